@@ -181,9 +181,7 @@ void FPNetworkControl::init(const char *ifname, devtype iftype) {
   }
 
   /* De-register existing callers */
-  while (this->callers.size() > 0) {
-    this->callers.pop_back();
-  }
+  this->callers.clear();
   return;
 }
 
@@ -318,9 +316,10 @@ bool FPNetworkControl::request_slots(size_t num_packets) {
 
 /* This method lets FPHosts register themselves in the network controller so
  * the controller can call them back every time a packet they are interested
- * in is captured.*/
+ * in is captured. Callers are indexed by target address so that captured
+ * packets can be dispatched without walking the whole list. */
 int FPNetworkControl::register_caller(FPHost *newcaller) {
-  this->callers.push_back(newcaller);
+  this->callers.insert(std::make_pair(*newcaller->getTargetAddress(), newcaller));
   return OP_SUCCESS;
 }
 
@@ -329,9 +328,12 @@ int FPNetworkControl::register_caller(FPHost *newcaller) {
  * the controller does not call them back again. This is called by hosts that
  * have already finished their OS detection. */
 int FPNetworkControl::unregister_caller(FPHost *oldcaller) {
-  for (size_t i = 0; i < this->callers.size(); i++) {
-    if (this->callers[i] == oldcaller) {
-      this->callers.erase(this->callers.begin() + i);
+  std::multimap<struct sockaddr_storage, FPHost *, lt_sockaddr_storage>::iterator it, end;
+
+  end = this->callers.upper_bound(*oldcaller->getTargetAddress());
+  for (it = this->callers.lower_bound(*oldcaller->getTargetAddress()); it != end; it++) {
+    if (it->second == oldcaller) {
+      this->callers.erase(it);
       return OP_SUCCESS;
     }
   }
@@ -484,7 +486,7 @@ void FPNetworkControl::response_reception_handler(nsock_pool nsp, nsock_event ns
   const u8 *rcvd_pkt = NULL;                    /* Points to the captured packet */
   size_t rcvd_pkt_len = 0;                      /* Length of the captured packet */
   struct timeval pcaptime;                    /* Time the packet was captured  */
-  struct sockaddr_storage sent_ss;
+  std::multimap<struct sockaddr_storage, FPHost *, lt_sockaddr_storage>::iterator caller;
   struct sockaddr_storage rcvd_ss;
   struct sockaddr_in *rcvd_ss4 = (struct sockaddr_in *)&rcvd_ss;
   struct sockaddr_in6 *rcvd_ss6 = (struct sockaddr_in6 *)&rcvd_ss;
@@ -524,42 +526,31 @@ void FPNetworkControl::response_reception_handler(nsock_pool nsp, nsock_event ns
           }
         }
 
-        /* Check if we have a caller that expects packets from this sender */
-        for (size_t i = 0; i < this->callers.size(); i++) {
-
-          /* Obtain the target address */
-          sent_ss = *this->callers[i]->getTargetAddress();
-
-          /* Check that the received packet is of the same address family */
-          if (sent_ss.ss_family != rcvd_ss.ss_family)
-            continue;
-
-          /* Check that the captured packet's source address matches the
-           * target address. If it matches, pass the received packet
-           * to the appropriate FPHost object through callback().  */
-          if (sockaddr_storage_equal(&rcvd_ss, &sent_ss)) {
-            if ((res = this->callers[i]->callback(rcvd_pkt, rcvd_pkt_len, &tv)) >= 0) {
-
-               /* If callback() returns >=0 it means that the packet we've just
-                * passed was successfully matched with a previous probe. Now
-                * update the count of received packets (so we can determine how
-                * many outstanding packets are out there). Note that we only do
-                * that if callback() returned >0 because 0 is a special case: a
-                * reply to a retransmitted timed probe that was already replied
-                * to in the past. We don't want to count replies to the same probe
-                * more than once, so that's why we only update when res > 0. */
-                if (res > 0)
-                  this->cc_update_received();
-
-               /* When the callback returns more than 1 it means that the packet
-                * was sent more than once before being answered. This means that
-                * we experienced congestion (first transmission got dropped), so
-                * we update our CC parameters to deal with the congestion. */
-                if (res > 1) {
-                  this->cc_report_drop();
-                }
-            }
-            return;
+        /* Check if we have a caller that expects packets from this sender.
+         * If it does, pass the received packet to the appropriate FPHost
+         * object through callback(). */
+        caller = this->callers.lower_bound(rcvd_ss);
+        if (caller != this->callers.end() && sockaddr_storage_equal(&caller->first, &rcvd_ss)) {
+          if ((res = caller->second->callback(rcvd_pkt, rcvd_pkt_len, &tv)) >= 0) {
+
+             /* If callback() returns >=0 it means that the packet we've just
+              * passed was successfully matched with a previous probe. Now
+              * update the count of received packets (so we can determine how
+              * many outstanding packets are out there). Note that we only do
+              * that if callback() returned >0 because 0 is a special case: a
+              * reply to a retransmitted timed probe that was already replied
+              * to in the past. We don't want to count replies to the same probe
+              * more than once, so that's why we only update when res > 0. */
+              if (res > 0)
+                this->cc_update_received();
+
+             /* When the callback returns more than 1 it means that the packet
+              * was sent more than once before being answered. This means that
+              * we experienced congestion (first transmission got dropped), so
+              * we update our CC parameters to deal with the congestion. */
+              if (res > 1) {
+                this->cc_report_drop();
+              }
           }
         }
       break;
@@ -848,13 +839,14 @@ static int vectorize_icmpv6_code(const PacketElement *pe) {
   return icmpv6->getCode();
 }
 
-static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
+/* Fills in features, an array of get_nr_feature(&FPModel) values, from the
+   responses in FPR. */
+static void vectorize(const FingerPrintResultsIPv6 *FPR, double *features) {
   const char * const IPV6_PROBE_NAMES[] = {"S1", "S2", "S3", "S4", "S5", "S6", "IE1", "IE2", "NS", "U1", "TECN", "T2", "T3", "T4", "T5", "T6", "T7"};
   const char * const TCP_PROBE_NAMES[] = {"S1", "S2", "S3", "S4", "S5", "S6", "TECN", "T2", "T3", "T4", "T5", "T6", "T7"};
   const char * const ICMPV6_PROBE_NAMES[] = {"IE1", "IE2", "NS"};
 
   unsigned int nr_feature, i, idx;
-  struct feature_node *features;
   std::map<std::string, FPPacket> resps;
 
   for (i = 0; i < NUM_FP_PROBES_IPv6; i++) {
@@ -869,24 +861,20 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
   }
 
   nr_feature = get_nr_feature(&FPModel);
-  features = new feature_node[nr_feature + 1];
-  for (i = 0; i < nr_feature; i++) {
-    features[i].index = i + 1;
-    features[i].value = -1;
-  }
-  features[i].index = -1;
+  for (i = 0; i < nr_feature; i++)
+    features[i] = -1;
 
   idx = 0;
   for (i = 0; i < NELEMS(IPV6_PROBE_NAMES); i++) {
     const char *probe_name;
 
     probe_name = IPV6_PROBE_NAMES[i];
-    features[idx++].value = vectorize_plen(resps[probe_name].getPacket());
-    features[idx++].value = vectorize_tc(resps[probe_name].getPacket());
-    features[idx++].value = vectorize_hlim(resps[probe_name].getPacket(), FPR->distance, FPR->distance_calculation_method);
+    features[idx++] = vectorize_plen(resps[probe_name].getPacket());
+    features[idx++] = vectorize_tc(resps[probe_name].getPacket());
+    features[idx++] = vectorize_hlim(resps[probe_name].getPacket(), FPR->distance, FPR->distance_calculation_method);
   }
   /* TCP features */
-  features[idx++].value = vectorize_isr(resps);
+  features[idx++] = vectorize_isr(resps);
   for (i = 0; i < NELEMS(TCP_PROBE_NAMES); i++) {
     const char *probe_name;
     const TCPHeader *tcp;
@@ -909,17 +897,17 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
       idx += 49;
       continue;
     }
-    features[idx++].value = tcp->getWindow();
+    features[idx++] = tcp->getWindow();
     flags = tcp->getFlags16();
     for (mask = 0x001; mask <= 0x800; mask <<= 1)
-      features[idx++].value = (flags & mask) != 0;
+      features[idx++] = (flags & mask) != 0;
 
     for (j = 0; j < 16; j++) {
       nping_tcp_opt_t opt;
       opt = tcp->getOption(j);
       if (opt.value == NULL)
         break;
-      features[idx++].value = opt.type;
+      features[idx++] = opt.type;
       /* opt.len includes the two (type, len) bytes. */
       if (opt.type == TCPOPT_MSS && opt.len == 4 && mss == -1)
         mss = ntohs(*(u16 *) opt.value);
@@ -936,26 +924,26 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
       opt = tcp->getOption(j);
       if (opt.value == NULL)
         break;
-      features[idx++].value = opt.len;
+      features[idx++] = opt.len;
     }
     for (; j < 16; j++)
       idx++;
 
-    features[idx++].value = mss;
-    features[idx++].value = sackok;
-    features[idx++].value = wscale;
+    features[idx++] = mss;
+    features[idx++] = sackok;
+    features[idx++] = wscale;
     if (mss != 0 && mss != -1)
-      features[idx++].value = (float)tcp->getWindow() / mss;
+      features[idx++] = (float)tcp->getWindow() / mss;
     else
-      features[idx++].value = -1;
+      features[idx++] = -1;
   }
   /* ICMPv6 features */
   for (i = 0; i < NELEMS(ICMPV6_PROBE_NAMES); i++) {
     const char *probe_name;
 
     probe_name = ICMPV6_PROBE_NAMES[i];
-    features[idx++].value = vectorize_icmpv6_type(resps[probe_name].getPacket());
-    features[idx++].value = vectorize_icmpv6_code(resps[probe_name].getPacket());
+    features[idx++] = vectorize_icmpv6_type(resps[probe_name].getPacket());
+    features[idx++] = vectorize_icmpv6_code(resps[probe_name].getPacket());
   }
 
   assert(idx == nr_feature);
@@ -963,23 +951,86 @@ static struct feature_node *vectorize(const FingerPrintResultsIPv6 *FPR) {
   if (o.debugging > 2) {
     log_write(LOG_PLAIN, "v = {");
     for (i = 0; i < nr_feature; i++)
-      log_write(LOG_PLAIN, "%.16g, ", features[i].value);
+      log_write(LOG_PLAIN, "%.16g, ", features[i]);
     log_write(LOG_PLAIN, "};\n");
   }
-
-  return features;
 }
 
-static void apply_scale(struct feature_node *features, unsigned int num_features,
+static void apply_scale(double *features, unsigned int num_features,
   const double (*scale)[2]) {
   unsigned int i;
 
   for (i = 0; i < num_features; i++) {
-    double val = features[i].value;
+    double val = features[i];
     if (val < 0)
       continue;
     val = (val + scale[i][0]) * scale[i][1];
-    features[i].value = val;
+    features[i] = val;
+  }
+}
+
+/* Features are scored in blocks of this many, so that the weights of a block
+   (a few tens of KB) stay in cache while every host of a batch is scored. */
+#define CLASSIFY_FEATURE_BLOCK 32
+
+/* Computes the decision values of a multi-class linear model for num_hosts
+   dense feature vectors at once: values[h * nr_class + i] is the value of
+   class i for the feature vector at features + h * nr_feature. This is the sum
+   liblinear's predict_values() computes from sparse feature_nodes, added up in
+   the same order (by feature) so that the results are identical. The sums of
+   eight classes at a time are kept in registers across a block of features;
+   the weights are stored by feature, so each step reads eight adjacent ones,
+   which the compiler can vectorize. */
+static void predict_values_batch(const struct model *model, const double *features,
+  unsigned int num_hosts, double *values) {
+  unsigned int nr_feature, nr_class, h, i, j, j0, j1;
+
+  nr_feature = get_nr_feature(model);
+  nr_class = get_nr_class(model);
+  assert(nr_class > 2 || model->param.solver_type == MCSVM_CS);
+
+  for (i = 0; i < num_hosts * nr_class; i++)
+    values[i] = 0;
+  for (j0 = 0; j0 < nr_feature; j0 = j1) {
+    j1 = MIN(j0 + CLASSIFY_FEATURE_BLOCK, nr_feature);
+    for (h = 0; h < num_hosts; h++) {
+      const double *x = features + h * nr_feature;
+      double *dec = values + h * nr_class;
+
+      for (i = 0; i + 8 <= nr_class; i += 8) {
+        double d0 = dec[i], d1 = dec[i + 1], d2 = dec[i + 2], d3 = dec[i + 3];
+        double d4 = dec[i + 4], d5 = dec[i + 5], d6 = dec[i + 6], d7 = dec[i + 7];
+
+        for (j = j0; j < j1; j++) {
+          const double *w = model->w + j * nr_class + i;
+          double v = x[j];
+
+          d0 += w[0] * v;
+          d1 += w[1] * v;
+          d2 += w[2] * v;
+          d3 += w[3] * v;
+          d4 += w[4] * v;
+          d5 += w[5] * v;
+          d6 += w[6] * v;
+          d7 += w[7] * v;
+        }
+        dec[i] = d0;
+        dec[i + 1] = d1;
+        dec[i + 2] = d2;
+        dec[i + 3] = d3;
+        dec[i + 4] = d4;
+        dec[i + 5] = d5;
+        dec[i + 6] = d6;
+        dec[i + 7] = d7;
+      }
+      for (; i < nr_class; i++) {
+        double d = dec[i];
+
+        for (j = j0; j < j1; j++)
+          d += model->w[j * nr_class + i] * x[j];
+        dec[i] = d;
+      }
+    }
   }
 }
 
@@ -1026,7 +1077,7 @@ int label_prob_cmp(const void *a, const void *b) {
    tend to make small differences count a lot (because we probably want this
    fingerprint in order to expand the class), while still allowing near-perfect
    matches to match. */
-static double novelty_of(const struct feature_node *features, int label) {
+static double novelty_of(const double *features, int label) {
   const double *means, *variances;
   int i, nr_feature;
   double sum;
@@ -1042,8 +1093,7 @@ static double novelty_of(const struct feature_node *features, int label) {
   for (i = 0; i < nr_feature; i++) {
     double d, v;
 
-    assert(i + 1 == features[i].index);
-    d = features[i].value - means[i];
+    d = features[i] - means[i];
     v = variances[i];
     if (v == 0.0) {
       /* No variance? It means that samples were identical. Substitute a default
@@ -1057,21 +1107,16 @@ static double novelty_of(const struct feature_node *features, int label) {
   return sqrt(sum);
 }
 
-static void classify(FingerPrintResultsIPv6 *FPR) {
+/* Fills in the matches of FPR from its scaled feature vector and the decision
+   values of the model for it. */
+static void classify(FingerPrintResultsIPv6 *FPR, const double *features,
+  const double *values) {
   int nr_class, i;
-  struct feature_node *features;
-  double *values;
   struct label_prob *labels;
 
   nr_class = get_nr_class(&FPModel);
-
-  features = vectorize(FPR);
-  values = new double[nr_class];
   labels = new struct label_prob[nr_class];
 
-  apply_scale(features, get_nr_feature(&FPModel), FPscale);
-
-  predict_values(&FPModel, features, values);
   for (i = 0; i < nr_class; i++) {
     labels[i].label = i;
     labels[i].prob = 1.0 / (1.0 + exp(-values[i]));
@@ -1112,11 +1157,31 @@ static void classify(FingerPrintResultsIPv6 *FPR) {
     FPR->num_perfect_matches = 0;
   }
 
-  delete[] features;
-  delete[] values;
   delete[] labels;
 }
 
+/* Classifies the fingerprints of a whole scan, scoring all of them against
+   the model in one batch. */
+static void classify_batch(const std::vector<FingerPrintResultsIPv6 *> &FPRs) {
+  unsigned int nr_feature, nr_class, h;
+
+  if (FPRs.empty())
+    return;
+
+  nr_feature = get_nr_feature(&FPModel);
+  nr_class = get_nr_class(&FPModel);
+  std::vector<double> features(FPRs.size() * nr_feature);
+  std::vector<double> values(FPRs.size() * nr_class);
+
+  for (h = 0; h < FPRs.size(); h++) {
+    vectorize(FPRs[h], &features[h * nr_feature]);
+    apply_scale(&features[h * nr_feature], nr_feature, FPscale);
+  }
+  predict_values_batch(&FPModel, &features[0], FPRs.size(), &values[0]);
+  for (h = 0; h < FPRs.size(); h++)
+    classify(FPRs[h], &features[h * nr_feature], &values[h * nr_class]);
+}
+
 
 /* This method is the core of the FPEngine class. It takes a list of IPv6
  * targets that need to be fingerprinted. The method handles the whole
@@ -1218,12 +1283,14 @@ int FPEngine6::os_scan(std::vector<Target *> &Targets) {
 
   /* Once we've finished with all fphosts, check which ones were correctly
    * fingerprinted, and update the Target objects. */
+  std::vector<FingerPrintResultsIPv6 *> FPRs;
   for (size_t i = 0; i < this->fphosts.size(); i++) {
     fphosts[i]->finish();
 
     fphosts[i]->fill_FPR((FingerPrintResultsIPv6 *) Targets[i]->FPR);
-    classify((FingerPrintResultsIPv6 *) Targets[i]->FPR);
+    FPRs.push_back((FingerPrintResultsIPv6 *) Targets[i]->FPR);
   }
+  classify_batch(FPRs);
 
   /* Cleanup and return */
   while (this->fphosts.size() > 0) {
@@ -1460,6 +1527,7 @@ FPHost6::~FPHost6() {
 
 void FPHost6::reset() {
   this->__reset();
+  this->probe_index.clear();
   for (unsigned int i = 0; i < NUM_FP_PROBES_IPv6; i++) {
       this->fp_probes[i].reset();
       if (this->fp_responses[i]) {
@@ -1486,6 +1554,7 @@ void FPHost6::init(Target *tgt, FPNetworkControl *fpnc) {
 
   /* Build the list of OS detection probes */
   this->build_probe_list();
+  this->index_probes();
 
   for (unsigned int i = 0; i < NUM_FP_PROBES_IPv6; i++)
     this->fp_responses[i] = NULL;
@@ -1911,6 +1980,52 @@ int FPHost6::build_probe_list() {
   return OP_SUCCESS;
 }
 
+/* Computes the key under which a probe, or a packet that may be a response to
+ * one, is dispatched to the probe it belongs to. The key combines the layer 4
+ * protocol with the field that tells our probes apart: the source port of TCP
+ * and UDP probes (destination port of their responses) and the sequence
+ * number of ICMPv6 echo requests and replies. ICMPv6 errors are keyed by the
+ * probe they carry. PacketParser::is_response() never matches packets whose
+ * keys differ. Returns false for packets that have no key. */
+static bool probe_dispatch_key(const PacketElement *pkt, bool response, u32 *key) {
+  /* Skip the link and network layers and any IPv6 extension headers. */
+  while (pkt != NULL && pkt->protocol_id() != HEADER_TYPE_TCP
+         && pkt->protocol_id() != HEADER_TYPE_UDP
+         && pkt->protocol_id() != HEADER_TYPE_ICMPv6)
+    pkt = pkt->getNextElement();
+  if (pkt == NULL)
+    return false;
+
+  if (pkt->protocol_id() == HEADER_TYPE_ICMPv6) {
+    const ICMPv6Header *icmp6 = (const ICMPv6Header *) pkt;
+
+    if (response && icmp6->isError())
+      return probe_dispatch_key(icmp6->getNextElement(), false, key);
+    if (icmp6->getType() != (response ? ICMPv6_ECHOREPLY : ICMPv6_ECHO))
+      return false;
+    *key = (HEADER_TYPE_ICMPv6 << 16) | (icmp6->getSequence() & 0xFFFF);
+  } else {
+    const TransportLayerElement *l4 = (const TransportLayerElement *) pkt;
+
+    *key = (pkt->protocol_id() << 16)
+      | (response ? l4->getDestinationPort() : l4->getSourcePort());
+  }
+  return true;
+}
+
+/* Stores every probe in probe_index under its dispatch key (see
+ * probe_dispatch_key()), so callback() can go straight to the probe that a
+ * captured packet may answer. */
+void FPHost6::index_probes() {
+  u32 key;
+
+  this->probe_index.clear();
+  for (unsigned int i = 0; i < this->total_probes; i++) {
+    if (probe_dispatch_key(this->fp_probes[i].getPacket(), false, &key))
+      this->probe_index[key] = i;
+  }
+}
+
 /* Indicates whether the OS detection process has finished for this host.
  * Note that when "true" is returned the caller cannot assume that the host
  * has been accurately fingerprinted, only that the OS detection process
@@ -2294,6 +2409,9 @@ int FPHost6::callback(const u8 *pkt, size_t pkt_len, const struct timeval *tv) {
   FPPacket dummy;
   bool match_found = false;
   int times_tx = 0;
+  unsigned int first = 0, last = this->probes_sent;
+  std::map<u32, unsigned int>::const_iterator probe;
+  u32 key;
 
   /* Make sure we still expect callbacks */
   if (this->detection_done)
@@ -2308,9 +2426,22 @@ int FPHost6::callback(const u8 *pkt, size_t pkt_len, const struct timeval *tv) {
     return -2;
   dummy.setPacket(rcvd);
 
-  /* Iterate over the list of sent probes and determine if the captured
+  /* If the packet carries the port or sequence number of one of our probes,
+   * that probe is the only one it can be a response to. Packets without such
+   * a key (neighbor advertisements, for instance) are checked against all. */
+  if (probe_dispatch_key(rcvd, true, &key)) {
+    probe = this->probe_index.find(key);
+    if (probe == this->probe_index.end()) {
+      first = last = 0;
+    } else {
+      first = probe->second;
+      last = MIN(probe->second + 1, this->probes_sent);
+    }
+  }
+
+  /* Iterate over the candidate sent probes and determine if the captured
    * packet is a response to one of them. */
-  for (unsigned int i = 0; i < this->probes_sent; i++) {
+  for (unsigned int i = first; i < last; i++) {
       /* Skip probes for which we already got a response */
       if (this->fp_responses[i])
           continue;
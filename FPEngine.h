@@ -68,7 +68,9 @@
 
 #include "nsock.h"
 #include <vector>
+#include <map>
 #include "libnetutil/npacket.h"
+#include "tcpip.h"
 
 /* Mention some classes here so we don't have to place the declarations in
  * the right order (otherwise the compiler complains). */
@@ -143,7 +145,8 @@ class FPNetworkControl {
   bool first_pcap_scheduled; /* True if we scheduled the first pcap read event.     */
   bool nsock_init;           /* True if the nsock pool has been initialized.        */
   int rawsd;                 /* Raw socket.                                         */
-  std::vector<FPHost *> callers;  /* List of users of this instance (used for callbacks).*/
+  /* Users of this instance, keyed by target address (used for callbacks). */
+  std::multimap<struct sockaddr_storage, FPHost *, lt_sockaddr_storage> callers;
   int probes_sent;           /* Number of unique probes sent (not retransmissions). */
   int responses_recv;        /* Number of probe responses received.                 */
   int probes_timedout;       /* Number of probes that timeout after all retransms.  */
@@ -379,8 +382,10 @@ class FPHost6 : public FPHost {
   FPProbe fp_probes[NUM_FP_PROBES_IPv6];         /* OS detection probes to be sent.*/
   FPResponse *fp_responses[NUM_FP_PROBES_IPv6];  /* Received responses.            */
   FPResponse *aux_resp[NUM_FP_TIMEDPROBES_IPv6]; /* Aux vector for timed responses */
+  std::map<u32, unsigned int> probe_index;       /* fp_probes index by dispatch key */
 
   int build_probe_list();
+  void index_probes();
   int set_done_and_wrap_up();
 
  public:
@@ -74,6 +74,10 @@ NmapOps o;
 
 NmapOps::NmapOps() {
   datadir = NULL;
+  versiondb_cache = NULL;
+  osdb_cache = NULL;
+  service_cache = NULL;
+  version_adaptive_stats = NULL;
   xsl_stylesheet = NULL;
   Initialize();
 }
@@ -125,6 +129,22 @@ NmapOps::~NmapOps() {
     free(datadir);
     datadir = NULL;
   }
+  if (versiondb_cache) {
+    free(versiondb_cache);
+    versiondb_cache = NULL;
+  }
+  if (osdb_cache) {
+    free(osdb_cache);
+    osdb_cache = NULL;
+  }
+  if (service_cache) {
+    free(service_cache);
+    service_cache = NULL;
+  }
+  if (version_adaptive_stats) {
+    free(version_adaptive_stats);
+    version_adaptive_stats = NULL;
+  }
 
 #ifndef NOLUA
   if (scriptversion || script)
@@ -280,6 +300,7 @@ void NmapOps::Initialize() {
   sctpinitscan = 0;
   sctpcookieechoscan = 0;
   append_output = false;
+  stream_hosts = false;
   memset(logfd, 0, sizeof(FILE *) * LOG_NUM_FILES);
   ttl = -1;
   badsum = false;
@@ -290,6 +311,17 @@ void NmapOps::Initialize() {
   adler32 = false;
   if (datadir) free(datadir);
   datadir = NULL;
+  if (versiondb_cache) free(versiondb_cache);
+  versiondb_cache = NULL;
+  if (osdb_cache) free(osdb_cache);
+  osdb_cache = NULL;
+  if (service_cache) free(service_cache);
+  service_cache = NULL;
+  service_cache_ttl = 7 * 24 * 60 * 60;
+  service_cache_verify = 0;
+  version_adaptive = false;
+  if (version_adaptive_stats) free(version_adaptive_stats);
+  version_adaptive_stats = NULL;
   xsl_stylesheet_set = false;
   if (xsl_stylesheet) free(xsl_stylesheet);
   xsl_stylesheet = NULL;
@@ -333,6 +365,7 @@ void NmapOps::Initialize() {
   proxy_chain = NULL;
   resuming = false;
   discovery_ignore_rst = false;
+  inline_discovery = false;
 }
 
 bool NmapOps::SCTPScan() {
@@ -422,6 +455,15 @@ administrator privileges.";
    fatal("ICMP Timestamp and Address Mask pings are only valid for IPv4.");
  }
 
+ if (inline_discovery) {
+   if (!synscan)
+     fatal("--inline-discovery requires a SYN scan (-sS)");
+   if (pingtype == PINGTYPE_NONE)
+     fatal("--inline-discovery cannot be combined with -Pn");
+   if (pingtype & (PINGTYPE_CONNECTTCP|PINGTYPE_UDP|PINGTYPE_PROTO|PINGTYPE_SCTP_INIT))
+     fatal("--inline-discovery only supports ICMP and TCP SYN/ACK host discovery probes");
+ }
+
  if (sendpref == PACKET_SEND_NOPREF) {
 #ifdef WIN32
    sendpref = PACKET_SEND_ETH_STRONG;
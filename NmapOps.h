@@ -288,11 +288,19 @@ class NmapOps {
   bool noresolve;
   bool noportscan;
   bool append_output; /* Append to any output files rather than overwrite */
+  bool stream_hosts; /* Output and free each host as soon as it is done */
   FILE *logfd[LOG_NUM_FILES];
   FILE *nmap_stdout; /* Nmap standard output */
   int ttl; // Time to live
   bool badsum;
   char *datadir;
+  char *versiondb_cache; /* --versiondb-cache file of compiled version regexes */
+  char *osdb_cache; /* --osdb-cache file of the prebuilt OS fingerprint index */
+  char *service_cache; /* --service-cache file of version detection results */
+  long service_cache_ttl; /* Seconds a service cache entry stays valid */
+  double service_cache_verify; /* Fraction of cache hits to scan anyway */
+  bool version_adaptive; /* Order version probes by how often they succeed */
+  char *version_adaptive_stats; /* File to keep those statistics in */
   /* A map from abstract data file names like "nmap-services" and "nmap-os-db"
      to paths which have been requested by the user. nmap_fetchfile will return
      the file names defined in this map instead of searching for a matching
@@ -330,6 +338,7 @@ class NmapOps {
 
   nsock_proxychain proxy_chain;
   bool discovery_ignore_rst; /* host discovery should not consider TCP RST packet responses as a live asset */
+  bool inline_discovery; /* do host discovery as part of the SYN scan */
 
 #ifndef NOLUA
   bool script;
@@ -86,6 +86,7 @@ Target::Target() {
   FPR = NULL;
   osscan_flag = OS_NOTPERF;
   weird_responses = flags = 0;
+  discovery_pending = false;
   traceroute_probespec.type = PS_NONE;
   memset(&to, 0, sizeof(to));
   memset(&targetsock, 0, sizeof(targetsock));
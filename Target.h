@@ -251,6 +251,9 @@ class Target {
 
   int weird_responses; /* echo responses from other addresses, Ie a network broadcast address */
   int flags; /* HOST_UNKNOWN, HOST_UP, or HOST_DOWN. */
+  /* Set while a target is only presumed up because its host discovery is
+     being done inline with the SYN scan (--inline-discovery). */
+  bool discovery_pending;
   struct timeout_info to;
   char *hostname; // Null if unable to resolve or unset
   char * targetname; // The name of the target host given on the command line if it is a named host
@@ -69,6 +69,7 @@
 #include "NmapOps.h"
 #include "nmap_error.h"
 #include "nmap.h"
+#include "nmap_dns.h"
 #include "libnetutil/netutil.h"
 
 #include <string>
@@ -113,6 +114,9 @@ public:
    * On error, return NULL. */
   virtual NetBlock *resolve() { return this; }
   virtual bool next(struct sockaddr_storage *ss, size_t *sslen) = 0;
+  /* Advance so that next() returns the first address after ss. Subclasses
+     that can't do better may leave this as a no-op. */
+  virtual void skip_past(const struct sockaddr_storage *ss) {}
   virtual void apply_netmask(int bits) = 0;
   virtual std::string str() const = 0;
 };
@@ -124,12 +128,16 @@ public:
   NetBlockIPv4Ranges();
 
   bool next(struct sockaddr_storage *ss, size_t *sslen);
+  void skip_past(const struct sockaddr_storage *ss);
   void apply_netmask(int bits);
   std::string str() const;
   void set_addr(const struct sockaddr_in *addr);
 
 private:
   unsigned int counter[4];
+
+  bool seek(unsigned int i, uint32_t addr, bool bound);
+  void finish();
 };
 
 class NetBlockIPv6Netmask : public NetBlock {
@@ -137,6 +145,7 @@ public:
   void set_addr(const struct sockaddr_in6 *addr);
 
   bool next(struct sockaddr_storage *ss, size_t *sslen);
+  void skip_past(const struct sockaddr_storage *ss);
   void apply_netmask(int bits);
   std::string str() const;
 
@@ -285,6 +294,37 @@ static NetBlock *parse_expr_without_netmask(const char *hostexp, int af) {
   return new NetBlockHostname(hostexp, af);
 }
 
+/* Returns true and sets hostname if target_expr names a host that will have to
+   be resolved, as decided by parse_expr_without_netmask, but without reporting
+   errors. */
+bool target_expr_hostname(const char *target_expr, int af, std::string &hostname) {
+  struct sockaddr_storage ss;
+  size_t sslen;
+  char *hostexp;
+  int bits;
+  bool is_name = true;
+
+  hostexp = split_netmask(target_expr, &bits);
+  if (hostexp == NULL)
+    return false;
+
+  if (af == AF_INET) {
+    octet_bitvector octets[4];
+
+    memset(octets, 0, sizeof(octets));
+    if (parse_ipv4_ranges(octets, hostexp) == 0)
+      is_name = false;
+  }
+  sslen = sizeof(ss);
+  if (is_name && resolve_numeric(hostexp, 0, &ss, &sslen, AF_INET6) == 0)
+    is_name = false;
+
+  if (is_name)
+    hostname = hostexp;
+  free(hostexp);
+  return is_name;
+}
+
 /* Parses an expression such as 192.168.0.0/16, 10.1.0-5.1-254, or
    fe80::202:e3ff:fe14:1102/112 and returns a newly allocated NetBlock. The af
    parameter is AF_INET or AF_INET6. Returns NULL in case of error. */
@@ -374,22 +414,77 @@ bool NetBlockIPv4Ranges::next(struct sockaddr_storage *ss, size_t *sslen) {
     if (!carry)
       break;
   }
-  if (i >= 4) {
-    if (o.resolve_all && !this->resolvedaddrs.empty() && current_addr != this->resolvedaddrs.end() && ++current_addr != this->resolvedaddrs.end()) {
-      this->set_addr((struct sockaddr_in *) &*current_addr);
-    }
-    else {
-      /* We cycled all counters. Mark them invalid for the next call. */
-      this->counter[0] = 256;
-      this->counter[1] = 256;
-      this->counter[2] = 256;
-      this->counter[3] = 256;
-    }
-  }
+  if (i >= 4)
+    this->finish();
 
   return true;
 }
 
+/* Called when the counters have cycled through every address: move on to the
+   next resolved address if any, otherwise mark the block exhausted. */
+void NetBlockIPv4Ranges::finish() {
+  if (o.resolve_all && !this->resolvedaddrs.empty() && current_addr != this->resolvedaddrs.end() && ++current_addr != this->resolvedaddrs.end()) {
+    this->set_addr((struct sockaddr_in *) &*current_addr);
+  }
+  else {
+    /* We cycled all counters. Mark them invalid for the next call. */
+    this->counter[0] = 256;
+    this->counter[1] = 256;
+    this->counter[2] = 256;
+    this->counter[3] = 256;
+  }
+}
+
+/* Set counters i through 3 to the smallest address in the block that is at
+   least addr. If bound is false, the higher octets are already greater than
+   those of addr, so just take the smallest value of each octet. Returns false
+   if there is no such address. */
+bool NetBlockIPv4Ranges::seek(unsigned int i, uint32_t addr, bool bound) {
+  unsigned int v;
+
+  if (i >= 4)
+    return true;
+
+  v = bound ? (addr >> (8 * (3 - i))) & 0xFF : 0;
+  if (bound && BIT_IS_SET(this->octets[i], v) && this->seek(i + 1, addr, true)) {
+    this->counter[i] = v;
+    return true;
+  }
+  if (bound)
+    v++;
+  while (v < 256 && !BIT_IS_SET(this->octets[i], v))
+    v++;
+  if (v >= 256)
+    return false;
+  this->counter[i] = v;
+  return this->seek(i + 1, addr, false);
+}
+
+void NetBlockIPv4Ranges::skip_past(const struct sockaddr_storage *ss) {
+  uint32_t addr, cur;
+  unsigned int i;
+
+  if (ss->ss_family != AF_INET)
+    return;
+  addr = ntohl(((const struct sockaddr_in *) ss)->sin_addr.s_addr);
+
+  /* Find the address next() would return, as it does. */
+  for (i = 0; i < 4; i++) {
+    while (this->counter[i] < 256 && !BIT_IS_SET(this->octets[i], this->counter[i]))
+      this->counter[i]++;
+    if (this->counter[i] >= 256)
+      return;
+  }
+  cur = (this->counter[0] << 24) | (this->counter[1] << 16) | (this->counter[2] << 8) | this->counter[3];
+  /* Nothing to skip if the block ends before it (for example, if we have
+     already moved on to another resolved address). */
+  if (cur > addr)
+    return;
+
+  if (addr == 0xFFFFFFFF || !this->seek(0, addr + 1, true))
+    this->finish();
+}
+
 /* Expand a single-octet bit vector to include any additional addresses that
    result when mask is applied. */
 static void apply_ipv4_netmask_octet(octet_bitvector bits, uint8_t mask) {
@@ -572,6 +667,29 @@ bool NetBlockIPv6Netmask::next(struct sockaddr_storage *ss, size_t *sslen) {
   return true;
 }
 
+void NetBlockIPv6Netmask::skip_past(const struct sockaddr_storage *ss) {
+  const struct in6_addr *last;
+  struct in6_addr next;
+
+  if (ss->ss_family != AF_INET6 || this->exhausted)
+    return;
+  last = &((const struct sockaddr_in6 *) ss)->sin6_addr;
+  /* Nothing to skip if the block ends before the next address. */
+  if (memcmp(last->s6_addr, this->cur.s6_addr, 16) < 0)
+    return;
+  if (memcmp(last->s6_addr, this->end.s6_addr, 16) >= 0) {
+    this->exhausted = true;
+    return;
+  }
+  next = *last;
+  for (int i = 15; i >= 0; i--) {
+    next.s6_addr[i]++;
+    if (next.s6_addr[i] > 0)
+      break;
+  }
+  this->cur = next;
+}
+
 /* Fill in an in6_addr with a CIDR-style netmask with the given number of bits. */
 static void make_ipv6_netmask(struct in6_addr *mask, int bits) {
   unsigned int i;
@@ -662,26 +780,35 @@ std::string NetBlockIPv6Netmask::str() const {
 
 NetBlock *NetBlockHostname::resolve() {
   struct addrinfo *addrs, *addr;
+  std::list<struct sockaddr_storage> found;
   std::list<struct sockaddr_storage> resolvedaddrs;
   std::list<struct sockaddr_storage> unscanned_addrs;
   NetBlock *netblock;
   struct sockaddr_storage ss;
   size_t sslen;
 
-  addrs = resolve_all(this->hostname.c_str(), AF_UNSPEC);
-  for (addr = addrs; addr != NULL; addr = addr->ai_next) {
-    if (addr->ai_addrlen < sizeof(ss)) {
-      memcpy(&ss, addr->ai_addr, addr->ai_addrlen);
-      if ((o.resolve_all || resolvedaddrs.empty()) && addr->ai_family == this->af) {
-        resolvedaddrs.push_back(ss);
-      }
-      else {
-        unscanned_addrs.push_back(ss);
+  /* Use the addresses from a parallel lookup made ahead of time if there was
+     one; otherwise ask the system resolver. */
+  if (!nmap_mass_dns_result(this->hostname, found)) {
+    addrs = resolve_all(this->hostname.c_str(), AF_UNSPEC);
+    for (addr = addrs; addr != NULL; addr = addr->ai_next) {
+      if (addr->ai_addrlen < sizeof(ss)) {
+        memcpy(&ss, addr->ai_addr, addr->ai_addrlen);
+        found.push_back(ss);
       }
     }
+    if (addrs != NULL)
+      freeaddrinfo(addrs);
+  }
+
+  for (std::list<struct sockaddr_storage>::const_iterator it = found.begin(); it != found.end(); ++it) {
+    if ((o.resolve_all || resolvedaddrs.empty()) && it->ss_family == this->af) {
+      resolvedaddrs.push_back(*it);
+    }
+    else {
+      unscanned_addrs.push_back(*it);
+    }
   }
-  if (addrs != NULL)
-    freeaddrinfo(addrs);
 
   if (resolvedaddrs.empty()) {
     if (unscanned_addrs.empty())
@@ -813,6 +940,13 @@ int TargetGroup::get_next_host(struct sockaddr_storage *ss, size_t *sslen) {
     return -1;
 }
 
+/* Skip ahead so that the next host returned is the first one after the given
+   address. */
+void TargetGroup::skip_past(const struct sockaddr_storage *ss) {
+  if (this->netblock != NULL)
+    this->netblock->skip_past(ss);
+}
+
 /* Returns true iff the given address is the one that was resolved to create
    this target group; i.e., not one of the addresses derived from it with a
    netmask. */
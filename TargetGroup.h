@@ -68,6 +68,7 @@
 #define TARGETGROUP_H
 
 #include <list>
+#include <string>
 #include <cstddef>
 
 class NetBlock;
@@ -91,6 +92,9 @@ public:
      fills in ss if successful.  ss must point to a pre-allocated
      sockaddr_storage structure */
   int get_next_host(struct sockaddr_storage *ss, std::size_t *sslen);
+  /* Skip ahead so that the next host returned is the first one after the
+     given address. Used to jump over excluded blocks. */
+  void skip_past(const struct sockaddr_storage *ss);
   /* Returns true iff the given address is the one that was resolved to create
      this target group; i.e., not one of the addresses derived from it with a
      netmask. */
@@ -104,5 +108,9 @@ public:
   int get_namedhost() const;
 };
 
+/* Returns true and sets hostname if the target expression names a host that
+   has to be resolved (as opposed to an address or range). */
+bool target_expr_hostname(const char *target_expr, int af, std::string &hostname);
+
 #endif /* TARGETGROUP_H */
 
@@ -484,75 +484,106 @@ int ip_is_reserved(struct in_addr *ip)
   return 0;
 }
 
-/* A trivial functon that maintains a cache of IP to MAC Address
-   entries.  If the command is MACCACHE_GET, this func looks for the
-   IPv4 address in ss and fills in the 'mac' parameter and returns
-   true if it is found.  Otherwise (not found), the function returns
-   false.  If the command is MACCACHE_SET, the function adds an entry
-   with the given ip (ss) and mac address.  An existing entry for the
-   IP ss will be overwritten with the new MAC address.  true is always
-   returned for the set command. */
-#define MACCACHE_GET 1
-#define MACCACHE_SET 2
-static int do_mac_cache(int command, const struct sockaddr_storage *ss, u8 *mac) {
-  struct MacCache {
-    struct sockaddr_storage ip;
-    u8 mac[6];
-  };
-  static struct MacCache *Cache = NULL;
-  static int MacCapacity = 0;
-  static int MacCacheSz = 0;
-  int i;
-
-  if (command == MACCACHE_GET) {
-    for (i = 0; i < MacCacheSz; i++) {
-      if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-        memcpy(mac, Cache[i].mac, 6);
-        return 1;
-      }
-    }
-    return 0;
+/* The cache of IP to MAC address entries behind mac_cache_get() and
+   mac_cache_set(). It is an open-addressing hash table with linear probing,
+   keyed on the address family and raw address bytes. The table is kept at
+   most half full and entries are never removed, so a probe stops at the
+   first empty slot. */
+struct mac_cache_entry {
+  u8 family; /* 0 for an empty slot */
+  u8 addr[IP6_ADDR_LEN];
+  u8 mac[6];
+};
+
+static struct mac_cache_entry *mac_cache = NULL;
+static unsigned int mac_cache_capacity = 0; /* Always a power of two */
+static unsigned int mac_cache_count = 0;
+
+/* Fills in the family and address of key from ss. Returns -1 for families
+   that can't be cached. */
+static int mac_cache_key(const struct sockaddr_storage *ss, struct mac_cache_entry *key) {
+  memset(key, 0, sizeof(*key));
+  if (ss->ss_family == AF_INET) {
+    key->family = AF_INET;
+    memcpy(key->addr, &((const struct sockaddr_in *) ss)->sin_addr.s_addr, IP_ADDR_LEN);
+  } else if (ss->ss_family == AF_INET6) {
+    key->family = AF_INET6;
+    memcpy(key->addr, ((const struct sockaddr_in6 *) ss)->sin6_addr.s6_addr, IP6_ADDR_LEN);
+  } else {
+    return -1;
   }
-  assert(command == MACCACHE_SET);
-  if (MacCacheSz == MacCapacity) {
-    if (MacCapacity == 0)
-      MacCapacity = 32;
-    else
-      MacCapacity <<= 2;
-    Cache = (struct MacCache *) safe_realloc(Cache, MacCapacity * sizeof(struct MacCache));
+
+  return 0;
+}
+
+/* Returns the slot holding key, or the empty slot where it belongs. */
+static struct mac_cache_entry *mac_cache_slot(struct mac_cache_entry *table,
+  unsigned int capacity, const struct mac_cache_entry *key) {
+  unsigned int h, i;
+
+  /* FNV-1a */
+  h = 2166136261U ^ key->family;
+  h *= 16777619U;
+  for (i = 0; i < sizeof(key->addr); i++) {
+    h ^= key->addr[i];
+    h *= 16777619U;
   }
 
-  /* Ensure that it isn't already there ... */
-  for (i = 0; i < MacCacheSz; i++) {
-    if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-      memcpy(Cache[i].mac, mac, 6);
-      return 1;
-    }
+  for (i = h & (capacity - 1); ; i = (i + 1) & (capacity - 1)) {
+    if (table[i].family == 0
+      || (table[i].family == key->family
+        && memcmp(table[i].addr, key->addr, sizeof(key->addr)) == 0))
+      return &table[i];
   }
+}
 
-  /* Add it to the end of the list */
-  memcpy(&Cache[i].ip, ss, sizeof(struct sockaddr_storage));
-  memcpy(Cache[i].mac, mac, 6);
-  MacCacheSz++;
-  return 1;
+static void mac_cache_grow(void) {
+  struct mac_cache_entry *old = mac_cache;
+  unsigned int oldcapacity = mac_cache_capacity;
+  unsigned int i;
+
+  mac_cache_capacity = oldcapacity == 0 ? 64 : oldcapacity * 2;
+  mac_cache = (struct mac_cache_entry *) safe_zalloc(mac_cache_capacity * sizeof(*mac_cache));
+  for (i = 0; i < oldcapacity; i++) {
+    if (old[i].family != 0)
+      *mac_cache_slot(mac_cache, mac_cache_capacity, &old[i]) = old[i];
+  }
+  free(old);
 }
 
 /* A couple of trivial functions that maintain a cache of IP to MAC
- * Address entries. Function mac_cache_get() looks for the IPv4 address
- * in ss and fills in the 'mac' parameter and returns true if it is
- * found.  Otherwise (not found), the function returns false.
- * Function mac_cache_set() adds an entry with the given ip (ss) and
- * mac address.  An existing entry for the IP ss will be overwritten
- * with the new MAC address.  mac_cache_set() always returns true.
- * WARNING: The caller must ensure that the supplied "ss" is of family
- * AF_INET. Otherwise the function will return 0 and there would be
- * no way for the caller to tell tell the difference between an error
- * or a cache miss.*/
+ * Address entries. Function mac_cache_get() looks for the IPv4 or IPv6
+ * address in ss and fills in the 'mac' parameter and returns true if it
+ * is found.  Otherwise (not found), the function returns
+ * false.  Function mac_cache_set() adds an entry with the given ip (ss)
+ * and mac address.  An existing entry for the IP ss will be overwritten
+ * with the new MAC address.  mac_cache_set() returns true unless ss is
+ * of a family other than AF_INET or AF_INET6. */
 int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac){
-    return do_mac_cache(MACCACHE_GET, ss, mac);
+  struct mac_cache_entry key, *e;
+
+  if (mac_cache == NULL || mac_cache_key(ss, &key) == -1)
+    return 0;
+  e = mac_cache_slot(mac_cache, mac_cache_capacity, &key);
+  if (e->family == 0)
+    return 0;
+  memcpy(mac, e->mac, 6);
+  return 1;
 }
 int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac){
-    return do_mac_cache(MACCACHE_SET, ss, mac);
+  struct mac_cache_entry key, *e;
+
+  if (mac_cache_key(ss, &key) == -1)
+    return 0;
+  if ((mac_cache_count + 1) * 2 > mac_cache_capacity)
+    mac_cache_grow();
+  e = mac_cache_slot(mac_cache, mac_cache_capacity, &key);
+  if (e->family == 0) {
+    *e = key;
+    mac_cache_count++;
+  }
+  memcpy(e->mac, mac, 6);
+  return 1;
 }
 
 /* Standard BSD internet checksum routine. Uses libdnet helper functions. */
@@ -3214,6 +3245,420 @@ static int route_dst_netlink(const struct sockaddr_storage *dst,
   }
 }
 
+/* Route lookup cache for route_dst_netlink. Asking the kernel costs a netlink
+   socket and a round trip per destination, which adds up when scanning large
+   networks. Instead, the destination prefixes of every route and routing rule
+   (in all tables) are loaded once. Two addresses whose longest matching prefix
+   is the same cannot be told apart by the kernel's route selection, so the
+   answer for the first address in each such prefix is reused for the rest.
+   A netlink socket subscribed to route, rule, address, and link changes tells
+   us when to throw everything away and start over. */
+struct route_cache_prefix {
+  int af;
+  int bits;
+  u8 addr[IP6_ADDR_LEN];
+  /* Set if some route with this prefix has several next hops, which the
+     kernel picks between per destination. */
+  int multipath;
+  /* Index into route_cache_results, or -1 if not looked up yet. */
+  int result;
+};
+
+struct route_cache_result {
+  int found;
+  struct interface_info ii;
+  struct sockaddr_storage srcaddr;
+  struct sockaddr_storage nexthop;
+};
+
+static int route_cache_disabled = 0;
+static int route_cache_notify_fd = -1;
+static struct route_cache_prefix *route_cache_prefixes = NULL;
+static int route_cache_numprefixes = 0;
+static int route_cache_prefixes_capacity = 0;
+/* Distinct prefix lengths for each family, longest first. */
+static int route_cache_lengths4[IP_ADDR_LEN * 8 + 1];
+static int route_cache_numlengths4 = 0;
+static int route_cache_lengths6[IP6_ADDR_LEN * 8 + 1];
+static int route_cache_numlengths6 = 0;
+static struct route_cache_result *route_cache_results = NULL;
+static int route_cache_numresults = 0;
+static int route_cache_results_capacity = 0;
+/* The device and spoofed source the cached results were looked up with. */
+static char route_cache_device[64];
+static struct sockaddr_storage route_cache_spoofss;
+
+static void route_cache_flush(void) {
+  free(route_cache_prefixes);
+  route_cache_prefixes = NULL;
+  route_cache_numprefixes = 0;
+  route_cache_prefixes_capacity = 0;
+  route_cache_numlengths4 = 0;
+  route_cache_numlengths6 = 0;
+  free(route_cache_results);
+  route_cache_results = NULL;
+  route_cache_numresults = 0;
+  route_cache_results_capacity = 0;
+}
+
+/* Opens the socket that gets notified of routing changes. Returns -1 if
+   notifications are not available, in which case nothing can be cached. */
+static int route_cache_subscribe(void) {
+  struct sockaddr_nl snl;
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd == -1)
+    return -1;
+
+  memset(&snl, 0, sizeof(snl));
+  snl.nl_family = AF_NETLINK;
+  snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE
+    | RTMGRP_IPV6_IFADDR | RTMGRP_IPV6_ROUTE
+    | (1 << (RTNLGRP_IPV4_RULE - 1)) | (1 << (RTNLGRP_IPV6_RULE - 1));
+  if (bind(fd, (struct sockaddr *) &snl, sizeof(snl)) == -1
+    || unblock_socket(fd) == -1) {
+    close(fd);
+    return -1;
+  }
+  route_cache_notify_fd = fd;
+
+  return 0;
+}
+
+/* Drains the notification socket. Returns nonzero if anything changed since
+   the last call, including notifications lost because the socket buffer
+   overflowed. */
+static int route_cache_changed(void) {
+  unsigned char buf[4096];
+  int changed = 0;
+  int n;
+
+  for (;;) {
+    n = recv(route_cache_notify_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n > 0 || (n == -1 && errno == ENOBUFS))
+      changed = 1;
+    else if (n == -1 && errno == EINTR)
+      continue;
+    else
+      break;
+  }
+
+  return changed;
+}
+
+/* Clears all but the first bits bits of addr. */
+static void route_cache_mask(u8 *addr, int addrlen, int bits) {
+  int i;
+
+  for (i = 0; i < addrlen; i++) {
+    if (bits >= (i + 1) * 8)
+      continue;
+    else if (bits <= i * 8)
+      addr[i] = 0;
+    else
+      addr[i] &= (u8) (0xff << ((i + 1) * 8 - bits));
+  }
+}
+
+static void route_cache_add_prefix(int af, int bits, const void *addr,
+                                   int multipath) {
+  struct route_cache_prefix *p;
+  int addrlen;
+
+  addrlen = (af == AF_INET) ? IP_ADDR_LEN : IP6_ADDR_LEN;
+  if (bits < 0 || bits > addrlen * 8)
+    return;
+
+  if (route_cache_numprefixes >= route_cache_prefixes_capacity) {
+    route_cache_prefixes_capacity = route_cache_prefixes_capacity * 2 + 64;
+    route_cache_prefixes = (struct route_cache_prefix *) safe_realloc(route_cache_prefixes,
+      route_cache_prefixes_capacity * sizeof(*route_cache_prefixes));
+  }
+  p = &route_cache_prefixes[route_cache_numprefixes++];
+  memset(p, 0, sizeof(*p));
+  p->af = af;
+  p->bits = bits;
+  if (addr != NULL)
+    memcpy(p->addr, addr, addrlen);
+  route_cache_mask(p->addr, addrlen, bits);
+  p->multipath = multipath;
+  p->result = -1;
+}
+
+/* Loads the destination prefixes of all routes (type RTM_GETROUTE) or all
+   routing rules (type RTM_GETRULE) of family af, from every table. Returns -1
+   on error. */
+static int route_cache_dump(int type, int af) {
+  struct sockaddr_nl snl;
+  struct {
+    struct nlmsghdr nlmsg;
+    struct rtmsg rtmsg;
+  } req;
+  unsigned char buf[16384];
+  int fd, done;
+  ssize_t len;
+
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd == -1)
+    return -1;
+
+  memset(&snl, 0, sizeof(snl));
+  snl.nl_family = AF_NETLINK;
+
+  /* A struct fib_rule_hdr has the same size as a struct rtmsg, and the family
+     and dst_len fields are in the same place, so one request and one parser
+     serve for both routes and rules. */
+  memset(&req, 0, sizeof(req));
+  req.nlmsg.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtmsg));
+  req.nlmsg.nlmsg_type = type;
+  req.nlmsg.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.nlmsg.nlmsg_seq = 1;
+  req.rtmsg.rtm_family = af;
+
+  if (sendto(fd, &req, req.nlmsg.nlmsg_len, 0, (struct sockaddr *) &snl, sizeof(snl)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  done = 0;
+  while (!done) {
+    struct nlmsghdr *nlmsg;
+
+    len = recv(fd, buf, sizeof(buf), 0);
+    if (len == -1 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      break;
+
+    for (nlmsg = (struct nlmsghdr *) buf; NLMSG_OK(nlmsg, (unsigned int) len);
+         nlmsg = NLMSG_NEXT(nlmsg, len)) {
+      struct rtmsg *rtmsg;
+      struct rtattr *rtattr;
+      const void *dst;
+      int multipath;
+      unsigned int attrlen;
+
+      if (nlmsg->nlmsg_type == NLMSG_DONE) {
+        done = 1;
+        break;
+      } else if (nlmsg->nlmsg_type == NLMSG_ERROR) {
+        close(fd);
+        return -1;
+      } else if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(*rtmsg))) {
+        continue;
+      }
+
+      rtmsg = (struct rtmsg *) NLMSG_DATA(nlmsg);
+      if (rtmsg->rtm_family != af)
+        continue;
+      dst = NULL;
+      multipath = 0;
+      attrlen = RTM_PAYLOAD(nlmsg);
+      for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, attrlen); rtattr = RTA_NEXT(rtattr, attrlen)) {
+        if (rtattr->rta_type == RTA_DST)
+          dst = RTA_DATA(rtattr);
+        else if (rtattr->rta_type == RTA_MULTIPATH && type == RTM_GETROUTE)
+          multipath = 1;
+      }
+      route_cache_add_prefix(af, rtmsg->rtm_dst_len, dst, multipath);
+    }
+  }
+
+  close(fd);
+
+  return done ? 0 : -1;
+}
+
+static int route_cache_prefixcmp(const void *a, const void *b) {
+  const struct route_cache_prefix *p1 = (const struct route_cache_prefix *) a;
+  const struct route_cache_prefix *p2 = (const struct route_cache_prefix *) b;
+
+  if (p1->af != p2->af)
+    return p1->af < p2->af ? -1 : 1;
+  if (p1->bits != p2->bits)
+    return p1->bits > p2->bits ? -1 : 1;
+  return memcmp(p1->addr, p2->addr, sizeof(p1->addr));
+}
+
+/* Loads the prefixes and indexes them for route_cache_find. Returns -1 on
+   error. */
+static int route_cache_build(void) {
+  static const u8 any[IP6_ADDR_LEN] = { 0 };
+  static const u8 mcast4[IP_ADDR_LEN] = { 224, 0, 0, 0 };
+  static const u8 bcast4[IP_ADDR_LEN] = { 255, 255, 255, 255 };
+  static const u8 mcast6[IP6_ADDR_LEN] = { 0xff, 0 };
+  static const u8 linklocal6[IP6_ADDR_LEN] = { 0xfe, 0x80, 0 };
+  int i, j;
+
+  if (route_cache_dump(RTM_GETROUTE, AF_INET) == -1
+    || route_cache_dump(RTM_GETRULE, AF_INET) == -1
+    || route_cache_dump(RTM_GETROUTE, AF_INET6) == -1
+    || route_cache_dump(RTM_GETRULE, AF_INET6) == -1) {
+    route_cache_flush();
+    return -1;
+  }
+
+  /* Addresses the kernel treats specially regardless of the routing table
+     get prefixes of their own. The zero-length prefixes catch everything
+     when there is no default route. */
+  route_cache_add_prefix(AF_INET, 0, any, 0);
+  route_cache_add_prefix(AF_INET, 8, any, 0);
+  route_cache_add_prefix(AF_INET, 4, mcast4, 0);
+  route_cache_add_prefix(AF_INET, 32, bcast4, 0);
+  route_cache_add_prefix(AF_INET6, 0, any, 0);
+  route_cache_add_prefix(AF_INET6, 8, mcast6, 0);
+  route_cache_add_prefix(AF_INET6, 10, linklocal6, 0);
+
+  qsort(route_cache_prefixes, route_cache_numprefixes,
+    sizeof(*route_cache_prefixes), route_cache_prefixcmp);
+
+  /* Merge duplicates. */
+  j = 0;
+  for (i = 0; i < route_cache_numprefixes; i++) {
+    if (j > 0 && route_cache_prefixcmp(&route_cache_prefixes[j - 1], &route_cache_prefixes[i]) == 0) {
+      route_cache_prefixes[j - 1].multipath |= route_cache_prefixes[i].multipath;
+      continue;
+    }
+    route_cache_prefixes[j++] = route_cache_prefixes[i];
+  }
+  route_cache_numprefixes = j;
+
+  for (i = 0; i < route_cache_numprefixes; i++) {
+    const struct route_cache_prefix *p = &route_cache_prefixes[i];
+
+    if (i > 0 && p->af == p[-1].af && p->bits == p[-1].bits)
+      continue;
+    if (p->af == AF_INET)
+      route_cache_lengths4[route_cache_numlengths4++] = p->bits;
+    else
+      route_cache_lengths6[route_cache_numlengths6++] = p->bits;
+  }
+
+  return 0;
+}
+
+/* Returns the longest prefix containing dst. There is always one, because of
+   the zero-length prefixes added by route_cache_build. */
+static struct route_cache_prefix *route_cache_find(const struct sockaddr_storage *dst) {
+  struct route_cache_prefix key;
+  const int *lengths;
+  int numlengths, addrlen, i;
+
+  memset(&key, 0, sizeof(key));
+  key.af = dst->ss_family;
+  if (dst->ss_family == AF_INET) {
+    addrlen = IP_ADDR_LEN;
+    lengths = route_cache_lengths4;
+    numlengths = route_cache_numlengths4;
+  } else {
+    addrlen = IP6_ADDR_LEN;
+    lengths = route_cache_lengths6;
+    numlengths = route_cache_numlengths6;
+  }
+
+  for (i = 0; i < numlengths; i++) {
+    struct route_cache_prefix *p;
+
+    key.bits = lengths[i];
+    if (dst->ss_family == AF_INET)
+      memcpy(key.addr, &((const struct sockaddr_in *) dst)->sin_addr.s_addr, addrlen);
+    else
+      memcpy(key.addr, ((const struct sockaddr_in6 *) dst)->sin6_addr.s6_addr, addrlen);
+    route_cache_mask(key.addr, addrlen, key.bits);
+    p = (struct route_cache_prefix *) bsearch(&key, route_cache_prefixes,
+      route_cache_numprefixes, sizeof(*route_cache_prefixes), route_cache_prefixcmp);
+    if (p != NULL)
+      return p;
+  }
+
+  return NULL;
+}
+
+/* route_dst_netlink, with answers remembered by route_cache_find prefix. */
+static int route_dst_netlink_cached(const struct sockaddr_storage *dst,
+                                    struct route_nfo *rnfo, const char *device,
+                                    const struct sockaddr_storage *spoofss) {
+  struct route_cache_prefix *p;
+  struct route_cache_result *r;
+  struct sockaddr_storage nospoof;
+  int rc;
+
+  if (route_cache_disabled)
+    return route_dst_netlink(dst, rnfo, device, spoofss);
+  /* An IPv6 source address is picked per destination (RFC 6724), so IPv6
+     results can only be shared when the source is fixed. A zone ID selects
+     the interface itself. */
+  if (dst->ss_family == AF_INET6) {
+    if (spoofss == NULL || ((const struct sockaddr_in6 *) dst)->sin6_scope_id != 0)
+      return route_dst_netlink(dst, rnfo, device, spoofss);
+  } else if (dst->ss_family != AF_INET) {
+    return route_dst_netlink(dst, rnfo, device, spoofss);
+  }
+
+  if (route_cache_notify_fd == -1 && route_cache_subscribe() == -1) {
+    route_cache_disabled = 1;
+    return route_dst_netlink(dst, rnfo, device, spoofss);
+  }
+
+  /* Results only hold for the device and source they were looked up with. */
+  if (device == NULL)
+    device = "";
+  if (spoofss == NULL) {
+    memset(&nospoof, 0, sizeof(nospoof));
+    nospoof.ss_family = AF_UNSPEC;
+  } else {
+    nospoof = *spoofss;
+  }
+  if (strcmp(device, route_cache_device) != 0
+    || memcmp(&nospoof, &route_cache_spoofss, sizeof(nospoof)) != 0) {
+    route_cache_flush();
+    Strncpy(route_cache_device, device, sizeof(route_cache_device));
+    route_cache_spoofss = nospoof;
+  }
+
+  if (route_cache_changed())
+    route_cache_flush();
+  if (route_cache_numprefixes == 0 && route_cache_build() == -1) {
+    route_cache_disabled = 1;
+    return route_dst_netlink(dst, rnfo, device, spoofss);
+  }
+
+  p = route_cache_find(dst);
+  if (p == NULL || p->multipath)
+    return route_dst_netlink(dst, rnfo, device, spoofss);
+
+  if (p->result != -1) {
+    r = &route_cache_results[p->result];
+    if (!r->found)
+      return 0;
+    rnfo->ii = r->ii;
+    rnfo->srcaddr = r->srcaddr;
+    rnfo->nexthop = r->nexthop;
+    rnfo->direct_connect = (r->nexthop.ss_family == AF_UNSPEC
+      || sockaddr_storage_equal(dst, &r->nexthop));
+    return 1;
+  }
+
+  rc = route_dst_netlink(dst, rnfo, device, spoofss);
+
+  if (route_cache_numresults >= route_cache_results_capacity) {
+    route_cache_results_capacity = route_cache_results_capacity * 2 + 16;
+    route_cache_results = (struct route_cache_result *) safe_realloc(route_cache_results,
+      route_cache_results_capacity * sizeof(*route_cache_results));
+  }
+  r = &route_cache_results[route_cache_numresults];
+  r->found = rc;
+  if (rc) {
+    r->ii = rnfo->ii;
+    r->srcaddr = rnfo->srcaddr;
+    r->nexthop = rnfo->nexthop;
+  }
+  p->result = route_cache_numresults++;
+
+  return rc;
+}
+
 #else
 
 static struct interface_info *find_loopback_iface(struct interface_info *ifaces,
@@ -3446,7 +3891,7 @@ static int route_dst_generic(const struct sockaddr_storage *dst,
 int route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo,
               const char *device, const struct sockaddr_storage *spoofss) {
 #ifdef HAVE_LINUX_RTNETLINK_H
-  return route_dst_netlink(dst, rnfo, device, spoofss);
+  return route_dst_netlink_cached(dst, rnfo, device, spoofss);
 #else
   return route_dst_generic(dst, rnfo, device, spoofss);
 #endif
@@ -4410,123 +4855,242 @@ int read_ns_reply_pcap(pcap_t *pd, u8 *sendermac,
 }
 
 
-/* Issues an Neighbor Solicitation for the MAC of targetss (which will be placed
-   in targetmac if obtained) from the source IP (srcip) and source mac
-   (srcmac) given.  "The request is ussued using device dev to the
-   multicast MAC address.  The transmission is attempted up to 3
-   times.  If none of these elicit a response, false will be returned.
-   If the mac is determined, true is returned. The last parameter is
-   a pointer to a callback function that can be used for packet tracing.
-   This is intended to be used by Nmap only. Any other calling this
-   should pass NULL instead. */
-bool doND(const char *dev, const u8 *srcmac,
-                  const struct sockaddr_storage *srcip,
-                   const struct sockaddr_storage *targetip,
-                   u8 *targetmac,
-                   void (*traceND_callback)(int, const u8 *, u32 , struct timeval *)
-                    ) {
+/* A target of doArpNDBatch, in the order used to look up replies. */
+struct neighbor_target {
+  const struct sockaddr_storage *ip;
+  int index;
+};
+
+static int neighbor_target_cmp(const void *a, const void *b) {
+  const struct neighbor_target *t1 = (const struct neighbor_target *) a;
+  const struct neighbor_target *t2 = (const struct neighbor_target *) b;
+
+  return sockaddr_storage_cmp(t1->ip, t2->ip);
+}
+
+/* Builds an ARP request or Neighbor Solicitation frame for targetip in frame
+   and returns its length. */
+static int build_neighbor_request(u8 *frame, const u8 *srcmac,
+  const struct sockaddr_storage *srcip, const struct sockaddr_storage *targetip) {
+  if (targetip->ss_family == AF_INET) {
+    const struct sockaddr_in *targetsin = (struct sockaddr_in *) targetip;
+    const struct sockaddr_in *srcsin = (struct sockaddr_in *) srcip;
+
+    eth_pack_hdr(frame, ETH_ADDR_BROADCAST, *srcmac, ETH_TYPE_ARP);
+    arp_pack_hdr_ethip(frame + ETH_HDR_LEN, ARP_OP_REQUEST, *srcmac,
+                       srcsin->sin_addr, ETH_ADDR_BROADCAST,
+                       targetsin->sin_addr);
+    return ETH_HDR_LEN + ARP_HDR_LEN + ARP_ETHIP_LEN;
+  } else {
+    const struct sockaddr_in6 *target_sin6 = (struct sockaddr_in6 *) targetip;
+    const struct sockaddr_in6 *src_sin6 = (struct sockaddr_in6 *) srcip;
+    struct sockaddr_in6 ns_dst_ip6;
+
+    /* Solicited-node multicast address and MAC. */
+    unsigned char ns_dst_mac[6] = {0x33, 0x33, 0xff};
+    ns_dst_mac[3] = target_sin6->sin6_addr.s6_addr[13];
+    ns_dst_mac[4] = target_sin6->sin6_addr.s6_addr[14];
+    ns_dst_mac[5] = target_sin6->sin6_addr.s6_addr[15];
+
+    ns_dst_ip6 = *target_sin6;
+    unsigned char multicast_prefix[13] = {0};
+    multicast_prefix[0] = 0xff;
+    multicast_prefix[1] = 0x02;
+    multicast_prefix[11] = 0x1;
+    multicast_prefix[12] = 0xff;
+    memcpy(ns_dst_ip6.sin6_addr.s6_addr, multicast_prefix, sizeof(multicast_prefix));
+
+    eth_pack_hdr(frame, *ns_dst_mac, *srcmac, ETH_TYPE_IPV6);
+    ip6_pack_hdr(frame + ETH_HDR_LEN, 0, 0, 32, 0x3a, 255, *src_sin6->sin6_addr.s6_addr, *ns_dst_ip6.sin6_addr.s6_addr);
+    icmpv6_pack_hdr_ns_mac(frame + ETH_HDR_LEN + IP6_HDR_LEN, target_sin6->sin6_addr.s6_addr, *srcmac);
+    ip6_checksum(frame + ETH_HDR_LEN, IP6_HDR_LEN + ICMPV6_HDR_LEN + 4 + 16 + 8);
+    return ETH_HDR_LEN + IP6_HDR_LEN + ICMPV6_HDR_LEN + 4 + 16 + 8;
+  }
+}
+
+/* Reads ARP or Neighbor Advertisement replies from pd for to_usec
+   microseconds, or until every target has been found, recording the MAC
+   address of each target that answers. If to_usec is 0, only the replies
+   that are already waiting are read. */
+static void neighbor_batch_listen(pcap_t *pd, int af, long to_usec,
+  const struct neighbor_target *sorted, int num_targets,
+  u8 *targetmacs, bool *found, int *numfound,
+  void (*trace_callback)(int, const u8 *, u32 , struct timeval *)) {
+  struct timeval start, now, rcvdtime;
+  struct sockaddr_storage rcvdIP;
+  struct neighbor_target key, *t;
+  u8 mac[6];
+  long timeleft;
+  int rc;
+
+  gettimeofday(&start, NULL);
+  key.ip = &rcvdIP;
+  while (*numfound < num_targets) {
+    gettimeofday(&now, NULL);
+    timeleft = to_usec - TIMEVAL_SUBTRACT(now, start);
+    if (timeleft < 0)
+      timeleft = 0;
+
+    memset(&rcvdIP, 0, sizeof(rcvdIP));
+    if (af == AF_INET) {
+      struct sockaddr_in *sin = (struct sockaddr_in *) &rcvdIP;
+
+      rc = read_arp_reply_pcap(pd, mac, &sin->sin_addr, timeleft,
+                               &rcvdtime, trace_callback);
+      sin->sin_family = AF_INET;
+    } else {
+      bool has_mac;
+
+      rc = read_ns_reply_pcap(pd, mac, (struct sockaddr_in6 *) &rcvdIP, timeleft,
+                              &rcvdtime, &has_mac, trace_callback);
+      if (rc == 1 && !has_mac)
+        continue;
+    }
+    if (rc == -1)
+      netutil_fatal("%s: Received -1 response from reply reader", __func__);
+    if (rc == 0)
+      break;
+
+    /* Yay, I got one! But is it one of ours? */
+    t = (struct neighbor_target *) bsearch(&key, sorted, num_targets,
+      sizeof(*sorted), neighbor_target_cmp);
+    if (t == NULL || found[t->index])
+      continue;
+    memcpy(targetmacs + 6 * t->index, mac, 6);
+    found[t->index] = true;
+    (*numfound)++;
+  }
+}
+
+/* Issues ARP requests (for IPv4) or Neighbor Solicitations (for IPv6) for the
+   MACs of the num_targets addresses in targetips, from the source IP (srcip)
+   and source mac (srcmac) given, using device dev and a single capture
+   handle. All the addresses must be of the same family as srcip. Requests
+   are sent to every unresolved target in turn, at most max_rate per second
+   (0 for no limit), and replies are collected while sending. Each target
+   is tried up to 3 times. When the MAC of targetips[i] is found, it is
+   placed in the 6 bytes at targetmacs + 6 * i and found[i] is set to true.
+   Returns the number of MACs found. The last parameter is a pointer to a
+   callback function that can be used for packet tracing. This is intended
+   to be used by Nmap only. Any other calling this should pass NULL
+   instead. */
+int doArpNDBatch(const char *dev, const u8 *srcmac,
+                 const struct sockaddr_storage *srcip,
+                 const struct sockaddr_storage *targetips, int num_targets,
+                 u8 *targetmacs, bool *found, double max_rate,
+                 void (*trace_callback)(int, const u8 *, u32 , struct timeval *)) {
   /* timeouts in microseconds ... the first ones are retransmit times, while
      the final one is when we give up */
-  int timeouts[] = { 100000, 400000, 800000 };
+  static const int timeouts[] = { 100000, 400000, 800000 };
   int max_sends = 3;
-  int num_sends = 0; // How many we have sent so far
+  int num_sends; // How many rounds we have sent so far
+  int numfound = 0;
+  struct neighbor_target *sorted;
   eth_t *ethsd;
   u8 frame[ETH_HDR_LEN + IP6_HDR_LEN + ICMPV6_HDR_LEN + 4 + 16 + 8];
-  struct timeval start, now, rcvdtime;
-  int timeleft;
-  int listenrounds;
-  int rc;
-  bool has_mac;
+  int framelen;
+  struct timeval now;
+  long send_gap;
   pcap_t *pd;
-  struct sockaddr_storage rcvdIP;
-  rcvdIP.ss_family = AF_INET6;
-  bool foundit = false;
   char filterstr[256];
-  struct sockaddr_in6 *target_sin6, *src_sin6;
-  struct sockaddr_in6 ns_dst_ip6;
-
-  if (targetip->ss_family != AF_INET6 || srcip->ss_family != AF_INET6)
-    netutil_fatal("%s can only handle IPv6 addresses", __func__);
-
-  target_sin6 = (struct sockaddr_in6 *) targetip;
-  src_sin6 = (struct sockaddr_in6 *) srcip;
-
-  unsigned char ns_dst_mac[6] = {0x33, 0x33, 0xff};
-  ns_dst_mac[3] = target_sin6->sin6_addr.s6_addr[13];
-  ns_dst_mac[4] = target_sin6->sin6_addr.s6_addr[14];
-  ns_dst_mac[5] = target_sin6->sin6_addr.s6_addr[15];
+  int af = srcip->ss_family;
+  int i, rc;
+
+  if (af != AF_INET && af != AF_INET6)
+    netutil_fatal("%s can only handle IPv4 and IPv6 addresses", __func__);
+  for (i = 0; i < num_targets; i++) {
+    if (targetips[i].ss_family != af)
+      netutil_fatal("%s: target address family does not match the source", __func__);
+    found[i] = false;
+  }
+  if (num_targets == 0)
+    return 0;
 
-  ns_dst_ip6 = *target_sin6;
-  unsigned char multicast_prefix[13] = {0};
-  multicast_prefix[0] = 0xff;
-  multicast_prefix[1] = 0x02;
-  multicast_prefix[11] = 0x1;
-  multicast_prefix[12] = 0xff;
-  memcpy(ns_dst_ip6.sin6_addr.s6_addr, multicast_prefix, sizeof(multicast_prefix));
+  sorted = (struct neighbor_target *) safe_malloc(num_targets * sizeof(*sorted));
+  for (i = 0; i < num_targets; i++) {
+    sorted[i].ip = &targetips[i];
+    sorted[i].index = i;
+  }
+  qsort(sorted, num_targets, sizeof(*sorted), neighbor_target_cmp);
 
   /* Start listening */
-  if((pd=my_pcap_open_live(dev, 100, 1, 25))==NULL)
-    netutil_fatal("my_pcap_open_live(%s, 50, 1, 25) failed three times.", dev);
-  /* Libpcap: IPv6 upper-layer protocol is not supported by proto[x] */
-  /* Grab the ICMPv6 type using ip6[X:Y] syntax. This works only if there are no
-     extension headers (top-level nh is IPPROTO_ICMPV6). */
-  Snprintf(filterstr, 256, "ether dst %02X%02X%02X%02X%02X%02X and icmp6 and ip6[6:1] = %u and ip6[40:1] = %u",
-           srcmac[0], srcmac[1], srcmac[2], srcmac[3], srcmac[4], srcmac[5],
-	   IPPROTO_ICMPV6, ICMPV6_NEIGHBOR_ADVERTISEMENT);
+  if (af == AF_INET) {
+    if((pd=my_pcap_open_live(dev, 50, 1, 25))==NULL)
+      netutil_fatal("my_pcap_open_live(%s, 50, 1, 25) failed three times.", dev);
+    Snprintf(filterstr, 256, "arp and arp[18:4] = 0x%02X%02X%02X%02X and arp[22:2] = 0x%02X%02X",
+             srcmac[0], srcmac[1], srcmac[2], srcmac[3], srcmac[4], srcmac[5]);
+  } else {
+    if((pd=my_pcap_open_live(dev, 100, 1, 25))==NULL)
+      netutil_fatal("my_pcap_open_live(%s, 100, 1, 25) failed three times.", dev);
+    /* Libpcap: IPv6 upper-layer protocol is not supported by proto[x] */
+    /* Grab the ICMPv6 type using ip6[X:Y] syntax. This works only if there are no
+       extension headers (top-level nh is IPPROTO_ICMPV6). */
+    Snprintf(filterstr, 256, "ether dst %02X%02X%02X%02X%02X%02X and icmp6 and ip6[6:1] = %u and ip6[40:1] = %u",
+             srcmac[0], srcmac[1], srcmac[2], srcmac[3], srcmac[4], srcmac[5],
+             IPPROTO_ICMPV6, ICMPV6_NEIGHBOR_ADVERTISEMENT);
+  }
   set_pcap_filter(dev, pd, filterstr);
 
-  /* Prepare probe and sending stuff */
   ethsd = eth_open_cached(dev);
   if (!ethsd)
     netutil_fatal("%s: failed to open device %s", __func__, dev);
-  eth_pack_hdr(frame, *ns_dst_mac, *srcmac, ETH_TYPE_IPV6);
-  ip6_pack_hdr(frame + ETH_HDR_LEN, 0, 0, 32, 0x3a, 255, *src_sin6->sin6_addr.s6_addr, *ns_dst_ip6.sin6_addr.s6_addr);
-  icmpv6_pack_hdr_ns_mac(frame + ETH_HDR_LEN + IP6_HDR_LEN, target_sin6->sin6_addr.s6_addr, *srcmac);
-  ip6_checksum(frame + ETH_HDR_LEN, IP6_HDR_LEN + ICMPV6_HDR_LEN + 4 + 16 + 8);
-
-  gettimeofday(&start, NULL);
-  gettimeofday(&now, NULL);
 
-  while (!foundit && num_sends < max_sends) {
-    /* Send the sucker */
-    rc = eth_send(ethsd, frame, sizeof(frame));
-    if (rc != sizeof(frame)) {
-     netutil_error("WARNING: %s: eth_send of Neighbor Solicitation packet returned %u rather than expected %d bytes", __func__, rc, (int) sizeof(frame));
-    }
-    if(traceND_callback!=NULL){
-        /* TODO: First parameter "1" is a hardcoded value for Nmap's PacketTrace::SENT*/
-        traceND_callback(1, (u8 *) frame + ETH_HDR_LEN, IP6_HDR_LEN + ICMPV6_HDR_LEN + 4 + 16 + 8, &now);
-    }
-    num_sends++;
-
-    listenrounds = 0;
-    while (!foundit) {
+  send_gap = max_rate > 0 ? (long) (1000000 / max_rate) : 0;
+  for (num_sends = 0; num_sends < max_sends && numfound < num_targets; num_sends++) {
+    for (i = 0; i < num_targets && numfound < num_targets; i++) {
+      if (found[i])
+        continue;
+      /* Send the sucker */
+      framelen = build_neighbor_request(frame, srcmac, srcip, &targetips[i]);
       gettimeofday(&now, NULL);
-      timeleft = timeouts[num_sends - 1] - TIMEVAL_SUBTRACT(now, start);
-      if (timeleft < 0) {
-        if (listenrounds > 0)
-          break;
-        else
-          timeleft = 25000;
+      rc = eth_send(ethsd, frame, framelen);
+      if (rc != framelen) {
+        netutil_error("WARNING: %s: eth_send of %s packet returned %u rather than expected %d bytes", __func__,
+                      af == AF_INET ? "ARP" : "Neighbor Solicitation", rc, framelen);
       }
-      listenrounds++;
-      /* Now listen until we reach our next timeout or get an answer */
-      rc = read_ns_reply_pcap(pd, targetmac, (struct sockaddr_in6 *) &rcvdIP, timeleft,
-                               &rcvdtime, &has_mac, traceND_callback);
-      if (rc == -1)
-        netutil_fatal("%s: Received -1 response from read_ns_reply_pcap", __func__);
-      if (rc == 1) {
-        /* Yay, I got one! But is it the right one? */
-        if (sockaddr_storage_cmp(&rcvdIP,targetip) != 0)
-          continue; /* D'oh! */
-        foundit = true; /* WOOHOO! */
+      if (trace_callback != NULL) {
+        /* TODO: First parameter "1" is a hardcoded value for Nmap's PacketTrace::SENT*/
+        trace_callback(1, (u8 *) frame + ETH_HDR_LEN, framelen - ETH_HDR_LEN, &now);
       }
+      /* Collect replies while waiting for the next send. */
+      neighbor_batch_listen(pd, af, send_gap, sorted, num_targets,
+                            targetmacs, found, &numfound, trace_callback);
     }
+
+    /* Now listen until we reach our next timeout or get all the answers */
+    neighbor_batch_listen(pd, af,
+      timeouts[num_sends] - (num_sends > 0 ? timeouts[num_sends - 1] : 0),
+      sorted, num_targets, targetmacs, found, &numfound, trace_callback);
   }
 
   /* OK - let's close up shop ... */
   pcap_close(pd);
   /* No need to close ethsd due to caching */
+  free(sorted);
+  return numfound;
+}
+
+/* Issues an Neighbor Solicitation for the MAC of targetss (which will be placed
+   in targetmac if obtained) from the source IP (srcip) and source mac
+   (srcmac) given.  "The request is ussued using device dev to the
+   multicast MAC address.  The transmission is attempted up to 3
+   times.  If none of these elicit a response, false will be returned.
+   If the mac is determined, true is returned. The last parameter is
+   a pointer to a callback function that can be used for packet tracing.
+   This is intended to be used by Nmap only. Any other calling this
+   should pass NULL instead. */
+bool doND(const char *dev, const u8 *srcmac,
+                  const struct sockaddr_storage *srcip,
+                   const struct sockaddr_storage *targetip,
+                   u8 *targetmac,
+                   void (*traceND_callback)(int, const u8 *, u32 , struct timeval *)
+                    ) {
+  bool foundit;
+
+  if (targetip->ss_family != AF_INET6 || srcip->ss_family != AF_INET6)
+    netutil_fatal("%s can only handle IPv6 addresses", __func__);
+
+  doArpNDBatch(dev, srcmac, srcip, targetip, 1, targetmac, &foundit, 0, traceND_callback);
   return foundit;
 }
 
@@ -4545,85 +5109,12 @@ bool doArp(const char *dev, const u8 *srcmac,
                   u8 *targetmac,
                   void (*traceArp_callback)(int, const u8 *, u32 , struct timeval *)
                   ) {
-  /* timeouts in microseconds ... the first ones are retransmit times, while
-     the final one is when we give up */
-  int timeouts[] = { 100000, 400000, 800000 };
-  int max_sends = 3;
-  int num_sends = 0; // How many we have sent so far
-  eth_t *ethsd;
-  u8 frame[ETH_HDR_LEN + ARP_HDR_LEN + ARP_ETHIP_LEN];
-  const struct sockaddr_in *targetsin = (struct sockaddr_in *) targetip;
-  const struct sockaddr_in *srcsin = (struct sockaddr_in *) srcip;
-  struct timeval start, now, rcvdtime;
-  int timeleft;
-  int listenrounds;
-  int rc;
-  pcap_t *pd;
-  struct in_addr rcvdIP;
-  bool foundit = false;
-  char filterstr[256];
+  bool foundit;
 
-  if (targetsin->sin_family != AF_INET || srcsin->sin_family != AF_INET)
+  if (targetip->ss_family != AF_INET || srcip->ss_family != AF_INET)
     netutil_fatal("%s can only handle IPv4 addresses", __func__);
 
-  /* Start listening */
-  if((pd=my_pcap_open_live(dev, 50, 1, 25))==NULL)
-    netutil_fatal("my_pcap_open_live(%s, 50, 1, 25) failed three times.", dev);
-  Snprintf(filterstr, 256, "arp and arp[18:4] = 0x%02X%02X%02X%02X and arp[22:2] = 0x%02X%02X",
-           srcmac[0], srcmac[1], srcmac[2], srcmac[3], srcmac[4], srcmac[5]);
-  set_pcap_filter(dev, pd, filterstr);
-
-  /* Prepare probe and sending stuff */
-  ethsd = eth_open_cached(dev);
-  if (!ethsd)
-    netutil_fatal("%s: failed to open device %s", __func__, dev);
-  eth_pack_hdr(frame, ETH_ADDR_BROADCAST, *srcmac, ETH_TYPE_ARP);
-  arp_pack_hdr_ethip(frame + ETH_HDR_LEN, ARP_OP_REQUEST, *srcmac,
-                     srcsin->sin_addr, ETH_ADDR_BROADCAST,
-                     targetsin->sin_addr);
-  gettimeofday(&start, NULL);
-  gettimeofday(&now, NULL);
-
-  while (!foundit && num_sends < max_sends) {
-    /* Send the sucker */
-    rc = eth_send(ethsd, frame, sizeof(frame));
-    if (rc != sizeof(frame)) {
-     netutil_error("WARNING: %s: eth_send of ARP packet returned %u rather than expected %d bytes", __func__, rc, (int) sizeof(frame));
-    }
-    if(traceArp_callback!=NULL){
-        /* TODO: First parameter "1" is a hardcoded value for Nmap's PacketTrace::SENT*/
-        traceArp_callback(1, (u8 *) frame + ETH_HDR_LEN, ARP_HDR_LEN + ARP_ETHIP_LEN, &now);
-    }
-    num_sends++;
-
-    listenrounds = 0;
-    while (!foundit) {
-      gettimeofday(&now, NULL);
-      timeleft = timeouts[num_sends - 1] - TIMEVAL_SUBTRACT(now, start);
-      if (timeleft < 0) {
-        if (listenrounds > 0)
-          break;
-        else
-          timeleft = 25000;
-      }
-      listenrounds++;
-      /* Now listen until we reach our next timeout or get an answer */
-      rc = read_arp_reply_pcap(pd, targetmac, &rcvdIP, timeleft,
-                               &rcvdtime, traceArp_callback);
-      if (rc == -1)
-        netutil_fatal("%s: Received -1 response from readarp_reply_pcap", __func__);
-      if (rc == 1) {
-        /* Yay, I got one! But is it the right one? */
-        if (rcvdIP.s_addr != targetsin->sin_addr.s_addr)
-          continue; /* D'oh! */
-        foundit = true; /* WOOHOO! */
-      }
-    }
-  }
-
-  /* OK - let's close up shop ... */
-  pcap_close(pd);
-  /* No need to close ethsd due to caching */
+  doArpNDBatch(dev, srcmac, srcip, targetip, 1, targetmac, &foundit, 0, traceArp_callback);
   return foundit;
 }
 
@@ -171,12 +171,14 @@ int ip_is_reserved(struct in_addr *ip);
 
 
 /* A couple of trivial functions that maintain a cache of IP to MAC
- * Address entries. Function mac_cache_get() looks for the IPv4 address
- * in ss and fills in the 'mac' parameter and returns true if it is
- * found.  Otherwise (not found), the function returns false.
- * Function mac_cache_set() adds an entry with the given ip (ss) and
- * mac address.  An existing entry for the IP ss will be overwritten
- * with the new MAC address.  mac_cache_set() always returns true. */
+ * Address entries. Function mac_cache_get() looks for the IPv4 or IPv6
+ * address in ss and fills in the 'mac' parameter and returns true if it
+ * is found.  Otherwise (not found), the function returns
+ * false.  Function mac_cache_set() adds an entry with the given ip (ss)
+ * and mac address.  An existing entry for the IP ss will be overwritten
+ * with the new MAC address.  mac_cache_set() returns true unless ss is
+ * of a family other than AF_INET or AF_INET6. Lookups take constant time
+ * on average. */
 int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac);
 int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac);
 
@@ -500,6 +502,24 @@ bool doND(const char *dev, const u8 *srcmac,
                    void (*traceArp_callback)(int, const u8 *, u32 , struct timeval *)
                     ) ;
 
+/* Issues ARP requests (for IPv4) or Neighbor Solicitations (for IPv6) for the
+   MACs of the num_targets addresses in targetips, from the source IP (srcip)
+   and source mac (srcmac) given, using device dev and a single capture
+   handle. All the addresses must be of the same family as srcip. Requests
+   are sent to every unresolved target in turn, at most max_rate per second
+   (0 for no limit), and replies are collected while sending. Each target
+   is tried up to 3 times. When the MAC of targetips[i] is found, it is
+   placed in the 6 bytes at targetmacs + 6 * i and found[i] is set to true.
+   Returns the number of MACs found. The last parameter is a pointer to a
+   callback function that can be used for packet tracing. This is intended
+   to be used by Nmap only. Any other calling this should pass NULL
+   instead. */
+int doArpNDBatch(const char *dev, const u8 *srcmac,
+                 const struct sockaddr_storage *srcip,
+                 const struct sockaddr_storage *targetips, int num_targets,
+                 u8 *targetmacs, bool *found, double max_rate,
+                 void (*trace_callback)(int, const u8 *, u32 , struct timeval *));
+
 /* Attempts to read one IPv4/Ethernet ARP reply packet from the pcap
    descriptor pd.  If it receives one, fills in sendermac (must pass
    in 6 bytes), senderIP, and rcvdtime (can be NULL if you don't care)
@@ -510,6 +510,15 @@ extern void addrset_print(FILE *fp, const struct addrset *set);
 extern int addrset_add_spec(struct addrset *set, const char *spec, int af, int dns);
 extern int addrset_add_file(struct addrset *set, FILE *fd, int af, int dns);
 extern int addrset_contains(const struct addrset *set, const struct sockaddr *sa);
+/* Like addrset_contains, but when sa is in the set and block_end is not NULL,
+   also stores the last address of the contiguous block of the set that
+   contains sa, so that a caller walking addresses in order can skip over it. */
+extern int addrset_contains_block(const struct addrset *set, const struct sockaddr *sa,
+                                  struct sockaddr_storage *block_end);
+/* Convert the specifications added so far into sorted interval arrays that are
+   matched by binary search. Call once the set is loaded; adding more
+   specifications afterwards is allowed. */
+extern void addrset_compile(struct addrset *set);
 
 #ifndef STDIN_FILENO
 #define STDIN_FILENO 0
@@ -122,12 +122,33 @@ struct addrset_elem {
   struct addrset_elem *next;
 };
 
+/* A closed interval of IPv4 addresses, in host byte order. */
+struct ipv4_interval {
+  u32 first;
+  u32 last;
+};
+
+/* A closed interval of 128-bit addresses, in the same representation as the
+   trie (IPv4 addresses are IPv4-mapped). */
+struct ipv6_interval {
+  u32 first[4];
+  u32 last[4];
+};
+
 /* A set of addresses. Used to match against allow/deny lists. */
 struct addrset {
     /* Linked list of struct addset_elem. */
     struct addrset_elem *head;
     /* Radix tree for faster matching of certain cases */
     struct trie_node *trie;
+    /* Sorted, non-overlapping intervals built by addrset_compile from the
+       addrset_elem list and the trie. Specifications added after compilation
+       go into the (emptied) list and trie as usual and are checked in addition
+       to these. */
+    struct ipv4_interval *ipv4;
+    size_t ipv4_count;
+    struct ipv6_interval *ipv6;
+    size_t ipv6_count;
 };
 
 /* Special node pointer to represent "all possible addresses"
@@ -139,6 +160,10 @@ struct addrset *addrset_new()
 {
     struct addrset *set = (struct addrset *) safe_zalloc(sizeof(struct addrset));
     set->head = NULL;
+    set->ipv4 = NULL;
+    set->ipv4_count = 0;
+    set->ipv6 = NULL;
+    set->ipv6_count = 0;
 
     /* Allocate the first node of the IPv4 trie */
     set->trie = (struct trie_node *) safe_zalloc(sizeof(struct trie_node));
@@ -180,6 +205,8 @@ void addrset_free(struct addrset *set)
     }
 
     trie_free(set->trie);
+    free(set->ipv4);
+    free(set->ipv6);
     free(set);
 }
 
@@ -404,9 +431,42 @@ static int sockaddr_to_addr(const struct sockaddr *sa, u32 *addr)
   return 1;
 }
 
-static int sockaddr_to_mask (const struct sockaddr *sa, int bits, u32 *mask)
+/* Fill in a 128-bit mask with the given number of leading one bits. */
+static void bits_to_mask (int bits, u32 *mask)
 {
   int i, k;
+  k = bits / 32;
+  for (i=0; i < 4; i++) {
+    if (i < k) {
+      mask[i] = 0xffffffff;
+    }
+    else if (i > k) {
+      mask[i] = 0;
+    }
+    else {
+      mask[i] = 0xfffffffe << (31 - bits % 32);
+    }
+  }
+}
+
+/* Count the leading one bits of a 128-bit mask. */
+static int mask_to_bits (const u32 *mask)
+{
+  int i, bits = 0;
+  u32 m;
+  for (i=0; i < 4; i++) {
+    for (m = mask[i]; m & 0x80000000; m <<= 1) {
+      bits++;
+    }
+    if (mask[i] != 0xffffffff) {
+      break;
+    }
+  }
+  return bits;
+}
+
+static int sockaddr_to_mask (const struct sockaddr *sa, int bits, u32 *mask)
+{
   if (bits >= 0) {
     if (sa->sa_family == AF_INET) {
       bits += 96;
@@ -422,18 +482,7 @@ static int sockaddr_to_mask (const struct sockaddr *sa, int bits, u32 *mask)
   }
   else
     bits = 128;
-  k = bits / 32;
-  for (i=0; i < 4; i++) {
-    if (i < k) {
-      mask[i] = 0xffffffff;
-    }
-    else if (i > k) {
-      mask[i] = 0;
-    }
-    else {
-      mask[i] = 0xfffffffe << (31 - bits % 32);
-    }
-  }
+  bits_to_mask(bits, mask);
   return 1;
 }
 
@@ -472,16 +521,21 @@ static void trie_insert (struct trie_node *this, const struct sockaddr *sa, int
   }
 }
 
-/* Helper for matching addresses */
-static int _trie_match (const struct trie_node *this, const u32 *addr)
+/* Helper for matching addresses. On a match, *bits is set to the length of
+   the matched prefix. */
+static int _trie_match (const struct trie_node *this, const u32 *addr, int *bits)
 {
+  /* The root node branches on the first bit. */
+  *bits = 1;
   while (this != TRIE_NODE_TRUE && this != NULL
     && addr_matches(this->mask, this->addr, addr)) {
     if (1 & this->mask[3]) {
       /* We've matched all possible bits! Yay! */
+      *bits = 128;
       return 1;
     }
-    else if (addr_next_bit_is_one(this->mask, addr)) {
+    *bits = mask_to_bits(this->mask) + 1;
+    if (addr_next_bit_is_one(this->mask, addr)) {
       this = this->next_bit_one;
     }
     else {
@@ -494,19 +548,14 @@ static int _trie_match (const struct trie_node *this, const u32 *addr)
   return 0;
 }
 
-static int trie_match (const struct trie_node *this, const struct sockaddr *sa)
+static int trie_match (const struct trie_node *this, const u32 *addr, int *bits)
 {
-  u32 addr[4] = {0};
-  if (!sockaddr_to_addr(sa, addr)) {
-    log_debug("Unknown address family %u, cannot match.\n", sa->sa_family);
-    return 0;
-  }
   /* Manually check first bit to decide which branch to match against */
   if (0x80000000 & addr[0]) {
-    return _trie_match(this->next_bit_one, addr);
+    return _trie_match(this->next_bit_one, addr, bits);
   }
   else {
-    return _trie_match(this->next_bit_zero, addr);
+    return _trie_match(this->next_bit_zero, addr, bits);
   }
   return 0;
 }
@@ -529,6 +578,16 @@ static void addrset_elem_print(FILE *fp, const struct addrset_elem *elem)
 void addrset_print(FILE *fp, const struct addrset *set)
 {
   const struct addrset_elem *elem;
+  size_t i;
+
+  for (i = 0; i < set->ipv4_count; i++) {
+    fprintf(fp, "ipv4_interval: %08X-%08X\n", set->ipv4[i].first, set->ipv4[i].last);
+  }
+  for (i = 0; i < set->ipv6_count; i++) {
+    fprintf(fp, "ipv6_interval: %08X%08X%08X%08X-%08X%08X%08X%08X\n",
+        set->ipv6[i].first[0], set->ipv6[i].first[1], set->ipv6[i].first[2], set->ipv6[i].first[3],
+        set->ipv6[i].last[0], set->ipv6[i].last[1], set->ipv6[i].last[2], set->ipv6[i].last[3]);
+  }
   for (elem = set->head; elem != NULL; elem = elem->next) {
     fprintf(fp, "addrset_elem: %p\n", elem);
     addrset_elem_print(fp, elem);
@@ -916,21 +975,444 @@ static int addrset_elem_match(const struct addrset_elem *elem, const struct sock
   return match_ipv4_bits(elem->ipv4.bits, sa);
 }
 
-int addrset_contains(const struct addrset *set, const struct sockaddr *sa)
+/* Specifications that would expand to more than this many intervals (like
+   "*.*.*.1") are left in the addrset_elem list by addrset_compile. */
+#define ADDRSET_MAX_ELEM_INTERVALS 65536
+
+static int octet_is_full(const octet_bitvector bits)
+{
+    const size_t num_bitvector = sizeof(octet_bitvector) / sizeof(bitvector_t);
+    size_t i;
+
+    for (i = 0; i < num_bitvector; i++) {
+        if (bits[i] != ~(bitvector_t) 0)
+            return 0;
+    }
+    return 1;
+}
+
+static size_t octet_count(const octet_bitvector bits)
+{
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        if (BIT_IS_SET(bits, i))
+            n++;
+    }
+    return n;
+}
+
+/* Count the runs of consecutive set bits in an octet bit vector. */
+static size_t octet_runs(const octet_bitvector bits)
+{
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        if (BIT_IS_SET(bits, i) && (i == 0 || !BIT_IS_SET(bits, i - 1)))
+            n++;
+    }
+    return n;
+}
+
+/* Return the index of the last octet of elem that does not allow every value,
+   or -1 if all of them do. Octets after it only widen the intervals. */
+static int elem_last_partial_octet(const struct addrset_elem *elem)
+{
+    int k;
+
+    for (k = 3; k >= 0; k--) {
+        if (!octet_is_full(elem->ipv4.bits[k]))
+            break;
+    }
+    return k;
+}
+
+/* Return the number of intervals elem expands to, stopping early once the
+   count exceeds ADDRSET_MAX_ELEM_INTERVALS. */
+static size_t elem_interval_count(const struct addrset_elem *elem)
+{
+    size_t n;
+    int i, k;
+
+    k = elem_last_partial_octet(elem);
+    if (k < 0)
+        return 1;
+    n = octet_runs(elem->ipv4.bits[k]);
+    for (i = 0; i < k && n <= ADDRSET_MAX_ELEM_INTERVALS; i++)
+        n *= octet_count(elem->ipv4.bits[i]);
+    return n;
+}
+
+static void ipv4_interval_append(struct ipv4_interval **v, size_t *count, size_t *cap,
+                                 u32 first, u32 last)
+{
+    if (*count >= *cap) {
+        *cap = *cap * 2 + 16;
+        *v = (struct ipv4_interval *) safe_realloc(*v, *cap * sizeof(**v));
+    }
+    (*v)[*count].first = first;
+    (*v)[*count].last = last;
+    (*count)++;
+}
+
+static void ipv6_interval_append(struct ipv6_interval **v, size_t *count, size_t *cap,
+                                 const u32 *first, const u32 *last)
+{
+    if (*count >= *cap) {
+        *cap = *cap * 2 + 16;
+        *v = (struct ipv6_interval *) safe_realloc(*v, *cap * sizeof(**v));
+    }
+    memcpy((*v)[*count].first, first, sizeof((*v)[*count].first));
+    memcpy((*v)[*count].last, last, sizeof((*v)[*count].last));
+    (*count)++;
+}
+
+/* Append the intervals of elem, for octets i through k (the last partial
+   octet), under the already-fixed high-order octets in prefix. */
+static void elem_to_intervals(const struct addrset_elem *elem, int i, int k, u32 prefix,
+                              struct ipv4_interval **v, size_t *count, size_t *cap)
+{
+    const int shift = 8 * (3 - i);
+    u32 a, b;
+
+    if (i < k) {
+        for (a = 0; a < 256; a++) {
+            if (BIT_IS_SET(elem->ipv4.bits[i], a))
+                elem_to_intervals(elem, i + 1, k, prefix | (a << shift), v, count, cap);
+        }
+        return;
+    }
+
+    /* Each run of the last partial octet is one interval. */
+    a = 0;
+    while (a < 256) {
+        while (a < 256 && !BIT_IS_SET(elem->ipv4.bits[i], a))
+            a++;
+        if (a >= 256)
+            break;
+        b = a;
+        while (b + 1 < 256 && BIT_IS_SET(elem->ipv4.bits[i], b + 1))
+            b++;
+        ipv4_interval_append(v, count, cap, prefix | (a << shift),
+            prefix | (b << shift) | ((1U << shift) - 1));
+        a = b + 1;
+    }
+}
+
+static void ipv6_prefix_append(const u32 *addr, int bits,
+                               struct ipv6_interval **v, size_t *count, size_t *cap)
+{
+    u32 mask[4], first[4], last[4];
+    u8 i;
+
+    bits_to_mask(bits, mask);
+    for (i = 0; i < 4; i++) {
+        first[i] = addr[i] & mask[i];
+        last[i] = addr[i] | ~mask[i];
+    }
+    ipv6_interval_append(v, count, cap, first, last);
+}
+
+/* Append the prefixes matched by the trie below node, in address order. */
+static void trie_to_intervals(const struct trie_node *node,
+                              struct ipv6_interval **v, size_t *count, size_t *cap)
+{
+    const struct trie_node *child;
+    u32 addr[4];
+    int bits, one;
+
+    if (node == NULL || node == TRIE_NODE_TRUE)
+        return;
+    if (1 & node->mask[3]) {
+        ipv6_prefix_append(node->addr, 128, v, count, cap);
+        return;
+    }
+    bits = mask_to_bits(node->mask);
+    for (one = 0; one < 2; one++) {
+        child = one ? node->next_bit_one : node->next_bit_zero;
+        if (child == TRIE_NODE_TRUE) {
+            /* Everything under this node's prefix plus the next bit. */
+            memcpy(addr, node->addr, sizeof(addr));
+            if (one)
+                addr[bits / 32] |= 0x80000000U >> (bits % 32);
+            else
+                addr[bits / 32] &= ~(0x80000000U >> (bits % 32));
+            ipv6_prefix_append(addr, bits + 1, v, count, cap);
+        } else {
+            trie_to_intervals(child, v, count, cap);
+        }
+    }
+}
+
+static int addr_cmp(const u32 *a, const u32 *b)
+{
+    u8 i;
+
+    for (i = 0; i < 4; i++) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Add one to a 128-bit address. Returns 0 if it wrapped around to zero. */
+static int addr_increment(u32 *a)
+{
+    int i;
+
+    for (i = 3; i >= 0; i--) {
+        if (++a[i] != 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int ipv4_interval_cmp(const void *a, const void *b)
+{
+    const struct ipv4_interval *x = (const struct ipv4_interval *) a;
+    const struct ipv4_interval *y = (const struct ipv4_interval *) b;
+
+    if (x->first != y->first)
+        return x->first < y->first ? -1 : 1;
+    return 0;
+}
+
+static int ipv6_interval_cmp(const void *a, const void *b)
+{
+    return addr_cmp(((const struct ipv6_interval *) a)->first,
+                    ((const struct ipv6_interval *) b)->first);
+}
+
+/* Sort intervals and merge the ones that overlap or touch. Returns the new
+   count. */
+static size_t ipv4_intervals_merge(struct ipv4_interval *v, size_t count)
+{
+    size_t i, n;
+
+    if (count == 0)
+        return 0;
+    qsort(v, count, sizeof(*v), ipv4_interval_cmp);
+    n = 0;
+    for (i = 1; i < count; i++) {
+        if (v[n].last == 0xffffffff || v[i].first <= v[n].last + 1) {
+            if (v[i].last > v[n].last)
+                v[n].last = v[i].last;
+        } else {
+            v[++n] = v[i];
+        }
+    }
+    return n + 1;
+}
+
+static size_t ipv6_intervals_merge(struct ipv6_interval *v, size_t count)
+{
+    u32 next[4];
+    size_t i, n;
+
+    if (count == 0)
+        return 0;
+    qsort(v, count, sizeof(*v), ipv6_interval_cmp);
+    n = 0;
+    for (i = 1; i < count; i++) {
+        memcpy(next, v[n].last, sizeof(next));
+        if (!addr_increment(next) || addr_cmp(v[i].first, next) <= 0) {
+            if (addr_cmp(v[i].last, v[n].last) > 0)
+                memcpy(v[n].last, v[i].last, sizeof(v[n].last));
+        } else {
+            v[++n] = v[i];
+        }
+    }
+    return n + 1;
+}
+
+void addrset_compile(struct addrset *set)
+{
+    struct addrset_elem *elem, **prev;
+    size_t cap;
+
+    /* IPv4 range specifications. */
+    cap = set->ipv4_count;
+    prev = &set->head;
+    while ((elem = *prev) != NULL) {
+        if (elem_interval_count(elem) > ADDRSET_MAX_ELEM_INTERVALS) {
+            prev = &elem->next;
+            continue;
+        }
+        elem_to_intervals(elem, 0, elem_last_partial_octet(elem), 0,
+            &set->ipv4, &set->ipv4_count, &cap);
+        *prev = elem->next;
+        free(elem);
+    }
+    set->ipv4_count = ipv4_intervals_merge(set->ipv4, set->ipv4_count);
+
+    /* Everything in the trie. The trie is emptied so that it only holds
+       specifications added after this point. */
+    cap = set->ipv6_count;
+    trie_to_intervals(set->trie, &set->ipv6, &set->ipv6_count, &cap);
+    trie_free(set->trie);
+    set->trie = (struct trie_node *) safe_zalloc(sizeof(struct trie_node));
+    set->ipv6_count = ipv6_intervals_merge(set->ipv6, set->ipv6_count);
+
+    if (set->ipv4_count > 0 || set->ipv6_count > 0) {
+        log_debug("Compiled addrset into %lu IPv4 and %lu IPv6 intervals.\n",
+            (unsigned long) set->ipv4_count, (unsigned long) set->ipv6_count);
+    }
+}
+
+/* Binary search for the interval containing addr. */
+static const struct ipv4_interval *ipv4_interval_find(const struct addrset *set, u32 addr)
+{
+    size_t lo = 0, hi = set->ipv4_count;
+
+    /* Find the first interval that starts after addr. */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->ipv4[mid].first <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && addr <= set->ipv4[lo - 1].last)
+        return &set->ipv4[lo - 1];
+    return NULL;
+}
+
+static const struct ipv6_interval *ipv6_interval_find(const struct addrset *set, const u32 *addr)
+{
+    size_t lo = 0, hi = set->ipv6_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (addr_cmp(set->ipv6[mid].first, addr) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && addr_cmp(addr, set->ipv6[lo - 1].last) <= 0)
+        return &set->ipv6[lo - 1];
+    return NULL;
+}
+
+/* Store the end of a matching block in block_end (a 128-bit address) if it is
+   further along than what is already there. */
+static void extend_block(u32 *block_end, const u32 *last)
+{
+    if (addr_cmp(last, block_end) > 0)
+        memcpy(block_end, last, 4 * sizeof(*last));
+}
+
+/* Convert a 128-bit block end back into a sockaddr of the same family as sa. */
+static void block_end_to_sockaddr(const struct sockaddr *sa, const u32 *last,
+                                  struct sockaddr_storage *ss)
+{
+    if (sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+        u32 a;
+
+        /* A block that goes past the IPv4-mapped range ends with the last
+           IPv4 address. */
+        if (last[0] == 0 && last[1] == 0 && last[2] == 0xffff)
+            a = last[3];
+        else
+            a = 0xffffffff;
+        memcpy(sin, sa, sizeof(*sin));
+        sin->sin_addr.s_addr = htonl(a);
+    }
+#ifdef HAVE_IPV6
+    else if (sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+        u8 i;
+
+        memcpy(sin6, sa, sizeof(*sin6));
+        for (i = 0; i < 4; i++) {
+            sin6->sin6_addr.s6_addr[i*4] = (last[i] >> 24) & 0xff;
+            sin6->sin6_addr.s6_addr[i*4+1] = (last[i] >> 16) & 0xff;
+            sin6->sin6_addr.s6_addr[i*4+2] = (last[i] >> 8) & 0xff;
+            sin6->sin6_addr.s6_addr[i*4+3] = last[i] & 0xff;
+        }
+    }
+#endif
+}
+
+int addrset_contains_block(const struct addrset *set, const struct sockaddr *sa,
+                           struct sockaddr_storage *block_end)
 {
     struct addrset_elem *elem;
+    u32 addr[4] = {0};
+    u32 last[4];
+    int found = 0;
+    int bits;
 
-    /* First check the trie. */
-    if (trie_match(set->trie, sa))
-      return 1;
+    if (!sockaddr_to_addr(sa, addr)) {
+      log_debug("Unknown address family %u, cannot match.\n", sa->sa_family);
+      return 0;
+    }
+    memcpy(last, addr, sizeof(last));
+
+    /* First check the compiled intervals. */
+    if (sa->sa_family == AF_INET) {
+      const struct ipv4_interval *iv = ipv4_interval_find(set, addr[3]);
+      if (iv != NULL) {
+        if (block_end == NULL)
+          return 1;
+        found = 1;
+        if (iv->last > last[3])
+          last[3] = iv->last;
+      }
+    }
+    {
+      const struct ipv6_interval *iv = ipv6_interval_find(set, addr);
+      if (iv != NULL) {
+        if (block_end == NULL)
+          return 1;
+        found = 1;
+        extend_block(last, iv->last);
+      }
+    }
+
+    /* Then the trie. */
+    if (trie_match(set->trie, addr, &bits)) {
+      u32 mask[4], end[4];
+      u8 i;
+
+      if (block_end == NULL)
+        return 1;
+      found = 1;
+      bits_to_mask(bits, mask);
+      for (i = 0; i < 4; i++)
+        end[i] = addr[i] | ~mask[i];
+      extend_block(last, end);
+    }
 
     /* If that didn't match, check the rest of the addrset_elem in order */
     if (sa->sa_family == AF_INET) {
       for (elem = set->head; elem != NULL; elem = elem->next) {
-        if (addrset_elem_match(elem, sa))
-          return 1;
+        if (addrset_elem_match(elem, sa)) {
+          u32 end[4];
+          u32 a;
+
+          if (block_end == NULL)
+            return 1;
+          found = 1;
+          /* The block extends through the run of the last octet. */
+          a = addr[3] & 0xff;
+          while (a < 255 && BIT_IS_SET(elem->ipv4.bits[3], a + 1))
+            a++;
+          memcpy(end, addr, sizeof(end));
+          end[3] = (addr[3] & ~0xffU) | a;
+          extend_block(last, end);
+        }
       }
     }
 
-    return 0;
+    if (found)
+      block_end_to_sockaddr(sa, last, block_end);
+    return found;
+}
+
+int addrset_contains(const struct addrset *set, const struct sockaddr *sa)
+{
+    return addrset_contains_block(set, sa, NULL);
 }
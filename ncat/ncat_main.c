@@ -827,6 +827,8 @@ int main(int argc, char *argv[])
     host_list_free(allow_host_list);
     host_list_to_set(o.denyset, deny_host_list);
     host_list_free(deny_host_list);
+    addrset_compile(o.allowset);
+    addrset_compile(o.denyset);
 
     if (optind == argc) {
 #if HAVE_SYS_UN_H
@@ -69,6 +69,7 @@ int main(int argc, char *argv[])
             exit(1);
         }
     }
+    addrset_compile(set);
 
     while (fgets(line, sizeof(line), stdin) != NULL) {
         char *s, *hostname;
@@ -199,6 +199,22 @@ EOF
 	| test_addrset "192.168.5,30,191.0/22" \
 "192.168.4.0 192.168.5.0 192.168.6.0 192.168.7.0 192.168.28.0 192.168.29.0 192.168.30.0 192.168.31.0 192.168.188.0 192.168.189.0 192.168.190.0 192.168.191.0"
 
+# Overlapping and adjacent ranges and netmasks, merged when compiled.
+(for a in `seq 0 15`; do echo 10.0.0.$a; echo 10.0.1.$a; done) \
+	| test_addrset "10.0.0.2-4 10.0.0.5 10.0.0.4-6 10.0.0.8/30 10.0.0.9-13 10.0.1,2.15" \
+"10.0.0.2 10.0.0.3 10.0.0.4 10.0.0.5 10.0.0.6 10.0.0.8 10.0.0.9 10.0.0.10 10.0.0.11 10.0.0.12 10.0.0.13 10.0.1.15"
+
+# Wildcard in the last octet, too wide to expand into intervals.
+test_addrset "*.*.*.7 1.2.3.4/31" "1.2.3.4 1.2.3.5 1.2.3.7 9.9.9.7" <<EOF
+1.2.3.3
+1.2.3.4
+1.2.3.5
+1.2.3.6
+1.2.3.7
+9.9.9.7
+9.9.9.8
+EOF
+
 # IPv6 CIDR netmask.
 test_addrset "1:2::0003/120" "1:2::3 1:2::0 1:2::ff" <<EOF
 1:2::3
@@ -91,6 +91,7 @@
 #include "xml.h"
 #include "scan_lists.h"
 #include "payload.h"
+#include "nmap_dns.h"
 
 #ifndef NOLUA
 #include "nse_main.h"
@@ -523,6 +524,13 @@ void parse_options(int argc, char **argv) {
     {"datadir", required_argument, 0, 0},
     {"servicedb", required_argument, 0, 0},
     {"versiondb", required_argument, 0, 0},
+    {"versiondb-cache", required_argument, 0, 0},
+    {"osdb-cache", required_argument, 0, 0},
+    {"service-cache", required_argument, 0, 0},
+    {"service-cache-ttl", required_argument, 0, 0},
+    {"service-cache-verify", required_argument, 0, 0},
+    {"version-adaptive", no_argument, 0, 0},
+    {"version-adaptive-stats", required_argument, 0, 0},
     {"debug", optional_argument, 0, 'd'},
     {"help", no_argument, 0, 'h'},
     {"iflist", no_argument, 0, 0},
@@ -563,6 +571,7 @@ void parse_options(int argc, char **argv) {
     {"proxies", required_argument, 0, 0},
     {"proxy", required_argument, 0, 0},
     {"discovery-ignore-rst", no_argument, 0, 0},
+    {"inline-discovery", no_argument, 0, 0},
     {"osscan-limit", no_argument, 0, 0}, /* skip OSScan if no open ports */
     {"osscan-guess", no_argument, 0, 0}, /* More guessing flexibility */
     {"fuzzy", no_argument, 0, 0}, /* Alias for osscan_guess */
@@ -583,6 +592,7 @@ void parse_options(int argc, char **argv) {
     {"unprivileged", no_argument, 0, 0},
     {"mtu", required_argument, 0, 0},
     {"append-output", no_argument, 0, 0},
+    {"stream-hosts", no_argument, 0, 0},
     {"noninteractive", no_argument, 0, 0},
     {"spoof-mac", required_argument, 0, 0},
     {"thc", no_argument, 0, 0},
@@ -752,8 +762,38 @@ void parse_options(int argc, char **argv) {
           o.fastscan = true;
         } else if (strcmp(long_options[option_index].name, "versiondb") == 0) {
           o.requested_data_files["nmap-service-probes"] = optarg;
+        } else if (strcmp(long_options[option_index].name, "versiondb-cache") == 0) {
+          if (o.versiondb_cache)
+            free(o.versiondb_cache);
+          o.versiondb_cache = strdup(optarg);
+        } else if (strcmp(long_options[option_index].name, "osdb-cache") == 0) {
+          if (o.osdb_cache)
+            free(o.osdb_cache);
+          o.osdb_cache = strdup(optarg);
+        } else if (strcmp(long_options[option_index].name, "service-cache") == 0) {
+          if (o.service_cache)
+            free(o.service_cache);
+          o.service_cache = strdup(optarg);
+        } else if (strcmp(long_options[option_index].name, "service-cache-ttl") == 0) {
+          d = tval2secs(optarg);
+          if (d < 0 || d > LONG_MAX)
+            fatal("Bogus --service-cache-ttl argument specified");
+          o.service_cache_ttl = (long) d;
+        } else if (strcmp(long_options[option_index].name, "service-cache-verify") == 0) {
+          o.service_cache_verify = atof(optarg);
+          if (o.service_cache_verify < 0 || o.service_cache_verify > 1)
+            fatal("--service-cache-verify must be between 0 and 1");
+        } else if (strcmp(long_options[option_index].name, "version-adaptive") == 0) {
+          o.version_adaptive = true;
+        } else if (strcmp(long_options[option_index].name, "version-adaptive-stats") == 0) {
+          if (o.version_adaptive_stats)
+            free(o.version_adaptive_stats);
+          o.version_adaptive_stats = strdup(optarg);
+          o.version_adaptive = true;
         } else if (strcmp(long_options[option_index].name, "append-output") == 0) {
           o.append_output = true;
+        } else if (strcmp(long_options[option_index].name, "stream-hosts") == 0) {
+          o.stream_hosts = true;
         } else if (strcmp(long_options[option_index].name, "noninteractive") == 0) {
           o.noninteractive = true;
         } else if (strcmp(long_options[option_index].name, "spoof-mac") == 0) {
@@ -806,6 +846,8 @@ void parse_options(int argc, char **argv) {
             fatal("Invalid proxy chain specification");
         } else if (strcmp(long_options[option_index].name, "discovery-ignore-rst") == 0) {
             o.discovery_ignore_rst = true;
+        } else if (strcmp(long_options[option_index].name, "inline-discovery") == 0) {
+          o.inline_discovery = true;
         } else if (strcmp(long_options[option_index].name, "osscan-limit")  == 0) {
           o.osscan_limit = true;
         } else if (strcmp(long_options[option_index].name, "osscan-guess")  == 0
@@ -1784,6 +1826,112 @@ void  apply_delayed_options() {
   }
 }
 
+/* After a SYN scan that did host discovery inline (--inline-discovery), report
+   and free the targets that never answered it, and look up the names of the
+   ones that did. */
+static void drop_undiscovered_targets(std::vector<Target *> &Targets) {
+  std::vector<Target *> up;
+  Target *currenths;
+  unsigned int targetno;
+
+  for (targetno = 0; targetno < Targets.size(); targetno++) {
+    currenths = Targets[targetno];
+    if ((currenths->flags & HOST_UP) && !currenths->discovery_pending) {
+      up.push_back(currenths);
+      continue;
+    }
+    currenths->flags = HOST_DOWN;
+    if (o.verbose && !o.openOnly()) {
+      xml_start_tag("host");
+      write_host_header(currenths);
+      xml_end_tag();
+      xml_newline();
+    }
+    delete currenths;
+    o.numhosts_up--;
+    o.numhosts_scanned++;
+  }
+  Targets.swap(up);
+  o.numhosts_scanning = Targets.size();
+
+  if (!o.noresolve && !o.always_resolve && !Targets.empty())
+    nmap_mass_rdns(&Targets[0], Targets.size());
+}
+
+/* Write the normal, machine and XML output for a host whose scan is
+   complete. */
+static void write_host_output(Target *currenths) {
+  char hostname[FQDN_LEN + 1] = "";
+
+  if (currenths->timedOut(NULL)) {
+    xml_open_start_tag("host");
+    xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
+    xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
+    xml_attribute("timedout", "true");
+    xml_close_start_tag();
+    write_host_header(currenths);
+    printtimes(currenths);
+    xml_end_tag(); /* host */
+    xml_newline();
+    log_write(LOG_PLAIN, "Skipping host %s due to host timeout\n",
+              currenths->NameIP(hostname, sizeof(hostname)));
+    log_write(LOG_MACHINE, "Host: %s (%s)\tStatus: Timeout\n",
+              currenths->targetipstr(), currenths->HostName());
+  } else {
+    /* --open means don't show any hosts without open ports. */
+    if (o.openOnly() && !currenths->ports.hasOpenPorts())
+      return;
+
+    xml_open_start_tag("host");
+    xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
+    xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
+    xml_close_start_tag();
+    write_host_header(currenths);
+    printportoutput(currenths, &currenths->ports);
+    printmacinfo(currenths);
+    printosscanoutput(currenths);
+    printserviceinfooutput(currenths);
+#ifndef NOLUA
+    printhostscriptresults(currenths);
+#endif
+    if (o.traceroute)
+      printtraceroute(currenths);
+    printtimes(currenths);
+    log_write(LOG_PLAIN | LOG_MACHINE, "\n");
+    xml_end_tag(); /* host */
+    xml_newline();
+  }
+}
+
+/* With --stream-hosts, write out and free the targets that no remaining phase
+   of the host group's scan will touch, instead of holding them until the
+   whole group is done. Timed-out hosts are skipped by every phase. If
+   open_ports_only is true, the phases left only look at ports that may be
+   open (version detection and version scripts), so hosts without any are
+   finished too. */
+static void release_finished_targets(std::vector<Target *> &Targets, bool open_ports_only) {
+  std::vector<Target *> remaining;
+  Target *currenths;
+  unsigned int targetno;
+
+  for (targetno = 0; targetno < Targets.size(); targetno++) {
+    currenths = Targets[targetno];
+    if (!currenths->timedOut(NULL) &&
+        (!open_ports_only || currenths->ports.hasOpenPorts())) {
+      remaining.push_back(currenths);
+      continue;
+    }
+    write_host_output(currenths);
+    delete currenths;
+    o.numhosts_scanned++;
+  }
+  if (remaining.size() == Targets.size())
+    return;
+  log_flush_all();
+  Targets.swap(remaining);
+  o.numhosts_scanning = Targets.size();
+}
+
 // Free some global memory allocations.
 // This is used for detecting memory leaks.
 void nmap_free_mem() {
@@ -1815,7 +1963,6 @@ int nmap_main(int argc, char *argv[]) {
   int sourceaddrwarning = 0; /* Have we warned them yet about unguessable
                                 source addresses? */
   unsigned int targetno;
-  char hostname[FQDN_LEN + 1] = "";
   struct sockaddr_storage ss;
   size_t sslen;
   int err;
@@ -2031,6 +2178,7 @@ int nmap_main(int argc, char *argv[]) {
   if (o.exclude_spec != NULL) {
     load_exclude_string(exclude_group, o.exclude_spec);
   }
+  addrset_compile(exclude_group);
 
   if (o.debugging > 3)
     dumpExclude(exclude_group);
@@ -2174,6 +2322,12 @@ int nmap_main(int argc, char *argv[]) {
       if (o.synscan)
         ultra_scan(Targets, &ports, SYN_SCAN);
 
+      if (o.inline_discovery) {
+        drop_undiscovered_targets(Targets);
+        if (Targets.empty())
+          continue;
+      }
+
       if (o.ackscan)
         ultra_scan(Targets, &ports, ACK_SCAN);
 
@@ -2227,19 +2381,47 @@ int nmap_main(int argc, char *argv[]) {
         }
       }
 
+      if (o.stream_hosts) {
+        /* Version detection and version scripts only look at ports that
+           may be open. */
+        bool svc_only = !o.osscan && !o.traceroute;
+#ifndef NOLUA
+        svc_only = svc_only && !o.script;
+#endif
+        release_finished_targets(Targets, svc_only);
+        if (Targets.empty())
+          continue;
+      }
+
       if (o.servicescan) {
         o.current_scantype = SERVICE_SCAN;
         service_scan(Targets);
+        if (o.stream_hosts) {
+          release_finished_targets(Targets, false);
+          if (Targets.empty())
+            continue;
+        }
       }
     }
 
     if (o.osscan) {
       OSScan os_engine;
       os_engine.os_scan(Targets);
+      if (o.stream_hosts) {
+        release_finished_targets(Targets, false);
+        if (Targets.empty())
+          continue;
+      }
     }
 
-    if (o.traceroute)
+    if (o.traceroute) {
       traceroute(Targets);
+      if (o.stream_hosts) {
+        release_finished_targets(Targets, false);
+        if (Targets.empty())
+          continue;
+      }
+    }
 
 #ifndef NOLUA
     if (o.script || o.scriptversion) {
@@ -2247,48 +2429,8 @@ int nmap_main(int argc, char *argv[]) {
     }
 #endif
 
-    for (targetno = 0; targetno < Targets.size(); targetno++) {
-      currenths = Targets[targetno];
-      /* Now I can do the output and such for each host */
-      if (currenths->timedOut(NULL)) {
-        xml_open_start_tag("host");
-        xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
-        xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
-        xml_attribute("timedout", "true");
-        xml_close_start_tag();
-        write_host_header(currenths);
-        printtimes(currenths);
-        xml_end_tag(); /* host */
-        xml_newline();
-        log_write(LOG_PLAIN, "Skipping host %s due to host timeout\n",
-                  currenths->NameIP(hostname, sizeof(hostname)));
-        log_write(LOG_MACHINE, "Host: %s (%s)\tStatus: Timeout\n",
-                  currenths->targetipstr(), currenths->HostName());
-      } else {
-        /* --open means don't show any hosts without open ports. */
-        if (o.openOnly() && !currenths->ports.hasOpenPorts())
-          continue;
-
-        xml_open_start_tag("host");
-        xml_attribute("starttime", "%lu", (unsigned long) currenths->StartTime());
-        xml_attribute("endtime", "%lu", (unsigned long) currenths->EndTime());
-        xml_close_start_tag();
-        write_host_header(currenths);
-        printportoutput(currenths, &currenths->ports);
-        printmacinfo(currenths);
-        printosscanoutput(currenths);
-        printserviceinfooutput(currenths);
-#ifndef NOLUA
-        printhostscriptresults(currenths);
-#endif
-        if (o.traceroute)
-          printtraceroute(currenths);
-        printtimes(currenths);
-        log_write(LOG_PLAIN | LOG_MACHINE, "\n");
-        xml_end_tag(); /* host */
-        xml_newline();
-      }
-    }
+    for (targetno = 0; targetno < Targets.size(); targetno++)
+      write_host_output(Targets[targetno]);
     log_flush_all();
 
     o.numhosts_scanned += Targets.size();
@@ -2319,6 +2461,11 @@ int nmap_main(int argc, char *argv[]) {
   if (o.inputfd != NULL)
     fclose(o.inputfd);
 
+  if (o.servicescan) {
+    save_service_cache();
+    save_probe_stats();
+  }
+
   printdatafilepaths();
 
   printfinaloutput();
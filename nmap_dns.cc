@@ -104,6 +104,10 @@
 // Created by Doug Hoyte <doug at hcsw.org> http://www.hcsw.org
 // DNS Caching and aging added by Eddie Bell ejlbell@gmail.com 2007
 // IPv6 and improved DNS cache by Gioacchino Mazzurco <gmazzurco89@gmail.com> 2015
+//
+// The same machinery also does forward lookups of target host names
+// (nmap_mass_dns()), sending an A and a AAAA query for each name. Names it
+// can't settle are left for the system resolver.
 
 
 // TODO:
@@ -132,6 +136,8 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <list>
+#include <map>
+#include <set>
 #include <vector>
 
 extern NmapOps o;
@@ -204,6 +210,7 @@ static int read_timeouts[][4] = {
 
 struct dns_server;
 struct request;
+struct forward_lookup;
 typedef struct sockaddr_storage sockaddr_storage;
 
 struct dns_server {
@@ -221,6 +228,10 @@ struct dns_server {
 
 struct request {
   Target *targ;
+  // For forward lookups, the name being resolved (targ is NULL) and whether
+  // this is the A or AAAA query for it.
+  forward_lookup *fwd;
+  DNS::RECORD_TYPE type;
   struct timeval timeout;
   int tries;
   int servers_tried;
@@ -229,6 +240,15 @@ struct request {
   u16 id;
 };
 
+// A host name being resolved by nmap_mass_dns(). It is failed if it has to be
+// left to the system resolver.
+struct forward_lookup {
+  std::string name;
+  std::list<sockaddr_storage> addrs4;
+  std::list<sockaddr_storage> addrs6;
+  bool failed;
+};
+
 /*keeps record of a request going through a particular DNS server
 helps in attaining faster lookup based on ID */
 struct info{
@@ -376,6 +396,14 @@ static nsock_pool dnspool=NULL;
 /* The DNS cache, not just for entries from /etc/hosts. */
 static HostCache host_cache;
 
+/* Host names that appear in /etc/hosts (in lower case). Forward lookups of
+   these are left to the system resolver, which gives them precedence. */
+static std::set<std::string> etchosts_names;
+
+/* Addresses found by nmap_mass_dns(), until nmap_mass_dns_result() takes
+   them. */
+static std::map<std::string, std::list<sockaddr_storage> > resolved_names;
+
 static int stat_actual, stat_ok, stat_nx, stat_sf, stat_trans, stat_dropped, stat_cname;
 static struct timeval starttv;
 static int read_timeout_index;
@@ -394,6 +422,12 @@ static void put_dns_packet_on_wire(request *req);
 
 //------------------- Misc code ---------------------
 
+static const char *request_name(const request *req) {
+  if (req->fwd != NULL)
+    return req->fwd->name.c_str();
+  return req->targ->targetipstr();
+}
+
 static void output_summary() {
   int tp = stat_ok + stat_nx + stat_dropped;
   struct timeval now;
@@ -448,7 +482,7 @@ static void do_possible_writes() {
 
       if (tpreq) {
         if (o.debugging >= TRACE_DEBUG_LEVEL)
-           log_write(LOG_STDOUT, "mass_rdns: TRANSMITTING for <%s> (server <%s>)\n", tpreq->targ->targetipstr() , servI->hostname.c_str());
+           log_write(LOG_STDOUT, "mass_rdns: TRANSMITTING for <%s> (server <%s>)\n", request_name(tpreq), servI->hostname.c_str());
         stat_trans++;
         put_dns_packet_on_wire(tpreq);
       }
@@ -485,7 +519,10 @@ static void put_dns_packet_on_wire(request *req) {
   req->curr_server->write_busy = 1;
   req->curr_server->reqs_on_wire++;
 
-  plen = DNS::Factory::buildReverseRequest(*req->targ->TargetSockAddr(), packet, maxlen);
+  if (req->fwd != NULL)
+    plen = DNS::Factory::buildSimpleRequest(req->fwd->name, req->type, packet, maxlen);
+  else
+    plen = DNS::Factory::buildReverseRequest(*req->targ->TargetSockAddr(), packet, maxlen);
 
   memcpy(&now, nsock_gettimeofday(), sizeof(struct timeval));
   TIMEVAL_MSEC_ADD(timeout, now, read_timeouts[read_timeout_index][req->tries]);
@@ -554,7 +591,7 @@ static int deal_with_timedout_reads() {
             // FIXME: Find a good compromise
 
             // **** We've already tried all servers... give up
-            if (o.debugging >= TRACE_DEBUG_LEVEL) log_write(LOG_STDOUT, "mass_rdns: *DR*OPPING <%s>\n", tpreq->targ->targetipstr());
+            if (o.debugging >= TRACE_DEBUG_LEVEL) log_write(LOG_STDOUT, "mass_rdns: *DR*OPPING <%s>\n", request_name(tpreq));
 
             output_summary();
             stat_dropped++;
@@ -562,6 +599,8 @@ static int deal_with_timedout_reads() {
             infoI = records.find(tpreq->id);
             if ( infoI != records.end() )
               records.erase(infoI);
+            if (tpreq->fwd != NULL)
+              tpreq->fwd->failed = true;
             delete tpreq;
 
             // **** OR We start at the back of this server's queue
@@ -584,6 +623,41 @@ static int deal_with_timedout_reads() {
 
 }
 
+// Once a response for the request in infoI has been dealt with, updates the
+// server's capacity and queues according to action.
+static void request_answered(std::map<u16, info>::iterator infoI, int action)
+{
+  request *tpreq = infoI->second.tpreq;
+  dns_server *server = infoI->second.server;
+
+  if (action == ACTION_SYSTEM_RESOLVE || action == ACTION_FINISHED)
+  {
+    server->capacity += CAPACITY_UP_STEP;
+    check_capacities(&*server);
+
+    records.erase(infoI);
+    server->in_process.remove(tpreq);
+    server->reqs_on_wire--;
+
+    total_reqs--;
+
+    if (action == ACTION_SYSTEM_RESOLVE) deferred_reqs.push_back(tpreq);
+    if (action == ACTION_FINISHED) delete tpreq;
+  }
+  else
+  {
+    memcpy(&tpreq->timeout, nsock_gettimeofday(), sizeof(struct timeval));
+    deal_with_timedout_reads();
+  }
+
+  do_possible_writes();
+
+  // Close DNS servers if we're all done so that we kill
+  // all events and return from nsock_loop immediateley
+  if (total_reqs == 0)
+    close_dns_servers();
+}
+
 // After processing a DNS response, we search through the IPs we're
 // looking for and update their results as necessary.
 // Returns non-zero if this matches a query we're looking for
@@ -591,53 +665,99 @@ static int process_result(const sockaddr_storage &ip, const std::string &result,
 {
   request *tpreq;
   std::map<u16, info>::iterator infoI;
-  dns_server *server;
 
   infoI = records.find(id);
 
   if( infoI != records.end() ){
 
     tpreq = infoI->second.tpreq;
-    server = infoI->second.server;
 
     if( !result.empty() && !sockaddr_storage_equal(&ip, tpreq->targ->TargetSockAddr()) )
       return 0;
 
-    if (action == ACTION_SYSTEM_RESOLVE || action == ACTION_FINISHED)
+    if ((action == ACTION_SYSTEM_RESOLVE || action == ACTION_FINISHED) && !result.empty())
     {
-      server->capacity += CAPACITY_UP_STEP;
-      check_capacities(&*server);
+      tpreq->targ->setHostName(result.c_str());
+      host_cache.add(* tpreq->targ->TargetSockAddr(), result);
+    }
 
-      if(!result.empty())
-      {
-        tpreq->targ->setHostName(result.c_str());
-        host_cache.add(* tpreq->targ->TargetSockAddr(), result);
-      }
+    request_answered(infoI, action);
+    return 1;
+  }
+  return 0;
+}
+
+// Case-insensitive comparison of domain names, ignoring a trailing dot.
+static bool dns_name_equal(const std::string &a, const std::string &b)
+{
+  size_t alen = a.size(), blen = b.size();
+
+  if (alen > 0 && a[alen - 1] == '.') alen--;
+  if (blen > 0 && b[blen - 1] == '.') blen--;
+  return alen == blen && strncasecmp(a.c_str(), b.c_str(), alen) == 0;
+}
 
-      records.erase(infoI);
-      server->in_process.remove(tpreq);
-      server->reqs_on_wire--;
+// Handles a response to one of the A or AAAA queries of nmap_mass_dns().
+// Every address record of the queried type in the answer section is taken,
+// which includes those at the end of a CNAME chain.
+static void process_forward_result(const DNS::Packet &p, std::map<u16, info>::iterator infoI)
+{
+  request *tpreq = infoI->second.tpreq;
+  forward_lookup *fwd = tpreq->fwd;
+  const u16 &f = p.flags;
+  size_t found = 0;
+
+  // Make sure the response is about what we asked.
+  if (!dns_name_equal(p.queries.front().name, fwd->name)
+      || p.queries.front().record_type != tpreq->type)
+    return;
 
-      total_reqs--;
+  if (DNS_HAS_ERR(f, DNS::ERR_SERVFAIL))
+  {
+    if (o.debugging >= TRACE_DEBUG_LEVEL)
+      log_write(LOG_STDOUT, "mass_dns: SERVFAIL <%s>\n", fwd->name.c_str());
+    stat_sf++;
+    request_answered(infoI, ACTION_TIMEOUT);
+    return;
+  }
 
-      if (action == ACTION_SYSTEM_RESOLVE) deferred_reqs.push_back(tpreq);
-      if (action == ACTION_FINISHED) delete tpreq;
+  if (DNS_HAS_ERR(f, DNS::ERR_NAME))
+  {
+    // The system resolver may still know the name, through the search
+    // domains in resolv.conf for example.
+    if (o.debugging >= TRACE_DEBUG_LEVEL)
+      log_write(LOG_STDOUT, "mass_dns: NXDOMAIN <%s>\n", fwd->name.c_str());
+    fwd->failed = true;
+    stat_nx++;
+  }
+  else
+  {
+    for (std::list<DNS::Answer>::const_iterator it = p.answers.begin();
+         it != p.answers.end(); ++it)
+    {
+      if (it->record_class != DNS::CLASS_IN || it->record_type != tpreq->type)
+        continue;
+      if (tpreq->type == DNS::A)
+        fwd->addrs4.push_back(static_cast<DNS::A_Record *>(it->record)->value);
+      else
+        fwd->addrs6.push_back(static_cast<DNS::AAAA_Record *>(it->record)->value);
+      found++;
     }
-    else
+    if (found > 0)
     {
-      memcpy(&tpreq->timeout, nsock_gettimeofday(), sizeof(struct timeval));
-      deal_with_timedout_reads();
+      if (o.debugging >= TRACE_DEBUG_LEVEL)
+        log_write(LOG_STDOUT, "mass_dns: OK MATCHED <%s> to %lu address%s\n",
+                  fwd->name.c_str(), (unsigned long) found, found == 1 ? "" : "es");
+      stat_ok++;
+    }
+    else if (DNS_HAS_FLAG(f, DNS::TRUNCATED))
+    {
+      fwd->failed = true;
     }
-
-    do_possible_writes();
-
-    // Close DNS servers if we're all done so that we kill
-    // all events and return from nsock_loop immediateley
-    if (total_reqs == 0)
-      close_dns_servers();
-    return 1;
   }
-  return 0;
+
+  output_summary();
+  request_answered(infoI, ACTION_FINISHED);
 }
 
 // Nsock read handler. One nsock read for each DNS server exists at each
@@ -671,6 +791,13 @@ static void read_evt_handler(nsock_pool nsp, nsock_event evt, void *) {
      DNS_HAS_ERR(f, DNS::ERR_NOT_IMPLEMENTED) || DNS_HAS_ERR(f, DNS::ERR_REFUSED))
     return;
 
+  std::map<u16, info>::iterator infoI = records.find(p.id);
+  if (infoI != records.end() && infoI->second.tpreq->fwd != NULL)
+  {
+    process_forward_result(p, infoI);
+    return;
+  }
+
   if (DNS_HAS_ERR(f, DNS::ERR_NAME))
   {
     sockaddr_storage discard;
@@ -1000,6 +1127,14 @@ static void parse_etchosts(const char *fname) {
       {
         const std::string hname_ = hname;
         host_cache.add(ia, hname_);
+
+        // Remember the name and all its aliases for forward lookups.
+        strtok(tp, " \t");
+        while ((tp = strtok(NULL, " \t")) != NULL) {
+          std::string name = tp;
+          std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+          etchosts_names.insert(name);
+        }
       }
   }
 
@@ -1059,6 +1194,49 @@ static void init_servs(void) {
 
 //------------------- Main loops ---------------------
 
+// Sends the requests in new_reqs to the DNS servers and processes responses
+// until every one of them is answered or dropped.
+static void do_requests(const char *spm_message) {
+  int timeout;
+
+  if ((dnspool = nsock_pool_new(NULL)) == NULL)
+    fatal("Unable to create nsock pool in %s()", __func__);
+
+  nmap_set_nsock_logger();
+  nmap_adjust_loglevel(o.packetTrace());
+
+  nsock_pool_set_device(dnspool, o.device);
+
+  if (o.proxy_chain)
+    nsock_pool_set_proxychain(dnspool, o.proxy_chain);
+
+  connect_dns_servers();
+
+  read_timeout_index = MIN(sizeof(read_timeouts)/sizeof(read_timeouts[0]), servs.size()) - 1;
+
+  SPM = new ScanProgressMeter(spm_message);
+
+  while (total_reqs > 0) {
+    timeout = deal_with_timedout_reads();
+
+    do_possible_writes();
+
+    if (total_reqs <= 0) break;
+
+    /* Because this can change with runtime interaction */
+    nmap_adjust_loglevel(o.packetTrace());
+
+    nsock_loop(dnspool, timeout);
+  }
+
+  SPM->endTask(NULL, NULL);
+  delete SPM;
+
+  close_dns_servers();
+
+  nsock_pool_delete(dnspool);
+}
+
 
 // Actual main loop
 static void nmap_mass_rdns_core(Target **targets, int num_targets) {
@@ -1066,7 +1244,6 @@ static void nmap_mass_rdns_core(Target **targets, int num_targets) {
   Target **hostI;
   std::list<request *>::iterator reqI;
   request *tpreq;
-  int timeout;
   const char *tpname;
   int i;
   char spmobuf[1024];
@@ -1102,6 +1279,7 @@ static void nmap_mass_rdns_core(Target **targets, int num_targets) {
 
     tpreq = new request;
     tpreq->targ = *hostI;
+    tpreq->fwd = NULL;
     tpreq->tries = 0;
     tpreq->servers_tried = 0;
 
@@ -1115,45 +1293,10 @@ static void nmap_mass_rdns_core(Target **targets, int num_targets) {
 
   // And finally, do it!
 
-  if ((dnspool = nsock_pool_new(NULL)) == NULL)
-    fatal("Unable to create nsock pool in %s()", __func__);
-
-  nmap_set_nsock_logger();
-  nmap_adjust_loglevel(o.packetTrace());
-
-  nsock_pool_set_device(dnspool, o.device);
-
-  if (o.proxy_chain)
-    nsock_pool_set_proxychain(dnspool, o.proxy_chain);
-
-  connect_dns_servers();
-
   deferred_reqs.clear();
 
-  read_timeout_index = MIN(sizeof(read_timeouts)/sizeof(read_timeouts[0]), servs.size()) - 1;
-
   Snprintf(spmobuf, sizeof(spmobuf), "Parallel DNS resolution of %d host%s.", stat_actual, stat_actual-1 ? "s" : "");
-  SPM = new ScanProgressMeter(spmobuf);
-
-  while (total_reqs > 0) {
-    timeout = deal_with_timedout_reads();
-
-    do_possible_writes();
-
-    if (total_reqs <= 0) break;
-
-    /* Because this can change with runtime interaction */
-    nmap_adjust_loglevel(o.packetTrace());
-
-    nsock_loop(dnspool, timeout);
-  }
-
-  SPM->endTask(NULL, NULL);
-  delete SPM;
-
-  close_dns_servers();
-
-  nsock_pool_delete(dnspool);
+  do_requests(spmobuf);
 
   if (deferred_reqs.size() && o.debugging)
     log_write(LOG_STDOUT, "Performing system-dns for %d domain names that were deferred\n", (int) deferred_reqs.size());
@@ -1275,6 +1418,96 @@ void nmap_mass_rdns(Target **targets, int num_targets) {
 }
 
 
+// Resolves a batch of host names in parallel, with an A and a AAAA query for
+// each, and keeps the addresses for nmap_mass_dns_result(). Names that are in
+// the hosts file, or that can't be settled with a plain answer from the
+// servers, are left for the system resolver.
+void nmap_mass_dns(const std::list<std::string> &names) {
+  static const DNS::RECORD_TYPE types[] = { DNS::A, DNS::AAAA };
+  std::list<forward_lookup> lookups;
+  std::list<forward_lookup>::iterator lookupI;
+  std::set<std::string> seen;
+  struct timeval now;
+  request *tpreq;
+  char spmobuf[1024];
+  unsigned int i;
+
+  if (!o.mass_dns)
+    return;
+
+  init_servs();
+  if (servs.size() == 0)
+    return;
+
+  etchosts_init();
+
+  gettimeofday(&starttv, NULL);
+  stat_actual = stat_ok = stat_nx = stat_sf = stat_trans = stat_dropped = stat_cname = 0;
+  total_reqs = 0;
+
+  for (std::list<std::string>::const_iterator nameI = names.begin(); nameI != names.end(); nameI++) {
+    std::string lower = *nameI;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (etchosts_names.count(lower) > 0 || resolved_names.count(*nameI) > 0
+        || !seen.insert(*nameI).second)
+      continue;
+
+    lookups.push_back(forward_lookup());
+    lookups.back().name = *nameI;
+    lookups.back().failed = false;
+
+    for (i = 0; i < sizeof(types) / sizeof(*types); i++) {
+      tpreq = new request;
+      tpreq->targ = NULL;
+      tpreq->fwd = &lookups.back();
+      tpreq->type = types[i];
+      tpreq->tries = 0;
+      tpreq->servers_tried = 0;
+
+      new_reqs.push_back(tpreq);
+
+      stat_actual++;
+      total_reqs++;
+    }
+  }
+
+  if (total_reqs == 0)
+    return;
+
+  Snprintf(spmobuf, sizeof(spmobuf), "Parallel DNS resolution of %lu host name%s.",
+           (unsigned long) lookups.size(), lookups.size() == 1 ? "" : "s");
+  do_requests(spmobuf);
+
+  for (lookupI = lookups.begin(); lookupI != lookups.end(); lookupI++) {
+    if (lookupI->failed || (lookupI->addrs4.empty() && lookupI->addrs6.empty()))
+      continue;
+    std::list<sockaddr_storage> &addrs = resolved_names[lookupI->name];
+    addrs.splice(addrs.end(), lookupI->addrs4);
+    addrs.splice(addrs.end(), lookupI->addrs6);
+  }
+
+  gettimeofday(&now, NULL);
+  if (o.debugging || o.verbose >= 3) {
+    log_write(LOG_STDOUT, "DNS resolution of %lu names took %.2fs. Mode: Async [#: %lu, OK: %d, NX: %d, DR: %d, SF: %d, TR: %d]\n",
+              (unsigned long) lookups.size(), TIMEVAL_MSEC_SUBTRACT(now, starttv) / 1000.0,
+              (unsigned long) servs.size(), stat_ok, stat_nx, stat_dropped, stat_sf, stat_trans);
+  }
+}
+
+// Takes the addresses found for name by nmap_mass_dns(). Returns false if
+// there are none, in which case the name should be given to the system
+// resolver.
+bool nmap_mass_dns_result(const std::string &name, std::list<struct sockaddr_storage> &addrs) {
+  std::map<std::string, std::list<sockaddr_storage> >::iterator it;
+
+  it = resolved_names.find(name);
+  if (it == resolved_names.end())
+    return false;
+  addrs.swap(it->second);
+  resolved_names.erase(it);
+  return true;
+}
+
 // Returns a list of known DNS servers
 std::list<std::string> get_dns_servers() {
   init_servs();
@@ -1578,6 +1811,19 @@ size_t DNS::A_Record::parseFromBuffer(const u8 *buf, size_t offset, size_t maxle
   return ret;
 }
 
+size_t DNS::AAAA_Record::parseFromBuffer(const u8 *buf, size_t offset, size_t maxlen)
+{
+  if (!buf || maxlen < offset + 16)
+    return 0;
+
+  memset(&value, 0, sizeof(value));
+  struct sockaddr_in6 * ip6addr = (sockaddr_in6 *) &value;
+  ip6addr->sin6_family = AF_INET6;
+  memcpy(ip6addr->sin6_addr.s6_addr, buf + offset, 16);
+
+  return 16;
+}
+
 size_t DNS::Query::parseFromBuffer(const u8 *buf, size_t offset, size_t maxlen)
 {
   size_t ret=0;
@@ -1615,6 +1861,11 @@ size_t DNS::Answer::parseFromBuffer(const u8 *buf, size_t offset, size_t maxlen)
       record = new A_Record();
       break;
     }
+    case AAAA:
+    {
+      record = new AAAA_Record();
+      break;
+    }
     case CNAME:
     {
       record = new CNAME_Record();
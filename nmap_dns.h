@@ -170,6 +170,15 @@ public:
   size_t parseFromBuffer(const u8 *buf, size_t offset, size_t maxlen);
 };
 
+class AAAA_Record : public Record
+{
+public:
+  sockaddr_storage value;
+  Record * clone() { return new AAAA_Record(*this); }
+  ~AAAA_Record() {}
+  size_t parseFromBuffer(const u8 *buf, size_t offset, size_t maxlen);
+};
+
 class PTR_Record : public Record
 {
 public:
@@ -247,6 +256,12 @@ public:
 
 void nmap_mass_rdns(Target ** targets, int num_targets);
 
+/* Resolve a batch of host names in parallel ahead of time. The addresses are
+   then taken with nmap_mass_dns_result, which returns false for names that
+   have to go to the system resolver instead. */
+void nmap_mass_dns(const std::list<std::string> &names);
+bool nmap_mass_dns_result(const std::string &name, std::list<struct sockaddr_storage> &addrs);
+
 std::list<std::string> get_dns_servers();
 
 #endif
@@ -258,6 +258,19 @@ nsock_ssl_ctx nsock_pool_ssl_init(nsock_pool ms_pool, int flags);
  * Functionally similar to nsock_pool_ssl_init, just for the DTLS */
 nsock_ssl_ctx nsock_pool_dtls_init(nsock_pool ms_pool, int flags);
 
+/* Enables or disables (the default) the pool's client-side TLS session cache.
+ * Sessions handed out by servers (session IDs as well as tickets) are stored
+ * per peer address, port and SNI name, and offered again by nsock_connect_ssl
+ * when no explicit ssl_session is given. Disabling the cache empties it. Has
+ * no effect on DTLS connections. */
+void nsock_pool_set_ssl_session_cache(nsock_pool ms_pool, int enable);
+
+/* Reports how many completed TLS handshakes on this pool resumed a session
+ * (hits) and how many were full handshakes (misses) while the session cache
+ * was enabled. Either pointer may be NULL. */
+void nsock_pool_get_ssl_session_stats(nsock_pool ms_pool, unsigned long *hits,
+                                      unsigned long *misses);
+
 /* Enforce use of a given IO engine.
  * The engine parameter is a zero-terminated string that will be
  * strup()'ed by the library. No validity check is performed by this function,
@@ -391,6 +391,8 @@ void handle_connect_result(struct npool *ms, struct nevent *nse, enum nse_status
       if (SSL_set_fd(iod->ssl, iod->sd) != 1)
         fatal("SSL_set_fd failed: %s", ERR_error_string(ERR_get_error(), NULL));
 
+      nsi_ssl_session_setup(iod);
+
       /* Event not done -- need to do SSL connect below */
       nse->sslinfo.ssl_desire = SSL_ERROR_WANT_CONNECT;
 #endif
@@ -440,6 +442,7 @@ void handle_connect_result(struct npool *ms, struct nevent *nse, enum nse_status
     if (rc == 1) {
       /* Woop!  Connect is done! */
       nse->event_done = 1;
+      nsi_ssl_session_account(iod);
       /* Check that certificate verification was okay, if requested. */
       if (nsi_ssl_post_connect_verify(iod)) {
         nse->status = NSE_STATUS_SUCCESS;
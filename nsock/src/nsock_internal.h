@@ -205,6 +205,14 @@ struct npool {
 #ifdef HAVE_DTLS_CLIENT_METHOD
   SSL_CTX *dtlsctx;
 #endif
+
+  /* Client-side TLS session cache, keyed by peer address, port and SNI name.
+   * The bucket array is allocated when the first session is stored. */
+  struct ssl_session_entry **ssl_sessions;
+  int ssl_session_count;
+  int ssl_session_cache_enabled;
+  unsigned long ssl_session_hits;
+  unsigned long ssl_session_misses;
 #endif
 
   /* Optional proxy chain (NULL is not set). Can only be set once per NSP (using
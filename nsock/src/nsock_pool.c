@@ -182,6 +182,11 @@ nsock_pool nsock_pool_new(void *userdata) {
 #if HAVE_OPENSSL
   nsp->sslctx = NULL;
   nsp->dtlsctx = NULL;
+  nsp->ssl_sessions = NULL;
+  nsp->ssl_session_count = 0;
+  nsp->ssl_session_cache_enabled = 0;
+  nsp->ssl_session_hits = 0;
+  nsp->ssl_session_misses = 0;
 #endif
 
   nsp->px_chain = NULL;
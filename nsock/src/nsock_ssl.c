@@ -92,8 +92,45 @@ static void nsock_ssl_atexit(void)
   nsock_ssl_state = NSOCK_SSL_STATE_ATEXIT;
 }
 #endif
+/* Number of hash buckets in a pool's TLS session cache, and the number of
+ * sessions it may hold before it is flushed. */
+#define SSL_SESSION_CACHE_BUCKETS 1024
+#define SSL_SESSION_CACHE_MAX 4096
+
+struct ssl_session_entry {
+  struct ssl_session_entry *next;
+  char *key;
+  SSL_SESSION *session;
+};
+
+static void ssl_session_cache_flush(struct npool *nsp) {
+  struct ssl_session_entry *entry, *next;
+  int i;
+
+  if (nsp->ssl_sessions == NULL)
+    return;
+
+  for (i = 0; i < SSL_SESSION_CACHE_BUCKETS; i++) {
+    for (entry = nsp->ssl_sessions[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      /* After OpenSSL's atexit handler has run the session may not be touched
+       * any more; the process is going away anyway. */
+      if (nsock_ssl_state != NSOCK_SSL_STATE_ATEXIT)
+        SSL_SESSION_free(entry->session);
+      free(entry->key);
+      free(entry);
+    }
+    nsp->ssl_sessions[i] = NULL;
+  }
+  nsp->ssl_session_count = 0;
+}
+
 void nsp_ssl_cleanup(struct npool *nsp)
 {
+  ssl_session_cache_flush(nsp);
+  free(nsp->ssl_sessions);
+  nsp->ssl_sessions = NULL;
+
   if (nsock_ssl_state != NSOCK_SSL_STATE_ATEXIT)
   {
     if (nsp->sslctx != NULL)
@@ -109,6 +146,151 @@ void nsp_ssl_cleanup(struct npool *nsp)
 #endif
 }
 
+/* Builds the session cache key for iod into buf: the peer address and port,
+ * and the SNI name if one is sent. Returns the bucket index for the key. */
+static unsigned int ssl_session_key(const struct niod *iod, char *buf, size_t len) {
+  const unsigned char *p;
+  unsigned int h = 5381;
+
+  Snprintf(buf, len, "%s %d %s",
+           inet_ntop_ez((struct sockaddr_storage *)&iod->peer, iod->peerlen),
+           nsock_iod_get_peerport((nsock_iod)iod),
+           iod->hostname != NULL ? iod->hostname : "");
+
+  for (p = (const unsigned char *)buf; *p != '\0'; p++)
+    h = h * 33 + *p;
+  return h % SSL_SESSION_CACHE_BUCKETS;
+}
+
+/* OpenSSL marks a session as not resumable when a connection using it is
+ * freed without a clean shutdown, which is the norm during a scan. Where
+ * possible the cache therefore holds private copies and hands out copies, so
+ * that neither is ever attached to a connection. Returns a new reference. */
+static SSL_SESSION *ssl_session_copy(SSL_SESSION *session) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined LIBRESSL_VERSION_NUMBER
+  return SSL_SESSION_dup(session);
+#elif OPENSSL_VERSION_NUMBER >= 0x10100000L
+  SSL_SESSION_up_ref(session);
+  return session;
+#else
+  CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+  return session;
+#endif
+}
+
+static int ssl_session_cacheable(const struct niod *iod) {
+  return iod != NULL && iod->nsp->ssl_session_cache_enabled &&
+         iod->lastproto != IPPROTO_UDP;
+}
+
+/* Called by OpenSSL whenever the server hands us a new session, whether during
+ * the handshake (session IDs, TLS 1.2 tickets) or afterwards (TLS 1.3
+ * NewSessionTicket). We store a copy, so the caller's reference is not kept. */
+static int ssl_new_session_cb(SSL *ssl, SSL_SESSION *session) {
+  struct niod *iod = (struct niod *)SSL_get_app_data(ssl);
+  struct npool *nsp;
+  struct ssl_session_entry *entry;
+  char key[INET6_ADDRSTRLEN + 300];
+  unsigned int bucket;
+
+  if (!ssl_session_cacheable(iod))
+    return 0;
+  nsp = iod->nsp;
+
+  session = ssl_session_copy(session);
+  if (session == NULL)
+    return 0;
+
+  bucket = ssl_session_key(iod, key, sizeof(key));
+  if (nsp->ssl_sessions == NULL)
+    nsp->ssl_sessions = (struct ssl_session_entry **)safe_zalloc(
+        SSL_SESSION_CACHE_BUCKETS * sizeof(*nsp->ssl_sessions));
+
+  for (entry = nsp->ssl_sessions[bucket]; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->key, key) == 0) {
+      SSL_SESSION_free(entry->session);
+      entry->session = session;
+      return 0;
+    }
+  }
+
+  /* Keep it simple: a full cache is emptied rather than maintaining LRU order.
+   * Scans rarely come anywhere near the limit. */
+  if (nsp->ssl_session_count >= SSL_SESSION_CACHE_MAX)
+    ssl_session_cache_flush(nsp);
+
+  entry = (struct ssl_session_entry *)safe_malloc(sizeof(*entry));
+  entry->key = strdup(key);
+  entry->session = session;
+  entry->next = nsp->ssl_sessions[bucket];
+  nsp->ssl_sessions[bucket] = entry;
+  nsp->ssl_session_count++;
+
+  return 0;
+}
+
+void nsi_ssl_session_setup(struct niod *iod) {
+  struct ssl_session_entry *entry;
+  char key[INET6_ADDRSTRLEN + 300];
+  unsigned int bucket;
+
+  SSL_set_app_data(iod->ssl, iod);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined LIBRESSL_VERSION_NUMBER
+  /* A session captured right after a TLS 1.3 handshake has no ticket yet and
+   * cannot be resumed; the ticket that arrived later is in the cache. */
+  if (iod->ssl_session != NULL && !SSL_SESSION_is_resumable(iod->ssl_session))
+    iod->ssl_session = NULL;
+#endif
+
+  /* A session given explicitly to nsock_connect_ssl takes precedence. */
+  if (iod->ssl_session != NULL || !ssl_session_cacheable(iod) ||
+      iod->nsp->ssl_sessions == NULL)
+    return;
+
+  bucket = ssl_session_key(iod, key, sizeof(key));
+  for (entry = iod->nsp->ssl_sessions[bucket]; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->key, key) == 0) {
+      SSL_SESSION *session = ssl_session_copy(entry->session);
+
+      if (session == NULL)
+        break;
+      if (SSL_set_session(iod->ssl, session) == 0)
+        nsock_log_error("SSL_set_session() failed for cached session");
+      /* SSL_set_session took its own reference. */
+      SSL_SESSION_free(session);
+      break;
+    }
+  }
+}
+
+void nsi_ssl_session_account(struct niod *iod) {
+  if (!ssl_session_cacheable(iod))
+    return;
+  if (SSL_session_reused(iod->ssl))
+    iod->nsp->ssl_session_hits++;
+  else
+    iod->nsp->ssl_session_misses++;
+}
+
+void nsock_pool_set_ssl_session_cache(nsock_pool ms_pool, int enable) {
+  struct npool *ms = (struct npool *)ms_pool;
+
+  ms->ssl_session_cache_enabled = enable;
+  if (!enable)
+    ssl_session_cache_flush(ms);
+}
+
+void nsock_pool_get_ssl_session_stats(nsock_pool ms_pool, unsigned long *hits,
+                                      unsigned long *misses) {
+  struct npool *ms = (struct npool *)ms_pool;
+
+  if (hits != NULL)
+    *hits = ms->ssl_session_hits;
+  if (misses != NULL)
+    *misses = ms->ssl_session_misses;
+}
+
 static SSL_CTX *ssl_init_helper(const SSL_METHOD *method) {
   SSL_CTX *ctx;
 
@@ -139,11 +321,13 @@ static SSL_CTX *ssl_init_helper(const SSL_METHOD *method) {
           ERR_error_string(ERR_get_error(), NULL));
   }
 
-  /* Our SSL* will always have the SSL_SESSION* inside it, so we neither need to
-   * use nor waste memory for the session cache.  (Use '1' because '0' means
-   * 'infinite'.)   */
-  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF|SSL_SESS_CACHE_NO_AUTO_CLEAR);
+  /* Client sessions are kept in the pool's own cache, keyed by peer and SNI
+   * name (OpenSSL's internal cache is only useful to servers), so we neither
+   * need to use nor waste memory for the internal one.  (Use '1' because '0'
+   * means 'infinite'.)   */
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE|SSL_SESS_CACHE_NO_AUTO_CLEAR);
   SSL_CTX_sess_set_cache_size(ctx, 1);
+  SSL_CTX_sess_set_new_cb(ctx, ssl_new_session_cb);
   SSL_CTX_set_timeout(ctx, 3600); /* pretty unnecessary */
 
   return ctx;
@@ -276,4 +460,15 @@ int nsi_ssl_post_connect_verify(const nsock_iod nsockiod) {
   return 1;
 }
 
+void nsock_pool_set_ssl_session_cache(nsock_pool ms_pool, int enable) {
+}
+
+void nsock_pool_get_ssl_session_stats(nsock_pool ms_pool, unsigned long *hits,
+                                      unsigned long *misses) {
+  if (hits != NULL)
+    *hits = 0;
+  if (misses != NULL)
+    *misses = 0;
+}
+
 #endif
@@ -83,6 +83,14 @@ struct sslinfo {
 int nsi_ssl_post_connect_verify(const nsock_iod nsockiod);
 
 void nsp_ssl_cleanup(struct npool *nsp);
+
+/* Prepares a freshly set-up SSL object of iod for the pool's session cache:
+ * new sessions will be stored and, unless the caller supplied its own session,
+ * a cached one for the same peer is offered for resumption. */
+void nsi_ssl_session_setup(struct niod *iod);
+
+/* Records whether the completed handshake on iod resumed a session. */
+void nsi_ssl_session_account(struct niod *iod);
 #endif /* HAVE_OPENSSL */
 #endif /* NSOCK_SSL_H */
 
@@ -69,21 +69,160 @@
 #include "FingerPrintResults.h"
 #include "nmap_error.h"
 #include "string_pool.h"
+#include "utils.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <time.h>
 
 #include <algorithm>
 #include <list>
+#include <map>
 
 extern NmapOps o;
 
-FingerPrintDB::FingerPrintDB() : MatchPoints(NULL) {
+/* The reference prints of a FingerPrintDB, flattened for match_fingerprint
+   into one image that can also be written to and mapped back from an
+   --osdb-cache file. Each (test, attribute) pair used by any print gets a
+   dense attribute number, and each distinct expression used with an
+   attribute a slot number. A print is then just the list of its slots:
+   matching evaluates every slot once against the observed fingerprint and
+   then only sums up points per print, with no string comparisons.
+
+   The image is a header followed by the arrays below, in this order, and a
+   table of NUL-terminated strings. Strings are given by their offset in the
+   table. Everything is in host byte order. */
+#define OSDB_IMAGE_MAGIC "Nmap OS image 1"
+#define OSDB_BYTE_ORDER 0x01020304
+/* Offset of a missing string, i.e. an unclassified OS generation */
+#define OSDB_NO_STRING 0xFFFFFFFF
+
+struct osdb_image_header {
+  char magic[16];
+  char nmap_version[32];
+  u64 db_hash; /* FNV-1a hash of the nmap-os-db it was built from */
+  u64 db_size;
+  u32 byte_order;
+  u32 num_attrs;
+  u32 num_alts;
+  u32 num_slots;
+  u32 num_prints;
+  u32 num_print_slots;
+  u32 num_classes;
+  u32 num_cpes;
+  u32 strings_size;
+};
+
+struct osdb_attr {
+  u32 test;
+  u32 name;
+  /* The points from MatchPoints or one of the POINTS_NO_* values if
+     MatchPoints lacks them. */
+  s32 points;
+};
+
+/* An AValAlt */
+struct osdb_alt {
+  u32 num_op;
+  u32 lo;
+  u32 hi;
+  u32 str;
+  u32 len;
+  u32 prefix;
+};
+
+/* A slot is matched if any of its alternatives are. */
+struct osdb_slot {
+  u32 attr;
+  u32 first_alt;
+  u32 num_alts;
+};
+
+struct osdb_print {
+  u32 line;
+  u32 name;
+  /* Its slots in print_slots, the most discriminating first */
+  u32 first_slot;
+  u32 num_slots;
+  /* The points it is worth if every attribute is observed, which bounds its
+     accuracy once some points are known to be lost. */
+  u32 max_points;
+  u32 first_class;
+  u32 num_classes;
+};
+
+struct osdb_class {
+  u32 vendor;
+  u32 family;
+  u32 generation;
+  u32 device_type;
+  u32 first_cpe;
+  u32 num_cpes;
+};
+
+#define POINTS_NO_TEST -1
+#define POINTS_NO_ATTR -2
+
+struct FingerPrintIndex {
+  /* The image, if built in memory, or the mapping of a cache file */
+  std::string image;
+  char *mapped;
+  s64 mapped_len;
+
+  /* The parts of the image */
+  const struct osdb_image_header *hdr;
+  const struct osdb_attr *attrs;
+  const struct osdb_slot *slots;
+  const struct osdb_print *prints;
+  const u32 *print_slots;
+  const struct osdb_class *classes;
+  const u32 *cpes;
+  const char *strings;
+
+  /* Attribute numbers by test name and attribute name */
+  std::map<const char *, std::map<const char *, unsigned int, cstring_less>, cstring_less> attr_ids;
+  /* The alternatives of all slots, in the form expr_match takes */
+  std::vector<struct AValAlt> alts;
+
+  /* The FingerMatch of each print. These are those of the parsed prints when
+     the DB was read from nmap-os-db. From a cache, they are made from the
+     image when first needed, which is only for the few prints that make it
+     into match results. */
+  std::vector<FingerMatch *> matches;
+  bool owns_matches;
+
+  FingerPrintIndex() : mapped(NULL), mapped_len(0), owns_matches(false) {}
+  ~FingerPrintIndex();
+  bool attach(const char *data, size_t len);
+  FingerMatch *match(unsigned int i);
+  const char *str(u32 offset) const {
+    return strings + offset;
+  }
+};
+
+/* match_fingerprint scores this many of the leading slots of a print before
+   checking whether it can still reach the entrance requirement at all. */
+#define PRUNE_SLOTS 24
+
+/* Orders slots by how much their attribute tells prints apart: its points,
+   discounted by how many prints share the most common expression for it. */
+struct slot_weight_greater {
+  const std::vector<struct osdb_slot> *slots;
+  const std::vector<double> *attr_weight;
+  bool operator()(unsigned int a, unsigned int b) const {
+    return (*attr_weight)[(*slots)[a].attr] > (*attr_weight)[(*slots)[b].attr];
+  }
+};
+
+FingerPrintDB::FingerPrintDB() : MatchPoints(NULL), index(NULL) {
 }
 
 FingerPrintDB::~FingerPrintDB() {
   std::vector<FingerPrint *>::iterator current;
 
+  delete index;
+
   if (MatchPoints != NULL) {
     MatchPoints->erase();
     delete MatchPoints;
@@ -121,54 +260,101 @@ void FingerPrint::erase() {
   }
 }
 
-/* Compare an observed value (e.g. "45") against an OS DB expression (e.g.
-   "3B-47" or "8|A" or ">10"). Return true iff there's a match. The syntax uses
+/* Compiles an OS DB expression (e.g. "3B-47" or "8|A" or ">10") into the
+   alternatives that expr_match tests. The syntax uses
      < (less than)
      > (greater than)
      | (or)
      - (range)
-   No parentheses are allowed. */
-static bool expr_match(const char *val, const char *expr) {
-  const char *p, *q, *q1;  /* OHHHH YEEEAAAAAHHHH!#!@#$!% */
+   No parentheses are allowed. Identical expressions, which are the same
+   pointer thanks to the string pool, are compiled only once into the
+   compiled map, which owns the alternatives. */
+static void compile_expr(struct AVal *av,
+    std::map<const char *, std::vector<struct AValAlt> > &compiled) {
+  std::map<const char *, std::vector<struct AValAlt> >::iterator it;
+  const char *p, *q, *q1;
   char *endptr;
-  unsigned int val_num, expr_num, expr_num1;
-  bool is_numeric;
-
-  p = expr;
-
-  val_num = strtol(val, &endptr, 16);
-  is_numeric = !*endptr;
-  // TODO: this could be a lot faster if we compiled fingerprints to a bytecode
-  // instead of re-parsing every time.
-  do {
-    q = strchr(p, '|');
-    if (is_numeric && (*p == '<' || *p == '>')) {
-      expr_num = strtol(p + 1, &endptr, 16);
-      if (endptr == q || !*endptr) {
-        if ((*p == '<' && val_num < expr_num)
-            || (*p == '>' && val_num > expr_num)) {
-          return true;
-        }
-      }
-    } else if (is_numeric && ((q1 = strchr(p, '-')) != NULL)) {
-      expr_num = strtol(p, &endptr, 16);
-      if (endptr == q1) {
-        expr_num1 = strtol(q1 + 1, &endptr, 16);
+  unsigned int expr_num, expr_num1;
+
+  it = compiled.find(av->value);
+  if (it == compiled.end()) {
+    std::vector<struct AValAlt> &alts = compiled[av->value];
+
+    p = av->value;
+    do {
+      struct AValAlt alt;
+
+      q = strchr(p, '|');
+      alt.str = q ? string_pool_substr(p, q) : string_pool_insert(p);
+      alt.len = strlen(alt.str);
+      alt.prefix = (q != NULL);
+      alt.lo = alt.hi = 0;
+      /* What follows decides how a numeric value is matched. Note that a '-'
+         anywhere later in the expression makes it a range attempt. */
+      if (*p == '<' || *p == '>') {
+        alt.num_op = AValAlt::NUM_NEVER;
+        expr_num = strtol(p + 1, &endptr, 16);
         if (endptr == q || !*endptr) {
-          assert(expr_num1 > expr_num);
-          if (val_num >= expr_num && val_num <= expr_num1) {
-            return true;
+          if (*p == '<' && expr_num > 0) {
+            alt.num_op = AValAlt::NUM_RANGE;
+            alt.hi = expr_num - 1;
+          } else if (*p == '>' && expr_num < UINT_MAX) {
+            alt.num_op = AValAlt::NUM_RANGE;
+            alt.lo = expr_num + 1;
+            alt.hi = UINT_MAX;
+          }
+        }
+      } else if ((q1 = strchr(p, '-')) != NULL) {
+        alt.num_op = AValAlt::NUM_NEVER;
+        expr_num = strtol(p, &endptr, 16);
+        if (endptr == q1) {
+          expr_num1 = strtol(q1 + 1, &endptr, 16);
+          if (endptr == q || !*endptr) {
+            assert(expr_num1 > expr_num);
+            alt.num_op = AValAlt::NUM_RANGE;
+            alt.lo = expr_num;
+            alt.hi = expr_num1;
           }
         }
+      } else {
+        alt.num_op = AValAlt::NUM_LITERAL;
       }
-    } else {
-      if ((q && !strncmp(p, val, q - p)) || (!q && !strcmp(p, val))) {
+      alts.push_back(alt);
+      if (q)
+        p = q + 1;
+    } while (q);
+    it = compiled.find(av->value);
+  }
+
+  av->alts = &it->second[0];
+  av->num_alts = it->second.size();
+}
+
+/* Notes whether an observed value (e.g. "45") is a hex number, and which. */
+static void compile_value(struct AVal *av) {
+  char *endptr;
+
+  av->num = strtol(av->value, &endptr, 16);
+  av->is_numeric = !*endptr;
+}
+
+/* Compare an observed value against the alternatives of a compiled OS DB
+   expression. Return true iff there's a match. */
+static bool expr_match(const struct AVal *val, const struct AValAlt *alts, unsigned int num_alts) {
+  const struct AValAlt *alt, *end;
+
+  end = alts + num_alts;
+  for (alt = alts; alt < end; alt++) {
+    if (val->is_numeric && alt->num_op != AValAlt::NUM_LITERAL) {
+      if (alt->num_op == AValAlt::NUM_RANGE
+          && val->num >= alt->lo && val->num <= alt->hi) {
         return true;
       }
+    } else if (alt->prefix ? !strncmp(alt->str, val->value, alt->len)
+                           : !strcmp(alt->str, val->value)) {
+      return true;
     }
-    if (q)
-      p = q + 1;
-  } while (q);
+  }
 
   return false;
 }
@@ -195,7 +381,6 @@ static int AVal_match(const FingerTest *reference, const FingerTest *fprint, con
   std::vector<struct AVal>::const_iterator current_points;
   int subtests = 0, subtests_succeeded=0;
   int pointsThisTest = 1;
-  char *endptr;
 
   /* We rely on AVals being sorted by attribute. */
   prev_ref = reference->results->end();
@@ -221,13 +406,10 @@ static int AVal_match(const FingerTest *reference, const FingerTest *fprint, con
       }
       if (current_points == points->results->end())
         fatal("%s: Failed to find point amount for test %s.%s", __func__, reference->name ? reference->name : "", current_ref->attribute);
-      errno = 0;
-      pointsThisTest = strtol(current_points->value, &endptr, 10);
-      if (errno != 0 || *endptr != '\0' || pointsThisTest < 0)
-        fatal("%s: Got bogus point amount (%s) for test %s.%s", __func__, current_points->value, reference->name ? reference->name : "", current_ref->attribute);
+      pointsThisTest = current_points->num;
       subtests += pointsThisTest;
 
-      if (expr_match(current_fp->value, current_ref->value)) {
+      if (expr_match(&*current_fp, current_ref->alts, current_ref->num_alts)) {
         subtests_succeeded += pointsThisTest;
       } else {
         if (shortcut) {
@@ -259,6 +441,509 @@ static int AVal_match(const FingerTest *reference, const FingerTest *fprint, con
   return (subtests == subtests_succeeded) ? 1 : 0;
 }
 
+void compile_observed_fingerprint(FingerPrint *FP) {
+  std::vector<FingerTest>::iterator test;
+  std::vector<struct AVal>::iterator av;
+
+  for (test = FP->tests.begin(); test != FP->tests.end(); test++) {
+    for (av = test->results->begin(); av != test->results->end(); av++)
+      compile_value(&*av);
+  }
+}
+
+/* An image being put together by build_fingerprint_index */
+struct osdb_image_builder {
+  std::map<const char *, std::map<const char *, unsigned int, cstring_less>, cstring_less> attr_ids;
+  std::vector<struct osdb_attr> attrs;
+  std::vector<struct osdb_alt> alts;
+  std::vector<struct osdb_slot> slots;
+  std::vector<struct osdb_print> prints;
+  std::vector<u32> print_slots;
+  std::vector<struct osdb_class> classes;
+  std::vector<u32> cpes;
+  std::map<std::string, u32> string_ids;
+  std::string strings;
+
+  u32 add_string(const char *s);
+};
+
+/* Returns the offset of s in the string table, adding it if necessary. */
+u32 osdb_image_builder::add_string(const char *s) {
+  std::map<std::string, u32>::iterator it;
+  u32 offset;
+
+  if (s == NULL)
+    return OSDB_NO_STRING;
+  it = string_ids.find(s);
+  if (it != string_ids.end())
+    return it->second;
+  offset = strings.size();
+  strings.append(s, strlen(s) + 1);
+  string_ids[s] = offset;
+
+  return offset;
+}
+
+static void osdb_init_header(struct osdb_image_header *hdr, u64 hash, u64 size) {
+  memset(hdr, 0, sizeof(*hdr));
+  Strncpy(hdr->magic, OSDB_IMAGE_MAGIC, sizeof(hdr->magic));
+  Strncpy(hdr->nmap_version, NMAP_VERSION, sizeof(hdr->nmap_version));
+  hdr->db_hash = hash;
+  hdr->db_size = size;
+  hdr->byte_order = OSDB_BYTE_ORDER;
+}
+
+template <class T>
+static void osdb_append(std::string *image, const std::vector<T> &v) {
+  if (!v.empty())
+    image->append((const char *) &v[0], v.size() * sizeof(T));
+}
+
+/* Returns true if count elements starting at first fit in size. */
+static bool osdb_range_ok(u32 first, u32 count, u32 size) {
+  return first <= size && count <= size - first;
+}
+
+/* Returns the attribute number of test_name.attr_name in the image, adding it
+   if necessary. */
+static unsigned int index_attr(osdb_image_builder *b, const FingerPrint *MatchPoints,
+                               const char *test_name, const char *attr_name) {
+  std::map<const char *, unsigned int, cstring_less> &ids = b->attr_ids[test_name];
+  std::map<const char *, unsigned int, cstring_less>::iterator it;
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  struct osdb_attr attr;
+  int points;
+
+  it = ids.find(attr_name);
+  if (it != ids.end())
+    return it->second;
+
+  points = POINTS_NO_TEST;
+  if (MatchPoints != NULL) {
+    for (test = MatchPoints->tests.begin(); test != MatchPoints->tests.end(); test++) {
+      if (strcmp(test->name, test_name) == 0)
+        break;
+    }
+    if (test != MatchPoints->tests.end()) {
+      points = POINTS_NO_ATTR;
+      for (av = test->results->begin(); av != test->results->end(); av++) {
+        if (strcmp(av->attribute, attr_name) == 0) {
+          points = av->num;
+          break;
+        }
+      }
+    }
+  }
+
+  attr.test = b->add_string(test_name);
+  attr.name = b->add_string(attr_name);
+  attr.points = points;
+  ids[attr_name] = b->attrs.size();
+  b->attrs.push_back(attr);
+
+  return b->attrs.size() - 1;
+}
+
+static FingerPrintIndex *build_fingerprint_index(const FingerPrintDB *DB) {
+  osdb_image_builder b;
+  std::map<std::pair<unsigned int, const struct AValAlt *>, unsigned int> slot_ids;
+  std::map<std::pair<unsigned int, const struct AValAlt *>, unsigned int>::iterator it;
+  std::map<const struct AValAlt *, unsigned int> alt_ids;
+  std::map<const struct AValAlt *, unsigned int>::iterator alt_it;
+  std::vector<FingerPrint *>::const_iterator current;
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  std::vector<OS_Classification>::const_iterator osc;
+  std::vector<const char *>::const_iterator cpe;
+  unsigned int attr, slot, k;
+
+  /* Offset 0 is the empty string. */
+  b.add_string("");
+
+  for (current = DB->prints.begin(); current != DB->prints.end(); current++) {
+    struct osdb_print print;
+
+    print.line = (*current)->match.line;
+    print.name = b.add_string((*current)->match.OS_name);
+    print.first_slot = b.print_slots.size();
+    for (test = (*current)->tests.begin(); test != (*current)->tests.end(); test++) {
+      for (av = test->results->begin(); av != test->results->end(); av++) {
+        attr = index_attr(&b, DB->MatchPoints, test->name, av->attribute);
+        it = slot_ids.find(std::make_pair(attr, av->alts));
+        if (it != slot_ids.end()) {
+          slot = it->second;
+        } else {
+          struct osdb_slot s;
+
+          s.attr = attr;
+          alt_it = alt_ids.find(av->alts);
+          if (alt_it != alt_ids.end()) {
+            s.first_alt = alt_it->second;
+          } else {
+            s.first_alt = b.alts.size();
+            for (k = 0; k < av->num_alts; k++) {
+              struct osdb_alt alt;
+
+              alt.num_op = av->alts[k].num_op;
+              alt.lo = av->alts[k].lo;
+              alt.hi = av->alts[k].hi;
+              alt.str = b.add_string(av->alts[k].str);
+              alt.len = av->alts[k].len;
+              alt.prefix = av->alts[k].prefix;
+              b.alts.push_back(alt);
+            }
+            alt_ids[av->alts] = s.first_alt;
+          }
+          s.num_alts = av->num_alts;
+          slot = b.slots.size();
+          b.slots.push_back(s);
+          slot_ids[std::make_pair(attr, av->alts)] = slot;
+        }
+        b.print_slots.push_back(slot);
+      }
+    }
+    print.num_slots = b.print_slots.size() - print.first_slot;
+
+    print.first_class = b.classes.size();
+    for (osc = (*current)->match.OS_class.begin(); osc != (*current)->match.OS_class.end(); osc++) {
+      struct osdb_class c;
+
+      c.vendor = b.add_string(osc->OS_Vendor);
+      c.family = b.add_string(osc->OS_Family);
+      c.generation = b.add_string(osc->OS_Generation);
+      c.device_type = b.add_string(osc->Device_Type);
+      c.first_cpe = b.cpes.size();
+      for (cpe = osc->cpe.begin(); cpe != osc->cpe.end(); cpe++)
+        b.cpes.push_back(b.add_string(*cpe));
+      c.num_cpes = b.cpes.size() - c.first_cpe;
+      b.classes.push_back(c);
+    }
+    print.num_classes = b.classes.size() - print.first_class;
+    print.max_points = 0;
+    b.prints.push_back(print);
+  }
+
+  /* Put the slots of each print that are most likely to lose points first,
+     so that match_fingerprint can give up on hopeless prints early. */
+  std::vector<unsigned int> slot_prints(b.slots.size(), 0);
+  std::vector<unsigned int> attr_prints(b.attrs.size(), 0);
+  std::vector<unsigned int> attr_max_slot_prints(b.attrs.size(), 0);
+  std::vector<double> attr_weight(b.attrs.size(), 0);
+  std::vector<struct osdb_print>::iterator print;
+  unsigned int j;
+
+  for (j = 0; j < b.print_slots.size(); j++) {
+    slot = b.print_slots[j];
+    slot_prints[slot]++;
+    attr_prints[b.slots[slot].attr]++;
+  }
+  for (slot = 0; slot < b.slots.size(); slot++) {
+    attr = b.slots[slot].attr;
+    attr_max_slot_prints[attr] = MAX(attr_max_slot_prints[attr], slot_prints[slot]);
+  }
+  for (attr = 0; attr < b.attrs.size(); attr++) {
+    attr_weight[attr] = MAX(b.attrs[attr].points, 0) *
+      (1.0 - attr_max_slot_prints[attr] / (double) attr_prints[attr]);
+  }
+
+  slot_weight_greater cmp;
+  cmp.slots = &b.slots;
+  cmp.attr_weight = &attr_weight;
+  for (print = b.prints.begin(); print != b.prints.end(); print++) {
+    std::stable_sort(b.print_slots.begin() + print->first_slot,
+                     b.print_slots.begin() + print->first_slot + print->num_slots, cmp);
+    for (j = print->first_slot; j < print->first_slot + print->num_slots; j++)
+      print->max_points += MAX(b.attrs[b.slots[b.print_slots[j]].attr].points, 0);
+  }
+
+  FingerPrintIndex *index = new FingerPrintIndex;
+  struct osdb_image_header hdr;
+
+  osdb_init_header(&hdr, 0, 0);
+  hdr.num_attrs = b.attrs.size();
+  hdr.num_alts = b.alts.size();
+  hdr.num_slots = b.slots.size();
+  hdr.num_prints = b.prints.size();
+  hdr.num_print_slots = b.print_slots.size();
+  hdr.num_classes = b.classes.size();
+  hdr.num_cpes = b.cpes.size();
+  hdr.strings_size = b.strings.size();
+  index->image.append((const char *) &hdr, sizeof(hdr));
+  osdb_append(&index->image, b.attrs);
+  osdb_append(&index->image, b.alts);
+  osdb_append(&index->image, b.slots);
+  osdb_append(&index->image, b.prints);
+  osdb_append(&index->image, b.print_slots);
+  osdb_append(&index->image, b.classes);
+  osdb_append(&index->image, b.cpes);
+  index->image.append(b.strings);
+  if (!index->attach(index->image.data(), index->image.size()))
+    fatal("%s: Built an inconsistent OS fingerprint index", __func__);
+  for (current = DB->prints.begin(); current != DB->prints.end(); current++)
+    index->matches.push_back(&(*current)->match);
+
+  if (o.debugging > 1) {
+    log_write(LOG_PLAIN, "Indexed %u OS fingerprints: %u attributes, %u distinct expressions, %u in all\n",
+              hdr.num_prints, hdr.num_attrs, hdr.num_slots, hdr.num_print_slots);
+  }
+
+  return index;
+}
+
+FingerPrintIndex::~FingerPrintIndex() {
+  std::vector<FingerMatch *>::iterator m;
+
+  if (owns_matches) {
+    for (m = matches.begin(); m != matches.end(); m++)
+      delete *m;
+  }
+  if (mapped != NULL)
+    munmap(mapped, mapped_len);
+}
+
+/* Points the index at an image of len bytes, checking that every offset and
+   count in it is in range so that a damaged cache file can't make
+   match_fingerprint read out of bounds. Returns false if it is not. */
+bool FingerPrintIndex::attach(const char *data, size_t len) {
+  const struct osdb_alt *image_alts;
+  const char *p;
+  u64 total;
+  u32 i, size;
+
+  if (len < sizeof(*hdr))
+    return false;
+  hdr = (const struct osdb_image_header *) data;
+  if (hdr->byte_order != OSDB_BYTE_ORDER)
+    return false;
+  total = sizeof(*hdr) + (u64) hdr->num_attrs * sizeof(*attrs)
+    + (u64) hdr->num_alts * sizeof(*image_alts)
+    + (u64) hdr->num_slots * sizeof(*slots)
+    + (u64) hdr->num_prints * sizeof(*prints)
+    + (u64) hdr->num_print_slots * sizeof(*print_slots)
+    + (u64) hdr->num_classes * sizeof(*classes)
+    + (u64) hdr->num_cpes * sizeof(*cpes)
+    + hdr->strings_size;
+  if (total != len)
+    return false;
+
+  p = data + sizeof(*hdr);
+  attrs = (const struct osdb_attr *) p;
+  p += hdr->num_attrs * sizeof(*attrs);
+  image_alts = (const struct osdb_alt *) p;
+  p += hdr->num_alts * sizeof(*image_alts);
+  slots = (const struct osdb_slot *) p;
+  p += hdr->num_slots * sizeof(*slots);
+  prints = (const struct osdb_print *) p;
+  p += hdr->num_prints * sizeof(*prints);
+  print_slots = (const u32 *) p;
+  p += hdr->num_print_slots * sizeof(*print_slots);
+  classes = (const struct osdb_class *) p;
+  p += hdr->num_classes * sizeof(*classes);
+  cpes = (const u32 *) p;
+  p += hdr->num_cpes * sizeof(*cpes);
+  strings = p;
+
+  size = hdr->strings_size;
+  if (size == 0 || strings[size - 1] != '\0')
+    return false;
+  for (i = 0; i < hdr->num_attrs; i++) {
+    if (attrs[i].test >= size || attrs[i].name >= size || attrs[i].points < POINTS_NO_ATTR)
+      return false;
+  }
+  for (i = 0; i < hdr->num_alts; i++) {
+    if (image_alts[i].num_op > AValAlt::NUM_LITERAL
+        || !osdb_range_ok(image_alts[i].str, image_alts[i].len, size - 1)
+        || strings[image_alts[i].str + image_alts[i].len] != '\0')
+      return false;
+  }
+  for (i = 0; i < hdr->num_slots; i++) {
+    if (slots[i].attr >= hdr->num_attrs
+        || !osdb_range_ok(slots[i].first_alt, slots[i].num_alts, hdr->num_alts))
+      return false;
+  }
+  for (i = 0; i < hdr->num_prints; i++) {
+    if (prints[i].name >= size
+        || !osdb_range_ok(prints[i].first_slot, prints[i].num_slots, hdr->num_print_slots)
+        || !osdb_range_ok(prints[i].first_class, prints[i].num_classes, hdr->num_classes))
+      return false;
+  }
+  for (i = 0; i < hdr->num_print_slots; i++) {
+    if (print_slots[i] >= hdr->num_slots)
+      return false;
+  }
+  for (i = 0; i < hdr->num_classes; i++) {
+    if (classes[i].vendor >= size || classes[i].family >= size || classes[i].device_type >= size
+        || (classes[i].generation >= size && classes[i].generation != OSDB_NO_STRING)
+        || !osdb_range_ok(classes[i].first_cpe, classes[i].num_cpes, hdr->num_cpes))
+      return false;
+  }
+  for (i = 0; i < hdr->num_cpes; i++) {
+    if (cpes[i] >= size)
+      return false;
+  }
+
+  for (i = 0; i < hdr->num_attrs; i++)
+    attr_ids[str(attrs[i].test)][str(attrs[i].name)] = i;
+  alts.resize(hdr->num_alts);
+  for (i = 0; i < hdr->num_alts; i++) {
+    alts[i].num_op = (enum AValAlt::num_op_type) image_alts[i].num_op;
+    alts[i].lo = image_alts[i].lo;
+    alts[i].hi = image_alts[i].hi;
+    alts[i].str = str(image_alts[i].str);
+    alts[i].len = image_alts[i].len;
+    alts[i].prefix = image_alts[i].prefix != 0;
+  }
+
+  return true;
+}
+
+/* Returns the FingerMatch of print i, making it from the image if needed. */
+FingerMatch *FingerPrintIndex::match(unsigned int i) {
+  const struct osdb_class *c, *end;
+  FingerMatch *m;
+  u32 k;
+
+  if (matches[i] != NULL)
+    return matches[i];
+
+  m = new FingerMatch;
+  m->line = prints[i].line;
+  m->OS_name = str(prints[i].name);
+  end = classes + prints[i].first_class + prints[i].num_classes;
+  for (c = classes + prints[i].first_class; c < end; c++) {
+    struct OS_Classification osc;
+
+    osc.OS_Vendor = str(c->vendor);
+    osc.OS_Family = str(c->family);
+    osc.OS_Generation = (c->generation == OSDB_NO_STRING) ? NULL : str(c->generation);
+    osc.Device_Type = str(c->device_type);
+    for (k = 0; k < c->num_cpes; k++)
+      osc.cpe.push_back(str(cpes[c->first_cpe + k]));
+    m->OS_class.push_back(osc);
+  }
+  matches[i] = m;
+
+  return m;
+}
+
+/* Loads a FingerPrintDB from an --osdb-cache file, if it was made by this
+   version of Nmap from the nmap-os-db with the given hash and size. The file
+   is mapped read-only, so concurrent scans share its pages. Only the index is
+   filled in: the DB has no parsed prints or MatchPoints. */
+static FingerPrintDB *load_fingerprint_cache(const char *filename, u64 hash, u64 size) {
+  struct osdb_image_header expected;
+  FingerPrintIndex *index = new FingerPrintIndex;
+  FingerPrintDB *DB;
+  const char *data;
+  size_t len;
+
+#ifndef WIN32
+  index->mapped = mmapfile((char *) filename, &index->mapped_len, O_RDONLY);
+  if (index->mapped == NULL) {
+    delete index;
+    return NULL;
+  }
+  data = index->mapped;
+  len = index->mapped_len;
+#else
+  /* mmapfile() on Windows opens the file for exclusive access, which would
+     keep concurrent scans from using the cache, so read it instead. */
+  char buf[8192];
+  size_t n;
+  FILE *fp;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    delete index;
+    return NULL;
+  }
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    index->image.append(buf, n);
+  fclose(fp);
+  data = index->image.data();
+  len = index->image.size();
+#endif
+
+  osdb_init_header(&expected, hash, size);
+  if (len < sizeof(expected)
+      || memcmp(data, &expected, offsetof(struct osdb_image_header, num_attrs)) != 0
+      || !index->attach(data, len)) {
+    delete index;
+    return NULL;
+  }
+  index->matches.resize(index->hdr->num_prints, NULL);
+  index->owns_matches = true;
+
+  if (o.debugging) {
+    log_write(LOG_PLAIN, "Loaded %u OS fingerprints from cache %s\n",
+              index->hdr->num_prints, filename);
+  }
+
+  DB = new FingerPrintDB;
+  DB->index = index;
+
+  return DB;
+}
+
+/* Writes the index image to a temporary file and renames it into place, so
+   that concurrent scans never see a partial cache. */
+static void save_fingerprint_cache(const FingerPrintIndex *index, const char *filename,
+                                   u64 hash, u64 size) {
+  struct osdb_image_header hdr;
+  char tmpname[1024];
+  size_t len;
+  bool ok;
+  FILE *fp;
+
+  Snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", filename, (unsigned long) getpid());
+  fp = fopen(tmpname, "wb");
+  if (fp == NULL) {
+    error("Warning: could not create OS detection cache file %s: %s", tmpname, strerror(errno));
+    return;
+  }
+  hdr = *index->hdr;
+  hdr.db_hash = hash;
+  hdr.db_size = size;
+  len = index->image.size() - sizeof(hdr);
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+    && fwrite(index->image.data() + sizeof(hdr), 1, len, fp) == len;
+  if (fclose(fp) != 0)
+    ok = false;
+#ifdef WIN32
+  if (ok)
+    remove(filename);
+#endif
+  if (!ok || rename(tmpname, filename) != 0) {
+    error("Warning: could not write OS detection cache file %s: %s", filename, strerror(errno));
+    remove(tmpname);
+  }
+}
+
+/* Compiles the expressions of a reference fingerprint, or reads the point
+   amounts of the MatchPoints print. The expressions are compiled into
+   DB->exprs. */
+static void compile_reference_fingerprint(FingerPrint *FP, FingerPrintDB *DB, bool matchpoints) {
+  std::vector<FingerTest>::iterator test;
+  std::vector<struct AVal>::iterator av;
+  long points;
+  char *endptr;
+
+  for (test = FP->tests.begin(); test != FP->tests.end(); test++) {
+    for (av = test->results->begin(); av != test->results->end(); av++) {
+      if (!matchpoints) {
+        compile_expr(&*av, DB->exprs);
+        continue;
+      }
+      errno = 0;
+      points = strtol(av->value, &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || points < 0 || points > INT_MAX)
+        fatal("%s: Got bogus point amount (%s) for test %s.%s", __func__, av->value, test->name, av->attribute);
+      av->num = points;
+    }
+  }
+}
+
 /* Compares 2 fingerprints -- a referenceFP (can have expression
    attributes) with an observed fingerprint (no expressions).  If
    verbose is nonzero, differences will be printed.  The comparison
@@ -332,7 +1017,13 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
                                                            at least this big
                                                            to be added to the
                                                            list */
-  std::vector<FingerPrint *>::const_iterator current_os;
+  FingerPrintIndex *index = DB->index;
+  const struct osdb_print *print;
+  std::vector<FingerTest>::const_iterator test;
+  std::vector<struct AVal>::const_iterator av;
+  std::map<const char *, std::map<const char *, unsigned int, cstring_less>, cstring_less>::const_iterator test_attrs;
+  std::map<const char *, unsigned int, cstring_less>::const_iterator attr;
+  unsigned int i, j, s, slots_end, max_points, num_subtests, num_subtests_succeeded;
   FingerPrint FP_copy;
   double acc;
   int state;
@@ -346,22 +1037,82 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
   assert(FPR);
   assert(accuracy_threshold >= 0 && accuracy_threshold <= 1);
 
+  assert(index != NULL);
+
   FP_copy = *FP;
   FP_copy.sort();
+  compile_observed_fingerprint(&FP_copy);
+
+  /* Find the observed value of each indexed attribute. */
+  std::vector<const struct AVal *> observed(index->hdr->num_attrs, NULL);
+  for (test = FP_copy.tests.begin(); test != FP_copy.tests.end(); test++) {
+    test_attrs = index->attr_ids.find(test->name);
+    if (test_attrs == index->attr_ids.end())
+      continue;
+    for (av = test->results->begin(); av != test->results->end(); av++) {
+      attr = test_attrs->second.find(av->attribute);
+      if (attr != test_attrs->second.end())
+        observed[attr->second] = &*av;
+    }
+  }
+
+  /* Evaluate each distinct expression once; a print is then worth the sum
+     of the points of its slots. */
+  std::vector<unsigned int> slot_points(index->hdr->num_slots);
+  std::vector<unsigned int> slot_points_succeeded(index->hdr->num_slots);
+  for (s = 0; s < index->hdr->num_slots; s++) {
+    const struct osdb_slot *slot = &index->slots[s];
+    unsigned int a = slot->attr;
+    int points = index->attrs[a].points;
+
+    if (observed[a] == NULL) {
+      slot_points[s] = slot_points_succeeded[s] = 0;
+      continue;
+    }
+    if (points == POINTS_NO_TEST)
+      fatal("%s: Failed to locate test %s in MatchPoints directive of fingerprint file", __func__, index->str(index->attrs[a].test));
+    if (points == POINTS_NO_ATTR)
+      fatal("%s: Failed to find point amount for test %s.%s", __func__, index->str(index->attrs[a].test), index->str(index->attrs[a].name));
+    slot_points[s] = points;
+    slot_points_succeeded[s] = expr_match(observed[a], &index->alts[slot->first_alt], slot->num_alts) ? points : 0;
+  }
 
   FPR->overall_results = OSSCAN_SUCCESS;
 
-  for (current_os = DB->prints.begin(); current_os != DB->prints.end(); current_os++) {
+  for (i = 0; i < index->hdr->num_prints; i++) {
+    print = &index->prints[i];
     skipfp = 0;
 
-    acc = compare_fingerprints(*current_os, &FP_copy, DB->MatchPoints, 0);
+    num_subtests = num_subtests_succeeded = 0;
+    j = print->first_slot;
+    slots_end = j + MIN(PRUNE_SLOTS, print->num_slots);
+    for (; j < slots_end; j++) {
+      num_subtests += slot_points[index->print_slots[j]];
+      num_subtests_succeeded += slot_points_succeeded[index->print_slots[j]];
+    }
+    /* Even if the print matched on everything else, the points lost so far
+       cap its accuracy. If that cannot make the list, neither can the print,
+       so there is no need to score the rest. (Division rounds monotonically,
+       so the bound also holds for the computed values.) */
+    max_points = print->max_points;
+    if (j < print->first_slot + print->num_slots && max_points > 0) {
+      acc = (max_points - (num_subtests - num_subtests_succeeded)) / (double) max_points;
+      if (acc < FPR_entrance_requirement && acc < 1.0)
+        continue;
+    }
+    slots_end = print->first_slot + print->num_slots;
+    for (; j < slots_end; j++) {
+      num_subtests += slot_points[index->print_slots[j]];
+      num_subtests_succeeded += slot_points_succeeded[index->print_slots[j]];
+    }
+    acc = (num_subtests) ? (num_subtests_succeeded / (double) num_subtests) : 0;
 
     /*    error("Comp to %s: %li/%li=%f", o.reference_FPs1[i]->OS_name, num_subtests_succeeded, num_subtests, acc); */
     if (acc >= FPR_entrance_requirement || acc == 1.0) {
 
       state = 0;
       for (idx=0; idx < FPR->num_matches; idx++) {
-        if (strcmp(FPR->matches[idx]->OS_name, (*current_os)->match.OS_name) == 0) {
+        if (strcmp(FPR->matches[idx]->OS_name, index->str(print->name)) == 0) {
           if (FPR->accuracy[idx] >= acc) {
             skipfp = 1; /* Skip it -- a higher version is already in list */
           } else {
@@ -405,7 +1156,7 @@ void match_fingerprint(const FingerPrint *FP, FingerPrintResultsIPv4 *FPR,
             /* OK, I insert the sucker into the next slot ... */
             tmp_acc = FPR->accuracy[idx+1];
             tmp_FP = FPR->matches[idx+1];
-            FPR->matches[idx+1] = &(*current_os)->match;
+            FPR->matches[idx+1] = index->match(i);
             FPR->accuracy[idx+1] = acc;
             state = 1;
           }
@@ -894,10 +1645,11 @@ static void parse_cpeline(FingerPrint *FP, const char *thisline, const char *lin
    non-null fingerprint is returned, the user is in charge of freeing it
    when done.  This function does not require the fingerprint to be 100%
    complete since it is used by scripts such as scripts/fingerwatch for
-   which some partial fingerpritns are OK. */
+   which some partial fingerpritns are OK. Its expressions are compiled into
+   DB->exprs, so DB must outlive it. */
 /* This function is not currently used by Nmap, but it is present here because
    it is used by fingerprint utilities that link with Nmap object files. */
-FingerPrint *parse_single_fingerprint(const char *fprint) {
+FingerPrint *parse_single_fingerprint(const char *fprint, FingerPrintDB *DB) {
   int lineno = 0;
   const char *p, *q;
   const char *thisline, *nextline;
@@ -965,6 +1717,8 @@ FingerPrint *parse_single_fingerprint(const char *fprint) {
     lineno++;
   } while (thisline && thisline < end);
 
+  compile_reference_fingerprint(FP, DB, false);
+
   return FP;
 }
 
@@ -1068,14 +1822,20 @@ fparse:
     /* This sorting is important for later comparison of FingerPrints and
        FingerTests. */
     current->sort();
+    compile_reference_fingerprint(current, DB, parsingMatchPoints);
   }
 
   fclose(fp);
+
+  DB->index = build_fingerprint_index(DB);
+
   return DB;
 }
 
 FingerPrintDB *parse_fingerprint_reference_file(const char *dbname) {
   char filename[256];
+  FingerPrintDB *DB;
+  u64 hash, size;
 
   if (nmap_fetchfile(filename, sizeof(filename), dbname) != 1) {
     fatal("OS scan requested but I cannot find %s file.", dbname);
@@ -1083,5 +1843,18 @@ FingerPrintDB *parse_fingerprint_reference_file(const char *dbname) {
   /* Record where this data file was found. */
   o.loaded_data_files[dbname] = filename;
 
-  return parse_fingerprint_file(filename);
+  if (!o.osdb_cache)
+    return parse_fingerprint_file(filename);
+
+  if (!hash_file(filename, &hash, &size))
+    pfatal("Failed to open %s file %s for reading", dbname, filename);
+  DB = load_fingerprint_cache(o.osdb_cache, hash, size);
+  if (DB != NULL)
+    return DB;
+  if (o.debugging)
+    log_write(LOG_PLAIN, "Rebuilding OS detection cache %s\n", o.osdb_cache);
+  DB = parse_fingerprint_file(filename);
+  save_fingerprint_cache(DB->index, o.osdb_cache, hash, size);
+
+  return DB;
 }
@@ -66,6 +66,7 @@
 #define OSSCAN_H
 
 #include <nbase.h>
+#include <map>
 #include <vector>
 
 class Target;
@@ -90,10 +91,34 @@ enum dist_calc_method {
 
 /**********************  STRUCTURES  ***********************************/
 
+/* One "|"-separated alternative of a reference fingerprint expression such as
+   "3B-47", ">10" or "M5B4ST11", compiled when nmap-os-db is parsed. */
+struct AValAlt {
+  /* How the alternative is matched against an observed value that is a hex
+     number: by range, not at all (a malformed range), or literally as
+     against any other observed value. */
+  enum num_op_type { NUM_RANGE, NUM_NEVER, NUM_LITERAL } num_op;
+  unsigned int lo, hi; /* Inclusive bounds for NUM_RANGE */
+  const char *str; /* The alternative as written, for literal matching */
+  unsigned int len;
+  /* Any but the last alternative also matches values that merely start with
+     it, as the expression matcher always allowed. */
+  bool prefix;
+};
+
 struct AVal {
   const char *attribute;
   const char *value;
-  AVal() : attribute(NULL), value(NULL) {}
+  /* The value in numeric form. In an observed fingerprint, is_numeric tells
+     whether value is a hex number, which is then in num. In the MatchPoints
+     print, num is the number of points. */
+  unsigned int num;
+  bool is_numeric;
+  /* In a reference fingerprint, the compiled alternatives of the expression
+     in value. These are shared between identical expressions. */
+  const struct AValAlt *alts;
+  unsigned int num_alts;
+  AVal() : attribute(NULL), value(NULL), num(0), is_numeric(false), alts(NULL), num_alts(0) {}
 
   bool operator<(const AVal& other) const {
     return strcmp(attribute, other.attribute) < 0;
@@ -144,11 +169,20 @@ struct FingerPrint {
   void sort();
   void erase();
 };
+struct FingerPrintIndex;
+
 /* This structure contains the important data from the fingerprint
    database (nmap-os-db) */
 struct FingerPrintDB {
   FingerPrint *MatchPoints;
   std::vector<FingerPrint *> prints;
+  /* The prints in the flat form used by match_fingerprint, built by
+     parse_fingerprint_file. When loaded from an --osdb-cache file, this is
+     all there is: prints is empty and MatchPoints NULL. */
+  FingerPrintIndex *index;
+  /* The compiled alternatives of each distinct expression in prints, keyed
+     by its pooled string. The AVal::alts of the prints point in here. */
+  std::map<const char *, std::vector<struct AValAlt> > exprs;
 
   FingerPrintDB();
   ~FingerPrintDB();
@@ -162,8 +196,9 @@ const char *fp2ascii(const FingerPrint *FP);
  non-null fingerprint is returned, the user is in charge of freeing it
  when done.  This function does not require the fingerprint to be 100%
  complete since it is used by scripts such as scripts/fingerwatch for
- which some partial fingerpritns are OK. */
-FingerPrint *parse_single_fingerprint(const char *fprint_orig);
+ which some partial fingerpritns are OK.  The compiled expressions of the
+ returned fingerprint are owned by DB, so DB must outlive it. */
+FingerPrint *parse_single_fingerprint(const char *fprint, FingerPrintDB *DB);
 
 /* These functions take a file/db name and open+parse it, returning an
    (allocated) FingerPrintDB containing the results.  They exit with
@@ -173,8 +208,13 @@ FingerPrintDB *parse_fingerprint_reference_file(const char *dbname);
 
 void free_fingerprint_file(FingerPrintDB *DB);
 
+/* Converts the values of an observed fingerprint to numeric form, as needed
+   by compare_fingerprints. Reference prints are compiled when parsed. */
+void compile_observed_fingerprint(FingerPrint *FP);
+
 /* Compares 2 fingerprints -- a referenceFP (can have expression
-   attributes) with an observed fingerprint (no expressions).  If
+   attributes) with an observed fingerprint (no expressions) which has been
+   passed to compile_observed_fingerprint.  If
    verbose is nonzero, differences will be printed.  The comparison
    accuracy (between 0 and 1) is returned).  If MatchPoints is not NULL, it is
    a special "fingerprints" which tells how many points each test is worth. */
@@ -801,6 +801,18 @@ static void doTUITests(OsScanInfo *OSI, HostOsScan *HOS) {
 }
 
 
+/* Copies the results of matching a fingerprint into FPR, which must not have
+ * been matched against anything yet. This is equivalent to (and much cheaper
+ * than) calling match_fingerprint() again with the same fingerprint. */
+static void copyFPMatches(const FingerPrintResultsIPv4 *matched, FingerPrintResults *FPR) {
+  memcpy(FPR->accuracy, matched->accuracy, sizeof(FPR->accuracy));
+  memcpy(FPR->matches, matched->matches, sizeof(FPR->matches));
+  FPR->num_perfect_matches = matched->num_perfect_matches;
+  FPR->num_matches = matched->num_matches;
+  FPR->overall_results = matched->overall_results;
+}
+
+
 static void endRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
   std::list<HostOsScanInfo *>::iterator hostI;
   HostOsScanInfo *hsi = NULL;
@@ -827,8 +839,7 @@ static void endRound(OsScanInfo *OSI, HostOsScan *HOS, int roundNum) {
         if (o.verbose)
           log_write(LOG_STDOUT, "WARNING: OS didn't match until try #%d\n", roundNum + 1);
       }
-      match_fingerprint(hsi->FPR->FPs[roundNum], hsi->FPR,
-                        o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+      copyFPMatches(&hsi->FP_matches[roundNum], hsi->FPR);
       hsi->isCompleted = true;
     }
 
@@ -880,11 +891,9 @@ static void findBestFPs(OsScanInfo *OSI) {
       }
     }
 
-    // Now we redo the match, since target->FPR has various data (such as
-    // target->FPR->numFPs) which is not in FP_matches[bestaccidx].  This is
-    // kinda ugly.
-    match_fingerprint(hsi->FPR->FPs[bestaccidx], (FingerPrintResultsIPv4 *) hsi->target->FPR,
-                      o.reference_FPs, OSSCAN_GUESS_THRESHOLD);
+    // target->FPR has various data (such as target->FPR->numFPs) which is not
+    // in FP_matches[bestaccidx], so only the match results are taken from it.
+    copyFPMatches(&hsi->FP_matches[bestaccidx], hsi->target->FPR);
   }
 }
 
@@ -934,7 +943,7 @@ static int expireUnmatchedHosts(OsScanInfo *OSI, std::list<HostOsScanInfo *> *un
       /* We've done all the OS2 tries we're going to do ... move this
      to unMatchedHosts */
       HOS->target->stopTimeOutClock(&now);
-      OSI->incompleteHosts.erase(hostI);
+      OSI->removeIncompleteHost(hostI);
       /* We need to adjust nextI if necessary */
       OSI->resetHostIterator();
       hostsRemoved++;
@@ -1022,6 +1031,13 @@ HostOsScanStats::HostOsScanStats(Target * t) {
 
   distance = -1;
   distance_guess = -1;
+
+  for (i = 0; i <= OFP_TUDP; i++) {
+    for (int j = 0; j < OFP_MAX_SUBIDS; j++) {
+      activeProbeIndex[i][j] = probesActive.end();
+      activeProbeCount[i][j] = 0;
+    }
+  }
 }
 
 
@@ -1213,9 +1229,40 @@ void HostOsScanStats::addNewProbe(OFProbeType type, int subid) {
 }
 
 
+/* Note a probe that was just appended to probesActive in the index. */
+void HostOsScanStats::indexActiveProbe(std::list<OFProbe *>::iterator probeI) {
+  OFProbe *probe = *probeI;
+
+  assert(probe->type >= 0 && probe->type <= OFP_TUDP);
+  assert(probe->subid >= 0 && probe->subid < OFP_MAX_SUBIDS);
+  if (activeProbeCount[probe->type][probe->subid]++ == 0)
+    activeProbeIndex[probe->type][probe->subid] = probeI;
+}
+
+
+/* Drop a probe that is about to leave probesActive from the index. */
+void HostOsScanStats::unindexActiveProbe(std::list<OFProbe *>::iterator probeI) {
+  std::list<OFProbe *>::iterator nextI;
+  OFProbe *probe = *probeI;
+
+  if (--activeProbeCount[probe->type][probe->subid] == 0) {
+    activeProbeIndex[probe->type][probe->subid] = probesActive.end();
+  } else if (activeProbeIndex[probe->type][probe->subid] == probeI) {
+    /* Another probe of the same kind is active; it becomes the first. */
+    for (nextI = probeI, nextI++; nextI != probesActive.end(); nextI++) {
+      if ((*nextI)->type == probe->type && (*nextI)->subid == probe->subid)
+        break;
+    }
+    assert(nextI != probesActive.end());
+    activeProbeIndex[probe->type][probe->subid] = nextI;
+  }
+}
+
+
 /* Remove a probe from the probesActive. */
 void HostOsScanStats::removeActiveProbe(std::list<OFProbe *>::iterator probeI) {
   OFProbe *probe = *probeI;
+  unindexActiveProbe(probeI);
   probesActive.erase(probeI);
   delete probe;
 }
@@ -1224,14 +1271,10 @@ void HostOsScanStats::removeActiveProbe(std::list<OFProbe *>::iterator probeI) {
 /* Get an active probe from active probe list identified by probe type
    and subid.  Returns probesActive.end() if there isn't one */
 std::list<OFProbe *>::iterator HostOsScanStats::getActiveProbe(OFProbeType type, int subid) {
-  std::list<OFProbe *>::iterator probeI;
-  OFProbe *probe = NULL;
+  std::list<OFProbe *>::iterator probeI = probesActive.end();
 
-  for (probeI = probesActive.begin(); probeI != probesActive.end(); probeI++) {
-    probe = *probeI;
-    if (probe->type == type && probe->subid == subid)
-      break;
-  }
+  if (type >= 0 && type <= OFP_TUDP && subid >= 0 && subid < OFP_MAX_SUBIDS)
+    probeI = activeProbeIndex[type][subid];
 
   if (probeI == probesActive.end()) {
     /* not found!? */
@@ -1247,6 +1290,7 @@ std::list<OFProbe *>::iterator HostOsScanStats::getActiveProbe(OFProbeType type,
 /* Move a probe from probesToSend to probesActive. */
 void HostOsScanStats::moveProbeToActiveList(std::list<OFProbe *>::iterator probeI) {
   probesActive.push_back(*probeI);
+  indexActiveProbe(--probesActive.end());
   probesToSend.erase(probeI);
 }
 
@@ -1254,6 +1298,7 @@ void HostOsScanStats::moveProbeToActiveList(std::list<OFProbe *>::iterator probe
 /* Move a probe from probesActive to probesToSend. */
 void HostOsScanStats::moveProbeToUnSendList(std::list<OFProbe *>::iterator probeI) {
   probesToSend.push_back(*probeI);
+  unindexActiveProbe(probeI);
   probesActive.erase(probeI);
 }
 
@@ -3482,6 +3527,7 @@ OsScanInfo::OsScanInfo(std::vector<Target *> &Targets) {
 
     hsi = new HostOsScanInfo(Targets[targetno], this);
     incompleteHosts.push_back(hsi);
+    hostsByAddr.insert(std::make_pair((u32) hsi->target->v4hostip()->s_addr, hsi));
     numInitialTargets++;
   }
 
@@ -3501,20 +3547,34 @@ OsScanInfo::~OsScanInfo()
 /* Find a HostScanStats by IP its address in the incomplete list.  Returns NULL if
    none are found. */
 HostOsScanInfo *OsScanInfo::findIncompleteHost(const struct sockaddr_storage *ss) {
-  std::list<HostOsScanInfo *>::iterator hostI;
+  std::multimap<u32, HostOsScanInfo *>::const_iterator hostI;
   const struct sockaddr_in *sin = (struct sockaddr_in *) ss;
 
   if (sin->sin_family != AF_INET)
     fatal("%s passed a non IPv4 address", __func__);
 
-  for (hostI = incompleteHosts.begin(); hostI != incompleteHosts.end(); hostI++) {
-    if ((*hostI)->target->v4hostip()->s_addr == sin->sin_addr.s_addr)
-      return *hostI;
-  }
+  hostI = hostsByAddr.find(sin->sin_addr.s_addr);
+  if (hostI != hostsByAddr.end())
+    return hostI->second;
   return NULL;
 }
 
 
+void OsScanInfo::removeIncompleteHost(std::list<HostOsScanInfo *>::iterator hostI) {
+  std::multimap<u32, HostOsScanInfo *>::iterator addrI, end;
+
+  addrI = hostsByAddr.lower_bound((*hostI)->target->v4hostip()->s_addr);
+  end = hostsByAddr.upper_bound((*hostI)->target->v4hostip()->s_addr);
+  for (; addrI != end; addrI++) {
+    if (addrI->second == *hostI) {
+      hostsByAddr.erase(addrI);
+      break;
+    }
+  }
+  incompleteHosts.erase(hostI);
+}
+
+
 /* A circular buffer of the incompleteHosts.  nextIncompleteHost() gives
    the next one.  The first time it is called, it will give the
    first host in the list.  If incompleteHosts is empty, returns
@@ -3568,7 +3628,7 @@ int OsScanInfo::removeCompletedHosts() {
                     hsi->target->targetipstr(), remain,
                     (remain == 1)? "host left" : "hosts left");
       }
-      incompleteHosts.erase(hostI);
+      removeIncompleteHost(hostI);
       hostsRemoved++;
       hsi->target->stopTimeOutClock(&now);
       delete hsi;
@@ -3599,24 +3659,18 @@ void OSScan::reset() {
 
 
 /* This function takes a group of targets and divides it in chunks if there are
- * too many to be processed at the same time. The threshold is based on Nmap's
- * timing level (when timing level is above 4, no chunking is performed).
- * The reason targets are processed in smaller groups is to improve accuracy. */
+ * too many to be processed at the same time (more than OS_MAX_GROUP_SZ). */
 int OSScan::chunk_and_do_scan(std::vector<Target *> &Targets, int family) {
-  unsigned int max_os_group_sz = 20;
+  unsigned int max_os_group_sz = OS_MAX_GROUP_SZ;
   double fudgeratio = 1.2; /* Allow a slightly larger final group rather than finish with a tiny one */
   std::vector<Target *> tmpTargets;
   unsigned int startidx = 0;
 
-  if (o.timing_level == 4)
-    max_os_group_sz = (unsigned int) (max_os_group_sz * 1.5);
-
-  if (o.timing_level > 4 || Targets.size() <= max_os_group_sz * fudgeratio) {
+  if (Targets.size() <= max_os_group_sz * fudgeratio) {
     if (family == AF_INET6)
-      os_scan_ipv6(Targets);
+      return os_scan_ipv6(Targets);
     else
-      os_scan_ipv4(Targets);
-    return OP_SUCCESS;
+      return os_scan_ipv4(Targets);
   }
 
   /* We need to split it up */
@@ -3627,9 +3681,9 @@ int OSScan::chunk_and_do_scan(std::vector<Target *> &Targets, int family) {
     }
     tmpTargets.assign(Targets.begin() + startidx, Targets.begin() + startidx + diff);
     if (family == AF_INET6)
-      os_scan_ipv6(Targets);
+      os_scan_ipv6(tmpTargets);
     else
-      os_scan_ipv4(Targets);
+      os_scan_ipv4(tmpTargets);
     startidx += diff;
   }
   return OP_SUCCESS;
@@ -3641,6 +3695,8 @@ int OSScan::chunk_and_do_scan(std::vector<Target *> &Targets, int family) {
  * you don't do too many targets in parallel */
 int OSScan::os_scan_ipv4(std::vector<Target *> &Targets) {
   int itry = 0;
+  struct timeval probes_done, now;
+  long pause_usec;
   /* Hosts which haven't matched and have been removed from incompleteHosts because
    * they have exceeded the number of retransmissions the host is allowed. */
   std::list<HostOsScanInfo *> unMatchedHosts;
@@ -3664,10 +3720,17 @@ int OSScan::os_scan_ipv4(std::vector<Target *> &Targets) {
   /* Initialize the pcap session handler in HOS */
   begin_sniffer(&HOS, Targets);
   while (OSI.numIncompleteHosts() != 0) {
-    if (itry > 0)
-      sleep(1);
-    if (itry == 3)
-      usleep(1500000); /* Try waiting a little longer just in case it matters */
+    if (itry > 0) {
+      pause_usec = 1000000;
+      if (itry == 3)
+        pause_usec += 1500000; /* Try waiting a little longer just in case it matters */
+      /* The fingerprints of the last round were matched while this pause was
+         already running, so only wait for what is left of it. */
+      gettimeofday(&now, NULL);
+      pause_usec -= TIMEVAL_SUBTRACT(now, probes_done);
+      if (pause_usec > 0)
+        usleep(pause_usec);
+    }
     if (o.verbose) {
       char targetstr[128];
       bool plural = (OSI.numIncompleteHosts() != 1);
@@ -3680,6 +3743,7 @@ int OSScan::os_scan_ipv4(std::vector<Target *> &Targets) {
     startRound(&OSI, &HOS, itry);
     doSeqTests(&OSI, &HOS);
     doTUITests(&OSI, &HOS);
+    gettimeofday(&probes_done, NULL);
     endRound(&OSI, &HOS, itry);
     expireUnmatchedHosts(&OSI, &unMatchedHosts);
     itry++;
@@ -3741,11 +3805,11 @@ int OSScan::os_scan(std::vector<Target *> &Targets) {
 
   /* Do IPv4 OS Detection */
   if (ip4_targets.size() > 0)
-      res4 = this->os_scan_ipv4(ip4_targets);
+      res4 = this->chunk_and_do_scan(ip4_targets, AF_INET);
 
   /* Do IPv6 OS Detection */
   if (ip6_targets.size() > 0)
-      res6 = this->os_scan_ipv6(ip6_targets);
+      res6 = this->chunk_and_do_scan(ip6_targets, AF_INET6);
 
   /* If both scans were successful, return OK */
   if (res4 == OP_SUCCESS && res6 == OP_SUCCESS)
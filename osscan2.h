@@ -70,6 +70,7 @@
 
 #include <vector>
 #include <list>
+#include <map>
 #include "timing.h"
 struct FingerPrint;
 struct FingerTest;
@@ -104,6 +105,10 @@ class Target;
 /* How many syn packets do we send to TCP sequence a host? */
 #define NUM_SEQ_SAMPLES 6
 
+/* The most hosts to OS scan at once. Larger host groups are split into
+   groups of about this size. */
+#define OS_MAX_GROUP_SZ 4096
+
 /* TCP Timestamp Sequence */
 #define TS_SEQ_UNKNOWN 0
 #define TS_SEQ_ZERO 1 /* At least one of the timestamps we received back was 0 */
@@ -169,6 +174,9 @@ typedef enum OFProbeType {
   OFP_TUDP
 } OFProbeType;
 
+/* Probe subids run from 0 up to (but not including) this, for any type. */
+#define OFP_MAX_SUBIDS 7
+
 /******************************************************************************
  * FUNCTION PROTOTYPES                                                        *
  ******************************************************************************/
@@ -289,6 +297,15 @@ class HostOsScanStats {
   std::list<OFProbe *> probesToSend;
   std::list<OFProbe *> probesActive;
 
+  /* The first probe of each type and subid in probesActive, or
+   * probesActive.end() if there is none, and how many of them there are.
+   * This lets getActiveProbe() find the probe a response belongs to without
+   * searching probesActive. */
+  std::list<OFProbe *>::iterator activeProbeIndex[OFP_TUDP + 1][OFP_MAX_SUBIDS];
+  unsigned short activeProbeCount[OFP_TUDP + 1][OFP_MAX_SUBIDS];
+  void indexActiveProbe(std::list<OFProbe *>::iterator probeI);
+  void unindexActiveProbe(std::list<OFProbe *>::iterator probeI);
+
   /* A record of total number of probes that have been sent to this
    * host, including retransmitted ones. */
   unsigned int num_probes_sent;
@@ -465,14 +482,17 @@ class OsScanInfo {
   ~OsScanInfo();
   float starttime;
 
-  /* If you remove from this, you had better adjust nextI too (or call
-   * resetHostIterator() afterward). Don't let this list get empty,
-   * then add to it again, or you may mess up nextI (I'm not sure) */
+  /* Remove from this only with removeIncompleteHost(), and adjust nextI
+   * too (or call resetHostIterator() afterward). Don't let this list get
+   * empty, then add to it again, or you may mess up nextI (I'm not sure) */
   std::list<HostOsScanInfo *> incompleteHosts;
 
   unsigned int numIncompleteHosts() const {return incompleteHosts.size();}
   HostOsScanInfo *findIncompleteHost(const struct sockaddr_storage *ss);
 
+  /* Removes a host from incompleteHosts, without deleting it. */
+  void removeIncompleteHost(std::list<HostOsScanInfo *>::iterator hostI);
+
   /* A circular buffer of the incompleteHosts.  nextIncompleteHost() gives
      the next one.  The first time it is called, it will give the
      first host in the list.  If incompleteHosts is empty, returns
@@ -489,6 +509,9 @@ class OsScanInfo {
  private:
   unsigned int numInitialTargets;
   std::list<HostOsScanInfo *>::iterator nextI;
+  /* The incompleteHosts by IPv4 address (in network byte order), so that
+   * findIncompleteHost() doesn't have to walk the list for every packet. */
+  std::multimap<u32, HostOsScanInfo *> hostsByAddr;
 };
 
 
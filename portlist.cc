@@ -77,6 +77,9 @@
 
 extern NmapOps o;  /* option structure */
 
+/* Compact entry state of a port that has a full Port object. */
+#define COMPACT_PORT_FULL 0xff
+
 Port::Port() {
   portno = proto = 0;
   state = 0;
@@ -406,11 +409,12 @@ void PortList::addScriptResult(u16 portno, int protocol, ScriptResult *sr) {
 PortList::PortList() {
   int proto;
   memset(state_counts_proto, 0, sizeof(state_counts_proto));
-  memset(port_list, 0, sizeof(port_list));
+  memset(compact_ports, 0, sizeof(compact_ports));
 
+  /* compact_ports arrays are allocated the first time a port of that
+     protocol gets its own state. Until then every port is in the default
+     state, so targets that turn out to be down never pay for them. */
   for(proto=0; proto < PORTLIST_PROTO_MAX; proto++) {
-    if(port_list_count[proto] > 0)
-      port_list[proto] = (Port**) safe_zalloc(sizeof(Port*)*port_list_count[proto]);
     default_port_state[proto].proto = PORTLISTPROTO2INPROTO(proto);
     default_port_state[proto].reason.reason_id = ER_NORESPONSE;
     state_counts_proto[proto][default_port_state[proto].state] = port_list_count[proto];
@@ -421,7 +425,8 @@ PortList::PortList() {
 }
 
 PortList::~PortList() {
-  int proto, i;
+  int proto;
+  std::map<u16, Port *>::iterator it;
 
   if (idstr) {
     free(idstr);
@@ -429,41 +434,45 @@ PortList::~PortList() {
   }
 
   for(proto=0; proto < PORTLIST_PROTO_MAX; proto++) { // for every protocol
-    if(port_list[proto]) {
-      for(i=0; i < port_list_count[proto]; i++) { // free every Port
-        Port *port = port_list[proto][i];
-        if(port) {
-          if (port->service) {
-            port->service->erase();
-            delete port->service;
-          }
-          port->freeScriptResults();
-          delete port;
-        }
+    for (it = full_ports[proto].begin(); it != full_ports[proto].end(); it++) {
+      Port *port = it->second;
+      if (port->service) {
+        port->service->erase();
+        delete port->service;
       }
-      free(port_list[proto]);
+      port->freeScriptResults();
+      delete port;
     }
+    if (compact_ports[proto])
+      free(compact_ports[proto]);
   }
 }
 
 void PortList::setDefaultPortState(u8 protocol, int state) {
   int proto = INPROTO2PORTLISTPROTO(protocol);
-  int i;
+  int i, ndefault;
 
-  for (i = 0; i < port_list_count[proto]; i++) {
-    if (port_list[proto][i] == NULL) {
-      state_counts_proto[proto][default_port_state[proto].state]--;
-      state_counts_proto[proto][state]++;
+  if (compact_ports[proto] == NULL) {
+    ndefault = port_list_count[proto];
+  } else {
+    ndefault = 0;
+    for (i = 0; i < port_list_count[proto]; i++) {
+      if (compact_ports[proto][i].state == PORT_UNKNOWN)
+        ndefault++;
     }
   }
+  state_counts_proto[proto][default_port_state[proto].state] -= ndefault;
+  state_counts_proto[proto][state] += ndefault;
 
   default_port_state[proto].state = state;
 }
 
 void PortList::setPortState(u16 portno, u8 protocol, int state) {
-  const Port *oldport;
+  compact_port *cp;
   Port *current;
-  int proto = INPROTO2PORTLISTPROTO(protocol);
+  int oldstate;
+  u16 mapped_portno;
+  u8 proto;
 
   assert(state < PORT_HIGHEST_STATE);
 
@@ -483,20 +492,38 @@ void PortList::setPortState(u16 portno, u8 protocol, int state) {
 
   assert(protocol!=IPPROTO_IP || portno<256);
 
-  oldport = lookupPort(portno, protocol);
-  if (oldport != NULL) {
+  mapped_portno = portno;
+  proto = protocol;
+  mapPort(&mapped_portno, &proto);
+  cp = getCompactPort(mapped_portno, proto);
+
+  if (cp->state == COMPACT_PORT_FULL)
+    oldstate = full_ports[proto][mapped_portno]->state;
+  else
+    oldstate = cp->state;
+  if (oldstate != PORT_UNKNOWN) {
     /* We must discount our statistics from the old values.  Also warn
        if a complete duplicate */
-    if (o.debugging && oldport->state == state) {
+    if (o.debugging && oldstate == state) {
       error("Duplicate port (%hu/%s)", portno, proto2ascii_lowercase(protocol));
     }
-    state_counts_proto[proto][oldport->state]--;
+    state_counts_proto[proto][oldstate]--;
   } else {
     state_counts_proto[proto][default_port_state[proto].state]--;
   }
-  current = createPort(portno, protocol);
 
-  current->state = state;
+  /* Open ports are the ones that get service and script results, so give
+     them a full Port now. Everything else stays compact. */
+  if (cp->state == COMPACT_PORT_FULL || state == PORT_OPEN) {
+    current = createPort(portno, protocol);
+    current->state = state;
+  } else {
+    if (cp->state == PORT_UNKNOWN) {
+      cp->reason_id = ER_NORESPONSE;
+      cp->ttl = 0;
+    }
+    cp->state = state;
+  }
   state_counts_proto[proto][state]++;
 
   if(state == PORT_FILTERED || state == PORT_OPENFILTERED)
@@ -505,20 +532,28 @@ void PortList::setPortState(u16 portno, u8 protocol, int state) {
 }
 
 int PortList::getPortState(u16 portno, u8 protocol) {
-  const Port *port;
+  const compact_port *cp;
 
-  port = lookupPort(portno, protocol);
-  if (port == NULL)
-    return default_port_state[INPROTO2PORTLISTPROTO(protocol)].state;
+  mapPort(&portno, &protocol);
+  if (compact_ports[protocol] == NULL)
+    return default_port_state[protocol].state;
+
+  cp = &compact_ports[protocol][portno];
+  if (cp->state == PORT_UNKNOWN)
+    return default_port_state[protocol].state;
+  if (cp->state == COMPACT_PORT_FULL)
+    return full_ports[protocol][portno]->state;
 
-  return port->state;
+  return cp->state;
 }
 
 /* Return true if nothing special is known about this port; i.e., it's in the
    default state as defined by setDefaultPortState and every other data field is
    unset. */
 bool PortList::portIsDefault(u16 portno, u8 protocol) {
-  return lookupPort(portno, protocol) == NULL;
+  mapPort(&portno, &protocol);
+  return compact_ports[protocol] == NULL
+    || compact_ports[protocol][portno].state == PORT_UNKNOWN;
 }
 
   /* Saves an identification string for the target containing these
@@ -561,7 +596,8 @@ Port *PortList::nextPort(const Port *cur, Port *next,
                          int allowed_protocol, int allowed_state) const {
   int proto;
   int mapped_pno;
-  Port *port;
+  const compact_port *cp;
+  u8 cstate;
 
   if (cur) {
     proto = INPROTO2PORTLISTPROTO(cur->proto);
@@ -579,16 +615,28 @@ Port *PortList::nextPort(const Port *cur, Port *next,
     mapped_pno = 0;
   }
 
-  if(port_list[proto] != NULL) {
+  if(port_map[proto] != NULL) {
     for(;mapped_pno < port_list_count[proto]; mapped_pno++) {
-      port = port_list[proto][mapped_pno];
-      if (port && (allowed_state==0 || port->state==allowed_state)) {
-        *next = *port;
-        return next;
-      }
-      if (!port && (allowed_state==0 || default_port_state[proto].state==allowed_state)) {
+      cp = compact_ports[proto] ? &compact_ports[proto][mapped_pno] : NULL;
+      cstate = cp ? cp->state : PORT_UNKNOWN;
+      if (cstate == COMPACT_PORT_FULL) {
+        const Port *port = full_ports[proto].find(mapped_pno)->second;
+        if (allowed_state==0 || port->state==allowed_state) {
+          *next = *port;
+          return next;
+        }
+      } else if (cstate == PORT_UNKNOWN) {
+        if (allowed_state==0 || default_port_state[proto].state==allowed_state) {
+          *next = default_port_state[proto];
+          next->portno = port_map_rev[proto][mapped_pno];
+          return next;
+        }
+      } else if (allowed_state==0 || cstate==allowed_state) {
         *next = default_port_state[proto];
         next->portno = port_map_rev[proto][mapped_pno];
+        next->state = cstate;
+        next->reason.reason_id = cp->reason_id;
+        next->reason.ttl = cp->ttl;
         return next;
       }
     }
@@ -616,7 +664,7 @@ void PortList::mapPort(u16 *portno, u8 *protocol) const {
 
   if (*protocol == IPPROTO_IP)
     assert(*portno < 256);
-  if(port_map[mapped_protocol]==NULL || port_list[mapped_protocol]==NULL) {
+  if(port_map[mapped_protocol]==NULL) {
     fatal("%s(%i,%i): you're trying to access uninitialized protocol", __func__, *portno, *protocol);
   }
   mapped_portno = port_map[mapped_protocol][*portno];
@@ -630,12 +678,24 @@ void PortList::mapPort(u16 *portno, u8 *protocol) const {
 
 const Port *PortList::lookupPort(u16 portno, u8 protocol) const {
   mapPort(&portno, &protocol);
-  return port_list[protocol][portno];
+  if (compact_ports[protocol] == NULL
+      || compact_ports[protocol][portno].state != COMPACT_PORT_FULL)
+    return NULL;
+  return full_ports[protocol].find(portno)->second;
+}
+
+/* Get the compact entry of a mapped port, allocating the protocol's array
+   the first time one of its ports leaves the default state. */
+PortList::compact_port *PortList::getCompactPort(u16 mapped_portno, u8 mapped_protocol) {
+  if (compact_ports[mapped_protocol] == NULL)
+    compact_ports[mapped_protocol] = (compact_port *) safe_zalloc(sizeof(compact_port) * port_list_count[mapped_protocol]);
+  return &compact_ports[mapped_protocol][mapped_portno];
 }
 
 /* Create the port if it doesn't exist; otherwise this is like lookupPort. */
 Port *PortList::createPort(u16 portno, u8 protocol) {
   Port *p;
+  compact_port *cp;
   u16 mapped_portno;
   u8 mapped_protocol;
 
@@ -643,39 +703,62 @@ Port *PortList::createPort(u16 portno, u8 protocol) {
   mapped_protocol = protocol;
   mapPort(&mapped_portno, &mapped_protocol);
 
-  p = port_list[mapped_protocol][mapped_portno];
-  if (p == NULL) {
-    p = new Port();
-    p->portno = portno;
-    p->proto = protocol;
+  cp = getCompactPort(mapped_portno, mapped_protocol);
+  if (cp->state == COMPACT_PORT_FULL)
+    return full_ports[mapped_protocol][mapped_portno];
+
+  p = new Port();
+  p->portno = portno;
+  p->proto = protocol;
+  if (cp->state == PORT_UNKNOWN) {
     p->state = default_port_state[mapped_protocol].state;
     p->reason.reason_id = ER_NORESPONSE;
-    port_list[mapped_protocol][mapped_portno] = p;
+  } else {
+    p->state = cp->state;
+    p->reason.reason_id = cp->reason_id;
+    p->reason.ttl = cp->ttl;
   }
+  cp->state = COMPACT_PORT_FULL;
+  full_ports[mapped_protocol][mapped_portno] = p;
 
-  return port_list[mapped_protocol][mapped_portno];
+  return p;
 }
 
 int PortList::forgetPort(u16 portno, u8 protocol) {
   Port *answer = NULL;
+  compact_port *cp;
+  u16 mapped_portno;
+  u8 mapped_protocol;
+  int state;
 
   log_write(LOG_PLAIN, "Removed %d\n", portno);
 
-  mapPort(&portno, &protocol);
+  mapped_portno = portno;
+  mapped_protocol = protocol;
+  mapPort(&mapped_portno, &mapped_protocol);
 
-  answer = port_list[protocol][portno];
-  if (answer == NULL)
+  if (compact_ports[mapped_protocol] == NULL)
+    return -1;
+  cp = &compact_ports[mapped_protocol][mapped_portno];
+  if (cp->state == PORT_UNKNOWN)
     return -1;
 
-  state_counts_proto[protocol][answer->state]--;
-  state_counts_proto[protocol][default_port_state[protocol].state]++;
+  if (cp->state == COMPACT_PORT_FULL) {
+    answer = full_ports[mapped_protocol][mapped_portno];
+    full_ports[mapped_protocol].erase(mapped_portno);
+    state = answer->state;
+  } else {
+    state = cp->state;
+  }
+  cp->state = PORT_UNKNOWN;
 
-  port_list[protocol][portno] = NULL;
+  state_counts_proto[mapped_protocol][state]--;
+  state_counts_proto[mapped_protocol][default_port_state[mapped_protocol].state]++;
 
   if (o.verbose) {
     log_write(LOG_STDOUT, "Deleting port %hu/%s, which we thought was %s\n",
-              portno, proto2ascii_lowercase(answer->proto),
-              statenum2str(answer->state));
+              portno, proto2ascii_lowercase(protocol),
+              statenum2str(state));
     log_flush(LOG_STDOUT);
   }
 
@@ -730,8 +813,8 @@ void PortList::initializePortMap(int protocol, u16 *ports, int portcount) {
     port_map_rev[proto][i] = ports[i];
   }
   /* So now port_map should have such structure (lets scan 2nd,4th and 6th port):
-   * 	port_map[0,0,1,0,2,0,3,...]	        <- indexes to port_list structure
-   * 	port_list[port_2,port_4,port_6] */
+   * 	port_map[0,0,1,0,2,0,3,...]	        <- indexes to compact_ports structure
+   * 	compact_ports[port_2,port_4,port_6] */
 }
 
   /* Cycles through the 0 or more "ignored" ports which should be
@@ -889,6 +972,24 @@ bool PortList::isTCPwrapped(u16 portno) const {
 int PortList::setStateReason(u16 portno, u8 proto, reason_t reason, u8 ttl,
   const struct sockaddr_storage *ip_addr) {
     Port *answer = NULL;
+    compact_port *cp;
+    u16 mapped_portno = portno;
+    u8 mapped_protocol = proto;
+
+    mapPort(&mapped_portno, &mapped_protocol);
+    cp = getCompactPort(mapped_portno, mapped_protocol);
+
+    /* A reason without an address fits in the compact entry. */
+    if (cp->state != COMPACT_PORT_FULL && reason <= 0xff
+        && (ip_addr == NULL || ip_addr->ss_family == AF_UNSPEC)) {
+      if (cp->state == PORT_UNKNOWN)
+        cp->state = default_port_state[mapped_protocol].state;
+      if (cp->state != PORT_UNKNOWN) {
+        cp->reason_id = reason;
+        cp->ttl = ttl;
+        return 0;
+      }
+    }
 
     answer = createPort(portno, proto);
 
@@ -71,6 +71,7 @@
 
 #include "portreasons.h"
 
+#include <map>
 #include <vector>
 
 /* port states */
@@ -268,8 +269,10 @@ class PortList {
 
  private:
   void mapPort(u16 *portno, u8 *protocol) const;
-  /* Get Port structure from PortList structure.*/
+  /* Get the full Port structure of a port, or NULL if it has none. */
   const Port *lookupPort(u16 portno, u8 protocol) const;
+  /* Get the full Port structure of a port, creating it from the port's
+     compact entry (or the default state) if necessary. */
   Port *createPort(u16 portno, u8 protocol);
   /* Set Port structure to PortList structure.*/
   void  setPortEntry(u16 portno, u8 protocol, Port *port);
@@ -279,14 +282,28 @@ class PortList {
   char *idstr;
   /* Number of ports in each state per each protocol. */
   int state_counts_proto[PORTLIST_PROTO_MAX][PORT_HIGHEST_STATE];
-  Port **port_list[PORTLIST_PROTO_MAX];
+  /* Ports that have left the default state are stored in two tiers. Each
+     has an entry in compact_ports, indexed through port_map, which is all a
+     closed or filtered port with a plain reason needs. Open ports, and ports
+     with a reason address, service or script results, also get a full Port
+     object in full_ports (keyed by the same index), and their compact entry's
+     state is COMPACT_PORT_FULL. An entry with state PORT_UNKNOWN, or a NULL
+     compact_ports array, means the port is in default_port_state. */
+  struct compact_port {
+    u8 state;
+    u8 reason_id;
+    u8 ttl;
+  };
+  compact_port *compact_ports[PORTLIST_PROTO_MAX];
+  std::map<u16, Port *> full_ports[PORTLIST_PROTO_MAX];
+  compact_port *getCompactPort(u16 mapped_portno, u8 mapped_protocol);
  protected:
-  /* Maps port_number to index in port_list array.
+  /* Maps port_number to index in compact_ports array.
    * Only functions: getPortEntry, setPortEntry, initializePortMap and
    * nextPort should access this structure directly. */
   static u16 *port_map[PORTLIST_PROTO_MAX];
   static u16 *port_map_rev[PORTLIST_PROTO_MAX];
-  /* Number of allocated elements in port_list per each protocol. */
+  /* Number of scanned ports (entries in compact_ports) per each protocol. */
   static int port_list_count[PORTLIST_PROTO_MAX];
   Port default_port_state[PORTLIST_PROTO_MAX];
 };
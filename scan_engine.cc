@@ -101,6 +101,14 @@ extern "C" int g_has_npcap_loopback;
 /* How long extra to wait before retransmitting for rate-limit detection */
 #define RLD_TIME_MS 1000
 
+/* The minimum port scan group size with --inline-discovery */
+#define INLINE_DISCOVERY_GROUP_SZ 256
+
+/* How many ports of an --inline-discovery SYN scan are probed on a target
+   before it has answered anything. Every probe sent to a target that turns
+   out to be down is wasted, so this is kept to the first port. */
+#define DISCOVERY_PORT_PROBES 1
+
 int HssPredicate::operator() (const HostScanStats *lhs, const HostScanStats *rhs) const {
   const struct sockaddr_storage *lss, *rss;
   lss = (lhs) ? lhs->target->TargetSockAddr() : ss;
@@ -451,6 +459,7 @@ HostScanStats::HostScanStats(Target *t, UltraScanInfo *UltraSI) {
   sent_icmp_ping = false;
   sent_icmp_mask = false;
   sent_icmp_ts = false;
+  next_discoveryidx = 0;
   retry_capped_warned = false;
   num_probes_active = 0;
   num_probes_waiting_retransmit = 0;
@@ -833,6 +842,73 @@ static void set_default_port_state(std::vector<Target *> &targets, stype scantyp
 
 /* Order of initializations in this function CAN BE IMPORTANT, so be careful
  mucking with it. */
+/* Fills in USI->discovery_probes with the host discovery probes selected by
+   o.pingtype, in the order that a ping scan sends them. */
+static void init_discovery_probes(UltraScanInfo *USI) {
+  probespec pspec;
+  int i, j;
+
+  USI->inline_discovery = true;
+
+  if (o.pingtype & PINGTYPE_ICMP_PING) {
+    memset(&pspec, 0, sizeof(pspec));
+    if (o.af() == AF_INET6) {
+      pspec.type = PS_ICMPV6;
+      pspec.proto = IPPROTO_ICMPV6;
+      pspec.pd.icmpv6.type = ICMPV6_ECHO;
+    } else {
+      pspec.type = PS_ICMP;
+      pspec.proto = IPPROTO_ICMP;
+      pspec.pd.icmp.type = ICMP_ECHO;
+    }
+    USI->discovery_probes.push_back(pspec);
+  }
+  if (o.pingtype & PINGTYPE_TCP_USE_SYN) {
+    for (i = 0; i < USI->ports->syn_ping_count; i++) {
+      memset(&pspec, 0, sizeof(pspec));
+      pspec.type = PS_TCP;
+      pspec.proto = IPPROTO_TCP;
+      pspec.pd.tcp.dport = USI->ports->syn_ping_ports[i];
+      pspec.pd.tcp.flags = TH_SYN;
+      USI->discovery_probes.push_back(pspec);
+      /* A SYN to a scanned port is the port probe too; its response is
+         recorded like any other, and the port is not probed again. */
+      for (j = 0; j < USI->ports->tcp_count; j++) {
+        if (USI->ports->tcp_ports[j] == pspec.pd.tcp.dport)
+          break;
+      }
+      if (j == USI->ports->tcp_count)
+        USI->discovery_syn_ports.push_back(pspec.pd.tcp.dport);
+      else
+        USI->discovery_port_probes[pspec.pd.tcp.dport] = USI->discovery_probes.size() - 1;
+    }
+  }
+  if (o.pingtype & PINGTYPE_TCP_USE_ACK) {
+    for (i = 0; i < USI->ports->ack_ping_count; i++) {
+      memset(&pspec, 0, sizeof(pspec));
+      pspec.type = PS_TCP;
+      pspec.proto = IPPROTO_TCP;
+      pspec.pd.tcp.dport = USI->ports->ack_ping_ports[i];
+      pspec.pd.tcp.flags = TH_ACK;
+      USI->discovery_probes.push_back(pspec);
+    }
+  }
+  if (o.af() == AF_INET && (o.pingtype & PINGTYPE_ICMP_TS)) {
+    memset(&pspec, 0, sizeof(pspec));
+    pspec.type = PS_ICMP;
+    pspec.proto = IPPROTO_ICMP;
+    pspec.pd.icmp.type = ICMP_TSTAMP;
+    USI->discovery_probes.push_back(pspec);
+  }
+  if (o.af() == AF_INET && (o.pingtype & PINGTYPE_ICMP_MASK)) {
+    memset(&pspec, 0, sizeof(pspec));
+    pspec.type = PS_ICMP;
+    pspec.proto = IPPROTO_ICMP;
+    pspec.pd.icmp.type = ICMP_MASK;
+    USI->discovery_probes.push_back(pspec);
+  }
+}
+
 void UltraScanInfo::Init(std::vector<Target *> &Targets, const struct scan_lists *pts, stype scantp) {
   unsigned int targetno = 0;
   HostScanStats *hss;
@@ -848,6 +924,7 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, const struct scan_lists
   send_rate_meter.start(&now);
   tcp_scan = udp_scan = sctp_scan = prot_scan = false;
   ping_scan = noresp_open_scan = ping_scan_arp = ping_scan_nd = false;
+  inline_discovery = false;
   memset((char *) &ptech, 0, sizeof(ptech));
   perf.init();
   switch (scantype) {
@@ -910,6 +987,15 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, const struct scan_lists
     break;
   }
 
+  if (scantype == SYN_SCAN && o.inline_discovery) {
+    for (targetno = 0; targetno < Targets.size(); targetno++) {
+      if (Targets[targetno]->discovery_pending) {
+        init_discovery_probes(this);
+        break;
+      }
+    }
+  }
+
   set_default_port_state(Targets, scantype);
 
   /* Keep a completed host around for a standard TCP MSL (2 min) */
@@ -972,6 +1058,19 @@ void UltraScanInfo::Init(std::vector<Target *> &Targets, const struct scan_lists
   base_port = UltraScanInfo::increment_base_port();
 }
 
+bool UltraScanInfo::isDiscoveryProbe(const probespec *pspec) const {
+  if (!inline_discovery)
+    return false;
+  if (pspec->type == PS_ICMP || pspec->type == PS_ICMPV6)
+    return true;
+  if (pspec->type != PS_TCP)
+    return false;
+  if (pspec->pd.tcp.flags != TH_SYN)
+    return true;
+  return std::find(discovery_syn_ports.begin(), discovery_syn_ports.end(),
+                   pspec->pd.tcp.dport) != discovery_syn_ports.end();
+}
+
 /* Return the total number of probes that may be sent to each host. This never
    changes after initialization. */
 unsigned int UltraScanInfo::numProbesPerHost() const {
@@ -1170,6 +1269,15 @@ int UltraScanInfo::removeCompletedHosts() {
     assert(hss);
     // Don't bother checking timedOut for discovery scans or if the target is already completed.
     if (hss->completed() || (timedout = (!ping_scan) && hss->target->timedOut(&now)) != false) {
+      /* A target that ran out of probes without answering any is down. */
+      if (hss->discovering() && !timedout) {
+        if (o.debugging > 1)
+          log_write(LOG_PLAIN, "%s did not answer any %s probes; marking it down.\n",
+                    hss->target->targetipstr(), scantype2str(scantype));
+        hss->target->flags = HOST_DOWN;
+        hss->target->reason.reason_id = ER_NORESPONSE;
+        hss->target->discovery_pending = false;
+      }
       /* A host to remove!  First adjust nextI appropriately */
       if (nextI == hostI && incompleteHosts.size() > 1) {
         nextI++;
@@ -1260,6 +1368,14 @@ int determineScanGroupSize(int hosts_scanned_so_far,
     }
   }
 
+  /* With --inline-discovery the group holds every address rather than just
+     the live hosts, and most addresses of a sparse range drop out as soon as
+     their discovery probes time out. Size the group like a host discovery
+     batch so that replies from the live hosts open up the congestion window
+     for the rest. */
+  if (o.inline_discovery)
+    groupsize = MAX(groupsize, INLINE_DISCOVERY_GROUP_SZ);
+
   groupsize = box(o.minHostGroupSz(), o.maxHostGroupSz(), groupsize);
 
   if (o.max_ips_to_scan && (o.max_ips_to_scan - hosts_scanned_so_far) < (unsigned int)groupsize)
@@ -1296,6 +1412,12 @@ static int get_next_target_probe(UltraScanInfo *USI, HostScanStats *hss,
   assert(pspec);
 
   if (USI->tcp_scan) {
+    if (hss->discovering()
+        && hss->next_discoveryidx < USI->discovery_probes.size()) {
+      *pspec = USI->discovery_probes[hss->next_discoveryidx++];
+      hss->skipDiscoveryPorts();
+      return 0;
+    }
     if (hss->next_portidx >= USI->ports->tcp_count)
       return -1;
     if (USI->scantype == CONNECT_SCAN)
@@ -1305,6 +1427,7 @@ static int get_next_target_probe(UltraScanInfo *USI, HostScanStats *hss,
     pspec->proto = IPPROTO_TCP;
 
     pspec->pd.tcp.dport = USI->ports->tcp_ports[hss->next_portidx++];
+    hss->skipDiscoveryPorts();
     if (USI->scantype == CONNECT_SCAN)
       pspec->pd.tcp.flags = TH_SYN;
     else if (o.scanflags != -1)
@@ -1474,6 +1597,11 @@ static int get_next_target_probe(UltraScanInfo *USI, HostScanStats *hss,
 /* Returns whether there are ports remaining to probe */
 bool HostScanStats::freshPortsLeft() const {
   if (USI->tcp_scan) {
+    /* Until the target answers, it only gets the discovery probes and its
+       first few ports. */
+    if (discovering())
+      return next_discoveryidx < USI->discovery_probes.size()
+             || next_portidx < MIN(USI->ports->tcp_count, DISCOVERY_PORT_PROBES);
     return (next_portidx < USI->ports->tcp_count);
   } else if (USI->udp_scan) {
     return (next_portidx < USI->ports->udp_count);
@@ -1713,6 +1841,23 @@ void HostScanStats::markProbeTimedout(std::list<UltraProbe *>::iterator probeI)
   }
 }
 
+bool HostScanStats::discovering() const {
+  return USI->inline_discovery && target->discovery_pending;
+}
+
+void HostScanStats::skipDiscoveryPorts() {
+  std::map<u16, unsigned int>::const_iterator it;
+
+  if (USI->discovery_port_probes.empty())
+    return;
+  while (next_portidx < USI->ports->tcp_count) {
+    it = USI->discovery_port_probes.find(USI->ports->tcp_ports[next_portidx]);
+    if (it == USI->discovery_port_probes.end() || it->second >= next_discoveryidx)
+      break;
+    next_portidx++;
+  }
+}
+
 bool HostScanStats::completed() const {
   /* If there are probes active or awaiting retransmission, we are not done. */
   if (num_probes_active != 0 || num_probes_waiting_retransmit != 0
@@ -1999,6 +2144,29 @@ void ultrascan_ping_update(UltraScanInfo *USI, HostScanStats *hss,
   hss->destroyOutstandingProbe(probeI);
 }
 
+/* Called when a target of an --inline-discovery scan that has not been found
+   up yet answers a probe, directly (reason_sip is NULL or AF_UNSPEC) or via an
+   ICMP error from another address. Only a direct answer marks the target up,
+   after which it gets the rest of its ports probed. */
+void ultrascan_discovery_update(UltraScanInfo *USI, HostScanStats *hss,
+                                reason_t reason, const struct sockaddr_storage *reason_sip,
+                                unsigned short ttl) {
+  if (!hss->discovering())
+    return;
+  if (reason_sip != NULL && reason_sip->ss_family != AF_UNSPEC)
+    return;
+  if (o.discovery_ignore_rst && reason == ER_RESETPEER)
+    return;
+
+  if (o.debugging > 1)
+    log_write(LOG_PLAIN, "%s answered a %s probe (%s); continuing its port scan.\n",
+              hss->target->targetipstr(), scantype2str(USI->scantype),
+              reason_str(reason, SINGULAR));
+  hss->target->discovery_pending = false;
+  hss->target->reason.reason_id = reason;
+  hss->target->reason.ttl = ttl;
+}
+
 static const char *readhoststate(int state) {
   switch (state) {
   case HOST_UNKNOWN:
@@ -68,6 +68,7 @@
 
 #include "scan_lists.h"
 #include "probespec.h"
+#include "portreasons.h"
 
 #include <dnet.h>
 
@@ -76,6 +77,7 @@
 #include <pcap.h>
 #include <list>
 #include <vector>
+#include <map>
 #include <set>
 #include <algorithm>
 class Target;
@@ -357,6 +359,14 @@ public:
   bool sent_icmp_mask;
   /* Whether we have sent an ICMP timestamp request. */
   bool sent_icmp_ts;
+  /* The index of the next probe in USI->discovery_probes to send. */
+  unsigned int next_discoveryidx;
+  /* Returns true if this target has not answered any probe yet in an
+     --inline-discovery scan. */
+  bool discovering() const;
+  /* Moves next_portidx past the ports that this target already got a SYN to
+     as one of its discovery probes. */
+  void skipDiscoveryPorts();
 
   /* Have we warned that we've given up on a port for this host yet? Only one
      port per host is reported. */
@@ -562,6 +572,20 @@ public:
       rawprotoscan: 1;
   } ptech;
 
+  /* Set when host discovery for the targets is done as part of this SYN scan
+     (--inline-discovery). Targets that have not answered yet are sent
+     discovery_probes alongside their first few port probes. */
+  bool inline_discovery;
+  std::vector<probespec> discovery_probes;
+  /* The SYN ping ports in discovery_probes that are not also scanned. */
+  std::vector<u16> discovery_syn_ports;
+  /* The SYN ping ports in discovery_probes that are also scanned, with the
+     index of their probe. That probe stands in for the port probe. */
+  std::map<u16, unsigned int> discovery_port_probes;
+  /* Returns true if pspec is one of discovery_probes and not a probe of the
+     port scan itself, so a response to it says nothing about a port. */
+  bool isDiscoveryProbe(const probespec *pspec) const;
+
   bool isRawScan() const;
 
   struct timeval now; /* Updated after potentially meaningful delays.  This can
@@ -679,5 +703,9 @@ void ultrascan_ping_update(UltraScanInfo *USI, HostScanStats *hss,
                                   std::list<UltraProbe *>::iterator probeI,
                                   struct timeval *rcvdtime,
                                   bool adjust_timing = true);
+
+void ultrascan_discovery_update(UltraScanInfo *USI, HostScanStats *hss,
+                                reason_t reason, const struct sockaddr_storage *reason_sip,
+                                unsigned short ttl);
 #endif /* SCAN_ENGINE_H */
 
@@ -368,6 +368,19 @@ static bool tcp_probe_match(const UltraScanInfo *USI, const UltraProbe *probe,
     return false;
   }
 
+  /* In an --inline-discovery scan, an ACK discovery probe and a SYN port probe
+     to the same port can be outstanding at once. A reset answering the SYN
+     carries an ACK; one answering the ACK probe does not. */
+  if (USI->inline_discovery && (tcp->th_flags & TH_RST)
+      && ((probedata->flags & TH_ACK) != 0) == ((tcp->th_flags & TH_ACK) != 0)) {
+    if (probedata->flags & TH_ACK)
+      return false;
+    for (int i = 0; i < USI->ports->ack_ping_count; i++) {
+      if (USI->ports->ack_ping_ports[i] == probe->dport())
+        return false;
+    }
+  }
+
   /* Sometimes we get false results when scanning localhost with -p- because we
      scan localhost with src port = dst port and see our outgoing packet and
      think it is a response. */
@@ -379,6 +392,30 @@ static bool tcp_probe_match(const UltraScanInfo *USI, const UltraProbe *probe,
   return true;
 }
 
+/* Finds the outstanding ICMP discovery probe of an --inline-discovery scan
+   that an echo, timestamp, or address mask reply answers. */
+static bool find_icmp_discovery_probe(const UltraScanInfo *USI, HostScanStats *hss,
+                                      const struct ppkt *ping,
+                                      const struct abstract_ip_hdr *hdr,
+                                      std::list<UltraProbe *>::iterator *probeI) {
+  struct sockaddr_storage target_src;
+  size_t ss_len;
+  std::list<UltraProbe *>::iterator it;
+
+  ss_len = sizeof(target_src);
+  hss->target->SourceSockAddr(&target_src, &ss_len);
+  for (it = hss->probes_outstanding.end(); it != hss->probes_outstanding.begin(); ) {
+    it--;
+    if (icmp_probe_match(USI, *it, ping, &target_src, &hdr->src, &hdr->dst,
+                         hdr->proto, hdr->ipid)) {
+      *probeI = it;
+      return true;
+    }
+  }
+
+  return false;
+}
+
 /* Tries to get one *good* (finishes a probe) pcap response to a host discovery
    (ping) probe by the (absolute) time given in stime.  Even if stime is now,
    try an ultra-quick pcap read just in case.  Returns true if a "good" result
@@ -1526,6 +1563,7 @@ bool get_arp_result(UltraScanInfo *USI, struct timeval *stime) {
         continue;
       /* Add found HW address for target */
       hss->target->setMACAddress(rcvdmac);
+      mac_cache_set((struct sockaddr_storage *) &sin, rcvdmac);
       hss->target->reason.reason_id = ER_ARPRESPONSE;
 
       if (hss->probes_outstanding.empty()) {
@@ -1605,8 +1643,10 @@ bool get_ns_result(UltraScanInfo *USI, struct timeval *stime) {
         continue;
       /* Add found HW address for target */
       /* A Neighbor Advertisement packet may not include the Target link-layer address. */
-      if (has_mac)
+      if (has_mac) {
         hss->target->setMACAddress(rcvdmac);
+        mac_cache_set((struct sockaddr_storage *) &sin6, rcvdmac);
+      }
       hss->target->reason.reason_id = ER_NDRESPONSE;
 
       if (hss->probes_outstanding.empty()) {
@@ -1852,6 +1892,21 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
       if (datalen < 8)
         continue;
+
+      if (USI->inline_discovery
+          && (icmp->icmp_type == 0 || icmp->icmp_type == 14 || icmp->icmp_type == 18)) {
+        hss = USI->findHost(&hdr.src);
+        if (!hss)
+          continue; // Not from a host that interests us
+        setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
+        if (find_icmp_discovery_probe(USI, hss, (const struct ppkt *) data, &hdr, &probeI)) {
+          probe = *probeI;
+          current_reason = icmp_to_reason(hdr.proto, icmp->icmp_type, icmp->icmp_code);
+          goodone = true;
+        }
+        continue;
+      }
+
       if (icmp->icmp_type != 3 && icmp->icmp_type != 11)
         continue;
 
@@ -1981,6 +2036,20 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
 
       if (datalen < 8)
         continue;
+
+      if (USI->inline_discovery && icmpv6->icmpv6_type == ICMPV6_ECHOREPLY) {
+        hss = USI->findHost(&hdr.src);
+        if (!hss)
+          continue; // Not from a host that interests us
+        setTargetMACIfAvailable(hss->target, &linkhdr, &hdr.src, 0);
+        if (find_icmp_discovery_probe(USI, hss, (const struct ppkt *) data, &hdr, &probeI)) {
+          probe = *probeI;
+          current_reason = icmp_to_reason(hdr.proto, icmpv6->icmpv6_type, icmpv6->icmpv6_code);
+          goodone = true;
+        }
+        continue;
+      }
+
       if (!(icmpv6->icmpv6_type == ICMPV6_UNREACH || icmpv6->icmpv6_type == ICMPV6_PARAMPROBLEM))
         continue;
 
@@ -2181,8 +2250,13 @@ bool get_pcap_result(UltraScanInfo *USI, struct timeval *stime) {
       reason_sip.ss_family = AF_UNSPEC;
     else
       reason_sip = hdr.src;
+    ultrascan_discovery_update(USI, hss, current_reason, &reason_sip, hdr.ttl);
     if (probe->isPing())
       ultrascan_ping_update(USI, hss, probeI, &rcvdtime, adjust_timing);
+    else if (USI->isDiscoveryProbe(probe->pspec()))
+      ultrascan_host_probe_update(USI, hss, probeI,
+                                  reason_sip.ss_family == AF_UNSPEC ? HOST_UP : HOST_UNKNOWN,
+                                  &rcvdtime, adjust_timing);
     else {
       /* Save these values so we can use them after ultrascan_port_probe_update
          deletes probe. */
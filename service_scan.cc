@@ -73,6 +73,7 @@
 #include "nmap_error.h"
 #include "protocols.h"
 #include "scan_lists.h"
+#include "string_pool.h"
 
 #include "nmap_tty.h"
 
@@ -106,9 +107,13 @@
 
 #include <algorithm>
 #include <list>
+#include <map>
+#include <string>
 
 extern NmapOps o;
 
+struct ServiceHostQueue;
+
 // Details on a particular service (open port) we are trying to match
 class ServiceNFO {
 public:
@@ -129,9 +134,16 @@ public:
   // available anyway.  This function terminates the service fingerprint
   // with a semi-colon
   const char *getServiceFingerprint(int *flen);
+  // Replaces the service fingerprint with fp, as returned by
+  // getServiceFingerprint() in an earlier scan.
+  void setServiceFingerprint(const char *fp);
 
   // Note that the next 2 members are for convenience and are not destroyed w/the ServiceNFO
   Target *target; // the port belongs to this target host
+  ServiceHostQueue *hostq; // the ServiceGroup's work queues for target
+  // Position in ServiceGroup::services_in_progress, valid while in_progress.
+  std::list<ServiceNFO *>::iterator in_progress_pos;
+  bool in_progress;
   // if a match is found, it is placed here.  Otherwise NULL
   const char *probe_matched;
   // If a match is found, any product/version/info/hostname/ostype/devicetype
@@ -188,8 +200,30 @@ public:
   // Is it possible this service is tcpwrapped? Not if a probe times out or
   // gets a real response.
   bool tcpwrap_possible;
+  // Whether the NULL probe got a response, and the tunnel it came through.
+  // With --service-cache, nullresp_hash is a hash of that response; these,
+  // the address and the port identify the service in the cache.
+  bool nullresp_seen;
+  u64 nullresp_hash;
+  enum service_tunnel_type nullresp_tunnel;
+  // Was the result taken from the cache? Should a cache hit be ignored so
+  // that the entry gets verified by a full scan?
+  bool from_cache;
+  bool cache_verify;
+  // With --version-adaptive, the ProbeStats keys the current probe order was
+  // chosen by; empty before the first ordering.
+  std::string order_portkey;
+  std::string order_classkey;
 
 private:
+  // The probes to walk in the current phase: AP->probes, or with
+  // --version-adaptive, probe_order.
+  std::vector<ServiceProbe *> &phaseProbes() {
+    return o.version_adaptive ? probe_order : AP->probes;
+  }
+  // Sorts the probes into probe_order for the next phase.
+  void orderProbes();
+  std::vector<ServiceProbe *> probe_order;
   // Adds a character to servicefp.  Takes care of word wrapping if
   // necessary at the given (wrapat) column.  Chars will only be
   // written if there is enough space.  Otherwise it exits.
@@ -204,17 +238,50 @@ private:
   int servicefpalloc;
 };
 
+// The services of one target host in a ServiceGroup, so that whether the host
+// is done can be told without looking at the services of other hosts.
+struct ServiceHostQueue {
+  Target *target;
+  // Services not started yet, by tier: those on known open ports (0) are all
+  // tried before the speculative open|filtered ones (1).
+  std::list<ServiceNFO *> remaining[2];
+  // Whether this host is in ServiceGroup::ready_hosts[tier]
+  bool ready[2];
+  unsigned int in_progress; // Services of this host currently being probed
+  bool done() const {
+    return in_progress == 0 && remaining[0].empty() && remaining[1].empty();
+  }
+};
+
 // This holds the service information for a group of Targets being service scanned.
 class ServiceGroup {
 public:
   ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP);
   ~ServiceGroup();
+  // Queues svc as not started yet, behind the host's other services of tier.
+  void addRemaining(ServiceNFO *svc, int tier);
+  // Takes the next service to start off the remaining queues, going round
+  // robin over the hosts so each gets its turn. Returns NULL if none remain.
+  ServiceNFO *nextRemaining();
+  // Moves svc to services_in_progress / services_finished.
+  void setInProgress(ServiceNFO *svc);
+  void setFinished(ServiceNFO *svc);
+  // Fraction of services finished, for the progress meter.
+  double completion() const {
+    return services_finished.size() /
+      ((double) num_remaining + services_in_progress.size() + services_finished.size());
+  }
   std::list<ServiceNFO *> services_finished; // Services finished (discovered or not)
   std::list<ServiceNFO *> services_in_progress; // Services currently being probed
-  std::list<ServiceNFO *> services_remaining; // Probes not started yet
+  std::vector<ServiceHostQueue *> hosts; // Per-host queues of services not started yet
+  std::list<ServiceHostQueue *> ready_hosts[2]; // Hosts with remaining services, by tier
+  unsigned int num_remaining; // Services not started yet, over all hosts
   unsigned int ideal_parallelism; // Max (and desired) number of probes out at once.
   ScanProgressMeter *SPM;
   int num_hosts_timedout; // # of hosts timed out during (or before) scan
+  // Time spent testing responses against match lines, for -d statistics.
+  unsigned int responses_tested;
+  long match_usec;
 };
 
 #define SUBSTARGS_MAX_ARGS 5
@@ -248,6 +315,7 @@ ServiceProbeMatch::ServiceProbeMatch() {
   hostname_template = ostype_template = devicetype_template = NULL;
   regex_compiled = NULL;
   regex_extra = NULL;
+  match_prefixlen = 0;
   isInitialized = false;
   matchops_ignorecase = false;
   matchops_dotall = false;
@@ -269,7 +337,11 @@ ServiceProbeMatch::~ServiceProbeMatch() {
     free(*it);
   matchstrlen = 0;
   if (regex_compiled) pcre_free(regex_compiled);
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (regex_extra) pcre_free_study(regex_extra);
+#else
   if (regex_extra) pcre_free(regex_extra);
+#endif
   isInitialized = false;
   matchops_anchor = -1;
 }
@@ -338,6 +410,368 @@ static bool next_template(const char **matchtext, char **modestr, char **tmplt,
   return true;
 }
 
+#ifdef PCRE_STUDY_JIT_COMPILE
+/* JIT stack shared by all match regexes. Matching happens on one thread, so
+   one is enough. Allocated when the first regex is JIT-compiled. */
+static pcre_jit_stack *match_jit_stack = NULL;
+#endif
+
+/* Counts and times for compiling the match regexes, printed with -d. */
+static struct {
+  unsigned int compiled;
+  unsigned int jit_compiled;
+  long compile_usec;
+  long study_usec;
+} match_regex_stats;
+
+/* Studies a compiled match regex, also JIT-compiling it if the PCRE library
+   supports that. PCRE quietly leaves out the JIT code for patterns it can't
+   handle, and those are run by the interpreter as before. Always returns a
+   pcre_extra, so that the caller can set match limits in it. */
+static pcre_extra *study_match_regex(const pcre *regex, int lineno) {
+  struct timeval start, end;
+  const char *errptr;
+  pcre_extra *extra;
+  int study_ops = 0;
+
+#ifdef PCRE_STUDY_EXTRA_NEEDED
+  study_ops |= PCRE_STUDY_EXTRA_NEEDED;
+#endif
+#ifdef PCRE_STUDY_JIT_COMPILE
+  study_ops |= PCRE_STUDY_JIT_COMPILE;
+#endif
+
+  gettimeofday(&start, NULL);
+  extra = pcre_study(regex, study_ops, &errptr);
+  gettimeofday(&end, NULL);
+  match_regex_stats.study_usec += TIMEVAL_SUBTRACT(end, start);
+  if (errptr != NULL)
+    fatal("%s: failed to pcre_study regexp on line %d of nmap-service-probes: %s\n", __func__, lineno, errptr);
+
+  if (!extra) {
+    extra = (pcre_extra *) pcre_malloc(sizeof(pcre_extra));
+    memset(extra, 0, sizeof(pcre_extra));
+  }
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+  int jit = 0;
+  if (pcre_fullinfo(regex, extra, PCRE_INFO_JIT, &jit) == 0 && jit) {
+    /* The default JIT stack is 32K on the machine stack, which some of the
+       larger regexes exhaust. */
+    if (match_jit_stack == NULL)
+      match_jit_stack = pcre_jit_stack_alloc(32 * 1024, 1024 * 1024);
+    if (match_jit_stack != NULL)
+      pcre_assign_jit_stack(extra, NULL, match_jit_stack);
+    match_regex_stats.jit_compiled++;
+  }
+#endif
+
+  return extra;
+}
+
+/* Compiled match regexes can be kept in a cache file (--versiondb-cache) so
+   that they don't have to be compiled and studied on every start. A cache is
+   only used if it was built from a probes file with the same contents, by
+   the same versions of Nmap and PCRE; otherwise it is rebuilt. Entries are
+   in the order the match lines appear in the file. Each blob is followed by
+   its FNV-1a hash, because PCRE trusts a compiled pattern completely: a
+   damaged one would be read out of bounds when matching. */
+#define REGEX_CACHE_MAGIC "NmapRegexCache2"
+
+struct regex_cache_header {
+  char magic[16];
+  char nmap_version[32];
+  char pcre_version[32];
+  u64 probes_hash;
+  u64 probes_size;
+  u32 count;
+};
+
+class RegexCache {
+public:
+  RegexCache() : active(false), valid(false), next(0) {}
+  bool load(const char *filename, u64 hash, u64 size);
+  bool fetch(pcre **regex, pcre_extra **extra);
+  void store(const pcre *regex, const pcre_extra *extra);
+  void save(const char *filename, u64 hash, u64 size) const;
+
+  bool active; /* Is a cache in use for the file being parsed? */
+  bool valid; /* Were the entries loaded from a matching cache file? */
+private:
+  unsigned int next;
+  std::vector<std::string> regexes, studies;
+};
+
+static RegexCache regex_cache;
+
+static void regex_cache_init_header(struct regex_cache_header *hdr, u64 hash, u64 size) {
+  memset(hdr, 0, sizeof(*hdr));
+  Strncpy(hdr->magic, REGEX_CACHE_MAGIC, sizeof(hdr->magic));
+  Strncpy(hdr->nmap_version, NMAP_VERSION, sizeof(hdr->nmap_version));
+  Strncpy(hdr->pcre_version, pcre_version(), sizeof(hdr->pcre_version));
+  hdr->probes_hash = hash;
+  hdr->probes_size = size;
+}
+
+static bool read_cache_blob(FILE *fp, std::string *blob) {
+  u32 len;
+  u64 checksum;
+  char *buf;
+
+  if (fread(&len, sizeof(len), 1, fp) != 1 || len > 1000000)
+    return false;
+  buf = (char *) safe_malloc(len + 1);
+  if (fread(buf, 1, len, fp) != len
+      || fread(&checksum, sizeof(checksum), 1, fp) != 1
+      || fnv1a_64(FNV1A_64_INIT, (const u8 *) buf, len) != checksum) {
+    free(buf);
+    return false;
+  }
+  blob->assign(buf, len);
+  free(buf);
+  return true;
+}
+
+bool RegexCache::load(const char *filename, u64 hash, u64 size) {
+  struct regex_cache_header hdr, expected;
+  std::string re, study;
+  size_t relen;
+  FILE *fp;
+  u32 i;
+
+  regexes.clear();
+  studies.clear();
+  next = 0;
+  valid = false;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return false;
+  regex_cache_init_header(&expected, hash, size);
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+      || memcmp(&hdr, &expected, offsetof(struct regex_cache_header, count)) != 0) {
+    fclose(fp);
+    return false;
+  }
+  for (i = 0; i < hdr.count; i++) {
+    if (!read_cache_blob(fp, &re) || !read_cache_blob(fp, &study)
+        || re.size() < sizeof(u32))
+      break;
+    /* The magic number at the start of a compiled pattern is checked by
+       pcre_fullinfo; a truncated or foreign blob fails here. */
+    if (pcre_fullinfo((const pcre *) re.data(), NULL, PCRE_INFO_SIZE, &relen) != 0
+        || relen != re.size())
+      break;
+    regexes.push_back(re);
+    studies.push_back(study);
+  }
+  fclose(fp);
+
+  if (i != hdr.count) {
+    regexes.clear();
+    studies.clear();
+    return false;
+  }
+  valid = true;
+  return true;
+}
+
+/* Gets the compiled form of the next regex from a valid cache. The memory is
+   allocated with pcre_malloc, like that from pcre_compile and pcre_study. */
+bool RegexCache::fetch(pcre **regex, pcre_extra **extra) {
+  const std::string *study;
+
+  if (!active || !valid || next >= regexes.size())
+    return false;
+
+  *regex = (pcre *) pcre_malloc(regexes[next].size());
+  memcpy(*regex, regexes[next].data(), regexes[next].size());
+
+  /* pcre_study returns the pcre_extra and its study data in one block, so
+     that pcre_free frees both; do the same. */
+  study = &studies[next];
+  *extra = (pcre_extra *) pcre_malloc(sizeof(pcre_extra) + study->size());
+  memset(*extra, 0, sizeof(pcre_extra));
+  if (study->size() > 0) {
+    memcpy((char *) *extra + sizeof(pcre_extra), study->data(), study->size());
+    (*extra)->flags = PCRE_EXTRA_STUDY_DATA;
+    (*extra)->study_data = (char *) *extra + sizeof(pcre_extra);
+  }
+  next++;
+
+  return true;
+}
+
+void RegexCache::store(const pcre *regex, const pcre_extra *extra) {
+  size_t relen = 0, studylen = 0;
+
+  if (!active || valid)
+    return;
+  pcre_fullinfo(regex, NULL, PCRE_INFO_SIZE, &relen);
+  pcre_fullinfo(regex, extra, PCRE_INFO_STUDYSIZE, &studylen);
+  regexes.push_back(std::string((const char *) regex, relen));
+  if (studylen > 0)
+    studies.push_back(std::string((const char *) extra->study_data, studylen));
+  else
+    studies.push_back(std::string());
+}
+
+static bool write_cache_blob(FILE *fp, const std::string &blob) {
+  u32 len = blob.size();
+  u64 checksum = fnv1a_64(FNV1A_64_INIT, (const u8 *) blob.data(), len);
+
+  return fwrite(&len, sizeof(len), 1, fp) == 1
+    && fwrite(blob.data(), 1, len, fp) == len
+    && fwrite(&checksum, sizeof(checksum), 1, fp) == 1;
+}
+
+/* Writes the stored entries to a temporary file and renames it into place,
+   so that concurrent scans never see a partial cache. */
+void RegexCache::save(const char *filename, u64 hash, u64 size) const {
+  struct regex_cache_header hdr;
+  char tmpname[1024];
+  unsigned int i;
+  bool ok;
+  FILE *fp;
+
+  Snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", filename, (unsigned long) getpid());
+  fp = fopen(tmpname, "wb");
+  if (fp == NULL) {
+    error("Warning: could not create version detection cache file %s: %s", tmpname, strerror(errno));
+    return;
+  }
+  regex_cache_init_header(&hdr, hash, size);
+  hdr.count = regexes.size();
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+  for (i = 0; ok && i < regexes.size(); i++)
+    ok = write_cache_blob(fp, regexes[i]) && write_cache_blob(fp, studies[i]);
+  if (fclose(fp) != 0)
+    ok = false;
+#ifdef WIN32
+  if (ok)
+    remove(filename);
+#endif
+  if (!ok || rename(tmpname, filename) != 0) {
+    error("Warning: could not write version detection cache file %s: %s", filename, strerror(errno));
+    remove(tmpname);
+  }
+}
+
+/* Returns true if the regex might have an alternation ('|') outside of any
+   group, in which case what comes before it is not required to match. */
+static bool regex_may_alternate(const char *regex) {
+  const char *p;
+  int depth = 0;
+
+  for (p = regex; *p != '\0'; p++) {
+    if (*p == '\\') {
+      /* \Q...\E quotes metacharacters; don't try to follow it. */
+      if (p[1] == 'Q')
+        return true;
+      if (p[1] != '\0')
+        p++;
+    } else if (*p == '[') {
+      /* Skip the character class. A ']' right after '[' or '[^' is
+         literal. */
+      p++;
+      if (*p == '^')
+        p++;
+      if (*p == ']')
+        p++;
+      while (*p != '\0' && *p != ']') {
+        if (*p == '\\' && p[1] != '\0')
+          p++;
+        p++;
+      }
+      if (*p == '\0')
+        return true;
+    } else if (*p == '(') {
+      depth++;
+    } else if (*p == ')') {
+      depth--;
+    } else if (*p == '|' && depth <= 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int hexdigit_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  return tolower((int) (unsigned char) c) - 'a' + 10;
+}
+
+/* Fills prefix with the literal bytes that an anchored regex requires at the
+   start of the subject and returns their number, at most MATCH_PREFIX_MAX.
+   Anything that isn't plainly "^" followed by literals ends the prefix; it
+   is always safe to stop early. */
+static int regex_literal_prefix(const char *regex, u8 *prefix) {
+  const char *p, *next;
+  int len = 0;
+  int c;
+
+  if (regex[0] != '^' || regex_may_alternate(regex))
+    return 0;
+
+  for (p = regex + 1; *p != '\0' && len < MATCH_PREFIX_MAX; p = next) {
+    if (*p == '\\') {
+      next = p + 2;
+      if (p[1] == 'x' && isxdigit((int) (unsigned char) p[2])) {
+        c = hexdigit_value(p[2]);
+        next = p + 3;
+        if (isxdigit((int) (unsigned char) p[3])) {
+          c = c * 16 + hexdigit_value(p[3]);
+          next = p + 4;
+        }
+      } else if (p[1] == '0' && !isdigit((int) (unsigned char) p[2])) {
+        c = '\0';
+      } else if (p[1] == 'r') {
+        c = '\r';
+      } else if (p[1] == 'n') {
+        c = '\n';
+      } else if (p[1] == 't') {
+        c = '\t';
+      } else if (p[1] == 'f') {
+        c = '\f';
+      } else if (p[1] == 'a') {
+        c = '\a';
+      } else if (p[1] == 'e') {
+        c = '\033';
+      } else if (p[1] != '\0' && !isalnum((int) (unsigned char) p[1])) {
+        c = (unsigned char) p[1];
+      } else {
+        /* \d, \s, \b, back references, octal escapes... */
+        break;
+      }
+    } else if (strchr(".[]()*+?{}|^$", *p) != NULL) {
+      break;
+    } else {
+      c = (unsigned char) *p;
+      next = p + 1;
+    }
+
+    /* A quantifier may make this byte optional. */
+    if (*next == '*' || *next == '?' || *next == '{')
+      break;
+    prefix[len++] = c;
+    if (*next == '+')
+      break;
+  }
+
+  return len;
+}
+
+/* PCRE_CASELESS without UTF-8 only folds ASCII letters. */
+static inline u8 ascii_tolower(u8 c) {
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline u8 ascii_toupper(u8 c) {
+  return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
 // match text from the nmap-service-probes file.  This must be called
 // before you try and do anything with this match.  This function
 // should be passed the whole line starting with "match" or
@@ -403,35 +837,44 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
       fatal("%s: illegal regexp option on line %d of nmap-service-probes", __func__, lineno);
   }
 
-  // Next we compile and study the regular expression to match
-  if (matchops_ignorecase)
-    pcre_compile_ops |= PCRE_CASELESS;
+  // Next we compile and study the regular expression to match, unless
+  // --versiondb-cache already has it.
+  if (!regex_cache.fetch(&regex_compiled, &regex_extra)) {
+    struct timeval start, end;
 
-  if (matchops_dotall)
-    pcre_compile_ops |= PCRE_DOTALL;
+    if (matchops_ignorecase)
+      pcre_compile_ops |= PCRE_CASELESS;
 
-  regex_compiled = pcre_compile(matchstr, pcre_compile_ops, &pcre_errptr,
-                                   &pcre_erroffset, NULL);
+    if (matchops_dotall)
+      pcre_compile_ops |= PCRE_DOTALL;
 
-  if (regex_compiled == NULL)
-    fatal("%s: illegal regexp on line %d of nmap-service-probes (at regexp offset %d): %s\n", __func__, lineno, pcre_erroffset, pcre_errptr);
+    gettimeofday(&start, NULL);
+    regex_compiled = pcre_compile(matchstr, pcre_compile_ops, &pcre_errptr,
+                                     &pcre_erroffset, NULL);
+    gettimeofday(&end, NULL);
+    match_regex_stats.compile_usec += TIMEVAL_SUBTRACT(end, start);
 
-  // Now study the regexp for greater efficiency
-  regex_extra = pcre_study(regex_compiled, 0
-#ifdef PCRE_STUDY_EXTRA_NEEDED
-  | PCRE_STUDY_EXTRA_NEEDED
-#endif
-  , &pcre_errptr);
-  if (pcre_errptr != NULL)
-    fatal("%s: failed to pcre_study regexp on line %d of nmap-service-probes: %s\n", __func__, lineno, pcre_errptr);
+    if (regex_compiled == NULL)
+      fatal("%s: illegal regexp on line %d of nmap-service-probes (at regexp offset %d): %s\n", __func__, lineno, pcre_erroffset, pcre_errptr);
 
-  if (!regex_extra) {
-    regex_extra = (pcre_extra *) pcre_malloc(sizeof(pcre_extra));
-    memset(regex_extra, 0, sizeof(pcre_extra));
+    // Now study the regexp for greater efficiency
+    regex_extra = study_match_regex(regex_compiled, lineno);
+    regex_cache.store(regex_compiled, regex_extra);
+  }
+#ifdef PCRE_STUDY_JIT_COMPILE
+  else {
+    // Only the interpreter's study data is cached; JIT code has to be
+    // generated afresh.
+    pcre_free(regex_extra);
+    regex_extra = study_match_regex(regex_compiled, lineno);
   }
+#endif
+  match_regex_stats.compiled++;
 
   // Set some limits to avoid evil match cases.
-  // These are flexible; if they cause problems, increase them.
+  // These are flexible; if they cause problems, increase them. JIT code
+  // honors match_limit but not match_limit_recursion; it is bounded by the
+  // size of its stack instead.
 #ifdef PCRE_ERROR_MATCHLIMIT
   regex_extra->match_limit = 100000; // 100K
 #endif
@@ -439,6 +882,12 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
   regex_extra->match_limit_recursion = 10000; // 10K
 #endif
 
+  match_prefixlen = regex_literal_prefix(matchstr, match_prefix);
+  if (matchops_ignorecase) {
+    for (int i = 0; i < match_prefixlen; i++)
+      match_prefix[i] = ascii_tolower(match_prefix[i]);
+  }
+
   free(modestr);
   free(flags);
 
@@ -484,23 +933,14 @@ void ServiceProbeMatch::InitMatch(const char *matchtext, int lineno) {
 }
 
   // If the buf (of length buflen) match the regex in this
-  // ServiceProbeMatch, returns the details of the match (service
-  // name, version number if applicable, and whether this is a "soft"
-  // match.  If the buf doesn't match, the serviceName field in the
-  // structure will be NULL.  The MatchDetails structure returned is
-  // only valid until the next time this function is called. The only
-  // exception is that the serviceName field can be saved throughout
-  // program execution.  If no version matched, that field will be
-  // NULL.
-const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int buflen) {
+  // ServiceProbeMatch, fills in MD with the details of the match
+  // (service name, version number if applicable, and whether this is
+  // a "soft" match) and returns true.  If the buf doesn't match,
+  // returns false and the serviceName field of MD will be NULL.  The
+  // serviceName field can be saved throughout program execution.  If
+  // no version matched, that field will be NULL.
+bool ServiceProbeMatch::testMatch(const u8 *buf, int buflen, struct MatchDetails *MD) const {
   int rc;
-  static char product[80];
-  static char version[80];
-  static char info[256];  /* We will truncate with ... later */
-  static char hostname[80];
-  static char ostype[32];
-  static char devicetype[32];
-  static char cpe_a[80], cpe_h[80], cpe_o[80];
   char *bufc = (char *) buf;
   int ovector[150]; // allows 50 substring matches (including the overall match)
   assert(isInitialized);
@@ -508,8 +948,25 @@ const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int bufle
   assert (matchtype == SERVICEMATCH_REGEX);
 
   // Clear out the output struct
-  memset(&MD_return, 0, sizeof(MD_return));
-  MD_return.isSoft = isSoft;
+  MD->serviceName = NULL;
+  MD->lineno = 0;
+  MD->product = MD->version = MD->info = NULL;
+  MD->hostname = MD->ostype = MD->devicetype = NULL;
+  MD->cpe_a = MD->cpe_h = MD->cpe_o = NULL;
+  MD->isSoft = isSoft;
+
+  // Most regexes are anchored to a literal prefix; check it before
+  // bothering PCRE.
+  if (buflen < match_prefixlen)
+    return false;
+  if (matchops_ignorecase) {
+    for (int i = 0; i < match_prefixlen; i++) {
+      if (ascii_tolower(buf[i]) != match_prefix[i])
+        return false;
+    }
+  } else if (memcmp(buf, match_prefix, match_prefixlen) != 0) {
+    return false;
+  }
 
   rc = pcre_exec(regex_compiled, regex_extra, bufc, buflen, 0, 0, ovector, sizeof(ovector) / sizeof(*ovector));
   if (rc < 0) {
@@ -531,24 +988,32 @@ const struct MatchDetails *ServiceProbeMatch::testMatch(const u8 *buf, int bufle
   } else {
     // Yeah!  Match apparently succeeded.
     // Now lets get the version number if available
-    getVersionStr(buf, buflen, ovector, rc, product, sizeof(product), version, sizeof(version), info, sizeof(info),
-                  hostname, sizeof(hostname), ostype, sizeof(ostype), devicetype, sizeof(devicetype),
-                  cpe_a, sizeof(cpe_a), cpe_h, sizeof(cpe_h), cpe_o, sizeof(cpe_o));
-    if (*product) MD_return.product = product;
-    if (*version) MD_return.version = version;
-    if (*info) MD_return.info = info;
-    if (*hostname) MD_return.hostname = hostname;
-    if (*ostype) MD_return.ostype = ostype;
-    if (*devicetype) MD_return.devicetype = devicetype;
-    if (*cpe_a) MD_return.cpe_a = cpe_a;
-    if (*cpe_h) MD_return.cpe_h = cpe_h;
-    if (*cpe_o) MD_return.cpe_o = cpe_o;
-
-    MD_return.serviceName = servicename;
-    MD_return.lineno = getLineNo();
+    getVersionStr(buf, buflen, ovector, rc,
+                  MD->product_buf, sizeof(MD->product_buf),
+                  MD->version_buf, sizeof(MD->version_buf),
+                  MD->info_buf, sizeof(MD->info_buf),
+                  MD->hostname_buf, sizeof(MD->hostname_buf),
+                  MD->ostype_buf, sizeof(MD->ostype_buf),
+                  MD->devicetype_buf, sizeof(MD->devicetype_buf),
+                  MD->cpe_a_buf, sizeof(MD->cpe_a_buf),
+                  MD->cpe_h_buf, sizeof(MD->cpe_h_buf),
+                  MD->cpe_o_buf, sizeof(MD->cpe_o_buf));
+    if (*MD->product_buf) MD->product = MD->product_buf;
+    if (*MD->version_buf) MD->version = MD->version_buf;
+    if (*MD->info_buf) MD->info = MD->info_buf;
+    if (*MD->hostname_buf) MD->hostname = MD->hostname_buf;
+    if (*MD->ostype_buf) MD->ostype = MD->ostype_buf;
+    if (*MD->devicetype_buf) MD->devicetype = MD->devicetype_buf;
+    if (*MD->cpe_a_buf) MD->cpe_a = MD->cpe_a_buf;
+    if (*MD->cpe_h_buf) MD->cpe_h = MD->cpe_h_buf;
+    if (*MD->cpe_o_buf) MD->cpe_o = MD->cpe_o_buf;
+
+    MD->serviceName = servicename;
+    MD->lineno = getLineNo();
+    return true;
   }
 
-  return &MD_return;
+  return false;
 }
 
 // This simple function parses arguments out of a string.  The string
@@ -1235,13 +1700,7 @@ bool ServiceProbe::portIsProbable(enum service_tunnel_type tunnel, u16 portno) c
  // Returns true if the passed in service name is among those that can
   // be detected by the matches in this probe;
 bool ServiceProbe::serviceIsPossible(const char *sname) const {
-  std::vector<const char *>::const_iterator vi;
-
-  for(vi = detectedServices.begin(); vi != detectedServices.end(); vi++) {
-    if (strcmp(*vi, sname) == 0)
-      return true;
-  }
-  return false;
+  return detectedServices.find(sname) != detectedServices.end();
 }
 
 
@@ -1271,9 +1730,37 @@ void ServiceProbe::addMatch(const char *match, int lineno) {
   ServiceProbeMatch *newmatch = new ServiceProbeMatch();
   newmatch->InitMatch(match, lineno);
   sname = newmatch->getName();
-  if (!serviceIsPossible(sname))
-    detectedServices.push_back(sname);
+  detectedServices.insert(sname);
   matches.push_back(newmatch);
+  match_index_start.clear();
+}
+
+void ServiceProbe::buildMatchIndex() {
+  std::vector<unsigned int> buckets[256];
+  const u8 *prefix;
+  unsigned int i;
+  int b, len;
+
+  match_index.clear();
+  match_index_start.clear();
+  match_index_any.clear();
+
+  for (i = 0; i < matches.size(); i++) {
+    prefix = matches[i]->getPrefix(&len);
+    if (len == 0) {
+      match_index_any.push_back(i);
+      continue;
+    }
+    buckets[prefix[0]].push_back(i);
+    if (matches[i]->ignoreCase() && ascii_toupper(prefix[0]) != prefix[0])
+      buckets[ascii_toupper(prefix[0])].push_back(i);
+  }
+
+  for (b = 0; b < 256; b++) {
+    match_index_start.push_back(match_index.size());
+    match_index.insert(match_index.end(), buckets[b].begin(), buckets[b].end());
+  }
+  match_index_start.push_back(match_index.size());
 }
 
 /* Parses the given nmap-service-probes file into the AP class Must
@@ -1362,6 +1849,12 @@ void parse_nmap_service_probe_file(AllProbes *AP, const char *filename) {
   }
   fclose(fp);
 
+  if (AP->nullProbe)
+    AP->nullProbe->buildMatchIndex();
+  for (std::vector<ServiceProbe *>::iterator pi = AP->probes.begin();
+       pi != AP->probes.end(); pi++)
+    (*pi)->buildMatchIndex();
+
   AP->compileFallbacks();
 }
 
@@ -1369,12 +1862,32 @@ void parse_nmap_service_probe_file(AllProbes *AP, const char *filename) {
 // the already-created 'probes' vector.
 static void parse_nmap_service_probes(AllProbes *AP) {
   char filename[256];
+  u64 hash, size;
 
   if (nmap_fetchfile(filename, sizeof(filename), "nmap-service-probes") != 1){
     fatal("Service scan requested but I cannot find nmap-service-probes file.");
   }
 
+  if (o.versiondb_cache) {
+    if (!hash_file(filename, &hash, &size))
+      pfatal("Failed to open nmap-service-probes file %s for reading", filename);
+    regex_cache.active = true;
+    if (!regex_cache.load(o.versiondb_cache, hash, size) && o.debugging)
+      log_write(LOG_PLAIN, "Rebuilding version detection cache %s\n", o.versiondb_cache);
+  }
+
   parse_nmap_service_probe_file(AP, filename);
+
+  if (regex_cache.active) {
+    if (!regex_cache.valid)
+      regex_cache.save(o.versiondb_cache, hash, size);
+    regex_cache = RegexCache();
+  }
+  if (o.debugging) {
+    log_write(LOG_PLAIN, "Prepared %u version detection regexes: compile %.3fs, study %.3fs (%u JIT-compiled)\n",
+              match_regex_stats.compiled, match_regex_stats.compile_usec / 1000000.0,
+              match_regex_stats.study_usec / 1000000.0, match_regex_stats.jit_compiled);
+  }
   /* Record where this data file was found. */
   o.loaded_data_files["nmap-service-probes"] = filename;
 }
@@ -1396,6 +1909,12 @@ void AllProbes::service_scan_free(void)
     delete global_AP;
     global_AP = NULL;
   }
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (match_jit_stack) {
+    pcre_jit_stack_free(match_jit_stack);
+    match_jit_stack = NULL;
+  }
+#endif
 }
 
 // Function that calls isExcluded() function to check if the port
@@ -1422,28 +1941,42 @@ int AllProbes::check_excluded_port(unsigned short portno, int proto)
 }
 
 // If the buf (of length buflen) matches one of the regexes in this
-// ServiceProbe, returns the details of nth match (service name,
-// version number if applicable, and whether this is a "soft" match.
-// If the buf doesn't match, the serviceName field in the structure
-// will be NULL.  The MatchDetails returned is only valid until the
-// next time this function is called.  The only exception is that the
-// serviceName field can be saved throughout program execution.  If
-// no version matched, that field will be NULL. This function may
-// return NULL if there are no match lines at all in this probe.
-const struct MatchDetails *ServiceProbe::testMatch(const u8 *buf, int buflen, int n = 0) {
-  std::vector<ServiceProbeMatch *>::iterator vi;
-  const struct MatchDetails *MD;
+// ServiceProbe, fills in MD with the details of the nth match (service
+// name, version number if applicable, and whether this is a "soft"
+// match) and returns true.  Otherwise returns false and the serviceName
+// field of MD will be NULL.
+bool ServiceProbe::testMatch(const u8 *buf, int buflen, struct MatchDetails *MD, int n) const {
+  std::vector<unsigned int>::const_iterator bi, bend, ai, aend;
+  unsigned int next;
+
+  assert(!match_index_start.empty());
+  MD->serviceName = NULL;
+
+  /* Merge the matches whose prefix starts with the response's first byte
+     with those that have no prefix, keeping file order. */
+  ai = match_index_any.begin();
+  aend = match_index_any.end();
+  if (buflen > 0) {
+    bi = match_index.begin() + match_index_start[buf[0]];
+    bend = match_index.begin() + match_index_start[buf[0] + 1];
+  } else {
+    bi = bend = match_index.end();
+  }
 
-  for(vi = matches.begin(); vi != matches.end(); vi++) {
-    MD = (*vi)->testMatch(buf, buflen);
-    if (MD->serviceName) {
+  while (ai != aend || bi != bend) {
+    if (bi == bend || (ai != aend && *ai < *bi))
+      next = *ai++;
+    else
+      next = *bi++;
+    if (matches[next]->testMatch(buf, buflen, MD)) {
       if (n == 0)
-        return MD;
+        return true;
       n--;
     }
   }
 
-  return NULL;
+  MD->serviceName = NULL;
+  return false;
 }
 
 AllProbes::AllProbes() {
@@ -1586,8 +2119,438 @@ void AllProbes::compileFallbacks() {
 
 
 
+/* --service-cache keeps the final version detection results of services
+   that sent a banner to the NULL probe. An entry is keyed by address,
+   protocol, port and the tunnel the banner came through, and records a hash
+   of the banner. When a later scan gets the same banner from the same port,
+   it takes the stored result instead of sending the rest of the probes.
+   Entries older than --service-cache-ttl are ignored, and a fraction
+   (--service-cache-verify) of hits are scanned fully anyway to refresh them.
+
+   The file is text, one entry per line, with tab-separated fields in the
+   order they are written by ServiceCache::save(). */
+#define SERVICE_CACHE_HEADER "# Nmap service cache 1\n"
+
+static ServiceCache service_cache;
+
+std::string ServiceCache::key(const ServiceNFO *svc) {
+  char buf[128];
+
+  Snprintf(buf, sizeof(buf), "%s\t%s\t%hu\t%d", svc->target->targetipstr(),
+           IPPROTO2STR(svc->proto), svc->portno, (int) svc->nullresp_tunnel);
+
+  return std::string(buf);
+}
+
+bool ServiceCache::expired(const ServiceCacheEntry &entry) const {
+  return time(NULL) - entry.stored >= o.service_cache_ttl;
+}
+
+/* Escapes the characters that separate fields and entries in the cache
+   file. */
+static void service_cache_put(FILE *fp, const std::string &field) {
+  std::string::const_iterator it;
+
+  putc('\t', fp);
+  for (it = field.begin(); it != field.end(); it++) {
+    switch (*it) {
+    case '\\': fputs("\\\\", fp); break;
+    case '\t': fputs("\\t", fp); break;
+    case '\n': fputs("\\n", fp); break;
+    case '\r': fputs("\\r", fp); break;
+    default: putc(*it, fp); break;
+    }
+  }
+}
+
+/* Splits a line of the cache file into unescaped fields. */
+static void service_cache_split(const char *line, std::vector<std::string> *fields) {
+  std::string field;
+  const char *p;
+
+  fields->clear();
+  for (p = line; *p != '\0' && *p != '\n'; p++) {
+    if (*p == '\t') {
+      fields->push_back(field);
+      field.clear();
+    } else if (*p == '\\' && p[1] != '\0') {
+      p++;
+      if (*p == 't')
+        field += '\t';
+      else if (*p == 'n')
+        field += '\n';
+      else if (*p == 'r')
+        field += '\r';
+      else
+        field += *p;
+    } else {
+      field += *p;
+    }
+  }
+  fields->push_back(field);
+}
+
+/* Reads a whole line, however long, into line, without its newline. Returns
+   false at the end of the file. */
+static bool service_cache_getline(FILE *fp, std::string *line) {
+  char buf[4096];
+  size_t len;
+
+  line->clear();
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    len = strlen(buf);
+    if (len > 0 && buf[len - 1] == '\n') {
+      line->append(buf, len - 1);
+      return true;
+    }
+    line->append(buf, len);
+  }
+
+  return !line->empty();
+}
+
+void ServiceCache::load(const char *filename) {
+  std::vector<std::string> f;
+  ServiceCacheEntry entry;
+  std::string line;
+  unsigned int skipped = 0;
+  long state, tunnel;
+  char *endptr;
+  FILE *fp;
+
+  loaded = true;
+  fp = fopen(filename, "r");
+  if (fp == NULL)
+    return;
+  if (!service_cache_getline(fp, &line) || line + "\n" != SERVICE_CACHE_HEADER) {
+    error("Warning: %s is not an Nmap service cache file; ignoring it", filename);
+    fclose(fp);
+    return;
+  }
+  while (service_cache_getline(fp, &line)) {
+    service_cache_split(line.c_str(), &f);
+    if (f.size() != 19) {
+      skipped++;
+      continue;
+    }
+    /* Only the final states and tunnels that store() records are valid. */
+    state = strtol(f[6].c_str(), &endptr, 10);
+    if (f[6].empty() || *endptr != '\0'
+        || (state != PROBESTATE_FINISHED_HARDMATCHED
+            && state != PROBESTATE_FINISHED_SOFTMATCHED
+            && state != PROBESTATE_FINISHED_NOMATCH)) {
+      skipped++;
+      continue;
+    }
+    tunnel = strtol(f[7].c_str(), &endptr, 10);
+    if (f[7].empty() || *endptr != '\0'
+        || (tunnel != SERVICE_TUNNEL_NONE && tunnel != SERVICE_TUNNEL_SSL)) {
+      skipped++;
+      continue;
+    }
+    entry.resphash = strtoull(f[4].c_str(), NULL, 16);
+    entry.stored = (time_t) strtol(f[5].c_str(), NULL, 10);
+    entry.probe_state = (enum serviceprobestate) state;
+    entry.tunnel = (enum service_tunnel_type) tunnel;
+    entry.name = f[8];
+    entry.product = f[9];
+    entry.version = f[10];
+    entry.extrainfo = f[11];
+    entry.hostname = f[12];
+    entry.ostype = f[13];
+    entry.devicetype = f[14];
+    entry.cpe_a = f[15];
+    entry.cpe_h = f[16];
+    entry.cpe_o = f[17];
+    entry.fingerprint = f[18];
+    entries[f[0] + "\t" + f[1] + "\t" + f[2] + "\t" + f[3]] = entry;
+  }
+  fclose(fp);
+
+  if (skipped > 0)
+    error("Warning: skipped %u malformed entries in service cache %s", skipped, filename);
+  if (o.debugging)
+    log_write(LOG_PLAIN, "Loaded %u entries from service cache %s\n", (unsigned) entries.size(), filename);
+}
+
+/* Writes out the entries that haven't expired, to a temporary file that is
+   then renamed into place. */
+void ServiceCache::save(const char *filename) {
+  std::map<std::string, ServiceCacheEntry>::const_iterator it;
+  char tmpname[1024];
+  bool ok;
+  FILE *fp;
+
+  if (!dirty)
+    return;
+  Snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", filename, (unsigned long) getpid());
+  fp = fopen(tmpname, "w");
+  if (fp == NULL) {
+    error("Warning: could not create service cache file %s: %s", tmpname, strerror(errno));
+    return;
+  }
+  ok = fputs(SERVICE_CACHE_HEADER, fp) >= 0;
+  for (it = entries.begin(); ok && it != entries.end(); it++) {
+    const ServiceCacheEntry &e = it->second;
+    if (expired(e))
+      continue;
+    fputs(it->first.c_str(), fp);
+    fprintf(fp, "\t%016llx\t%ld\t%d\t%d", (unsigned long long) e.resphash,
+            (long) e.stored, (int) e.probe_state, (int) e.tunnel);
+    service_cache_put(fp, e.name);
+    service_cache_put(fp, e.product);
+    service_cache_put(fp, e.version);
+    service_cache_put(fp, e.extrainfo);
+    service_cache_put(fp, e.hostname);
+    service_cache_put(fp, e.ostype);
+    service_cache_put(fp, e.devicetype);
+    service_cache_put(fp, e.cpe_a);
+    service_cache_put(fp, e.cpe_h);
+    service_cache_put(fp, e.cpe_o);
+    service_cache_put(fp, e.fingerprint);
+    ok = putc('\n', fp) != EOF;
+  }
+  if (fclose(fp) != 0)
+    ok = false;
+#ifdef WIN32
+  if (ok)
+    remove(filename);
+#endif
+  if (!ok || rename(tmpname, filename) != 0) {
+    error("Warning: could not write service cache file %s: %s", filename, strerror(errno));
+    remove(tmpname);
+    return;
+  }
+  dirty = false;
+}
+
+/* If the cache has a fresh entry for this service with the same NULL probe
+   response, copies its results into svc and returns true with the final
+   probe state in *probe_state. */
+bool ServiceCache::lookup(ServiceNFO *svc, enum serviceprobestate *probe_state) const {
+  const ServiceCacheEntry *cached;
+
+  cached = get(key(svc));
+  if (cached == NULL)
+    return false;
+  const ServiceCacheEntry &e = *cached;
+  if (e.resphash != svc->nullresp_hash || expired(e))
+    return false;
+
+  svc->probe_matched = e.name.empty() ? NULL : string_pool_insert(e.name.c_str());
+  Strncpy(svc->product_matched, e.product.c_str(), sizeof(svc->product_matched));
+  Strncpy(svc->version_matched, e.version.c_str(), sizeof(svc->version_matched));
+  Strncpy(svc->extrainfo_matched, e.extrainfo.c_str(), sizeof(svc->extrainfo_matched));
+  Strncpy(svc->hostname_matched, e.hostname.c_str(), sizeof(svc->hostname_matched));
+  Strncpy(svc->ostype_matched, e.ostype.c_str(), sizeof(svc->ostype_matched));
+  Strncpy(svc->devicetype_matched, e.devicetype.c_str(), sizeof(svc->devicetype_matched));
+  Strncpy(svc->cpe_a_matched, e.cpe_a.c_str(), sizeof(svc->cpe_a_matched));
+  Strncpy(svc->cpe_h_matched, e.cpe_h.c_str(), sizeof(svc->cpe_h_matched));
+  Strncpy(svc->cpe_o_matched, e.cpe_o.c_str(), sizeof(svc->cpe_o_matched));
+  if (!e.fingerprint.empty())
+    svc->setServiceFingerprint(e.fingerprint.c_str());
+  svc->tunnel = e.tunnel;
+  svc->softMatchFound = (e.probe_state == PROBESTATE_FINISHED_SOFTMATCHED);
+  svc->from_cache = true;
+  *probe_state = e.probe_state;
+
+  return true;
+}
+
+/* Records the result of a finished service, if it got a NULL probe response
+   and its result didn't come from the cache already. */
+void ServiceCache::store(ServiceNFO *svc) {
+  ServiceCacheEntry entry;
+  const char *fp;
+
+  if (!svc->nullresp_seen || svc->from_cache)
+    return;
+  if (svc->probe_state != PROBESTATE_FINISHED_HARDMATCHED
+      && svc->probe_state != PROBESTATE_FINISHED_SOFTMATCHED
+      && svc->probe_state != PROBESTATE_FINISHED_NOMATCH)
+    return;
+
+  entry.resphash = svc->nullresp_hash;
+  entry.stored = time(NULL);
+  entry.probe_state = svc->probe_state;
+  entry.tunnel = svc->tunnel;
+  if (svc->probe_matched)
+    entry.name = svc->probe_matched;
+  entry.product = svc->product_matched;
+  entry.version = svc->version_matched;
+  entry.extrainfo = svc->extrainfo_matched;
+  entry.hostname = svc->hostname_matched;
+  entry.ostype = svc->ostype_matched;
+  entry.devicetype = svc->devicetype_matched;
+  entry.cpe_a = svc->cpe_a_matched;
+  entry.cpe_h = svc->cpe_h_matched;
+  entry.cpe_o = svc->cpe_o_matched;
+  fp = svc->getServiceFingerprint(NULL);
+  if (fp)
+    entry.fingerprint = fp;
+
+  const ServiceCacheEntry *old = get(key(svc));
+  if (svc->cache_verify && o.debugging && old != NULL
+      && old->resphash == entry.resphash
+      && (old->name != entry.name || old->product != entry.product
+          || old->version != entry.version)) {
+    log_write(LOG_PLAIN, "Service cache entry for %s:%hu was out of date\n",
+              svc->target->targetipstr(), svc->portno);
+  }
+  set(key(svc), entry);
+}
+
+const ServiceCacheEntry *ServiceCache::get(const std::string &entry_key) const {
+  std::map<std::string, ServiceCacheEntry>::const_iterator it;
+
+  it = entries.find(entry_key);
+  if (it == entries.end())
+    return NULL;
+
+  return &it->second;
+}
+
+void ServiceCache::set(const std::string &entry_key, const ServiceCacheEntry &entry) {
+  entries[entry_key] = entry;
+  dirty = true;
+}
+
+void save_service_cache() {
+  if (o.service_cache && service_cache.loaded)
+    service_cache.save(o.service_cache);
+}
+
+/* With --version-adaptive, counts how often each probe produced the hard
+   match that identified a service. Counts are kept for each port and
+   aggregated over all ports, in both cases separately for each protocol,
+   tunnel, and class of earlier response (no NULL probe response, a banner,
+   or a soft match to a given service). Later services in the same situation
+   try the probes with the most hits first; the remaining probes keep their
+   order from nmap-service-probes. Only the order changes, never which probes
+   are eligible. */
+class ProbeStats {
+public:
+  ProbeStats() : loaded(false), dirty(false) {}
+  void load(const char *filename);
+  void save(const char *filename);
+  void record(const std::string &key, const ServiceProbe *probe);
+  void order(std::vector<ServiceProbe *> &probes, const std::string &portkey,
+             const std::string &classkey) const;
+
+  bool loaded;
+private:
+  typedef std::map<std::string, unsigned int> Counts; // Probe name -> hits
+  std::map<std::string, Counts> hits;
+  bool dirty;
+};
+
+static ProbeStats probe_stats;
+
+void ProbeStats::load(const char *filename) {
+  char line[1024], key[512], name[256];
+  unsigned int count;
+  FILE *fp;
+
+  loaded = true;
+  fp = fopen(filename, "r");
+  if (fp == NULL)
+    return;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%511s %255s %u", key, name, &count) != 3)
+      continue;
+    hits[key][name] = count;
+  }
+  fclose(fp);
+}
+
+/* Writes the statistics to a temporary file and renames it into place, so
+   that concurrent scans never see a partial file. */
+void ProbeStats::save(const char *filename) {
+  std::map<std::string, Counts>::const_iterator ki;
+  Counts::const_iterator ci;
+  char tmpname[1024];
+  bool ok;
+  FILE *fp;
+
+  if (!dirty)
+    return;
+  Snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", filename, (unsigned long) getpid());
+  fp = fopen(tmpname, "w");
+  if (fp == NULL) {
+    error("Warning: could not create version probe statistics file %s: %s", tmpname, strerror(errno));
+    return;
+  }
+  ok = fprintf(fp, "# Nmap version probe statistics: key probe hits\n") >= 0;
+  for (ki = hits.begin(); ok && ki != hits.end(); ki++) {
+    for (ci = ki->second.begin(); ok && ci != ki->second.end(); ci++)
+      ok = fprintf(fp, "%s %s %u\n", ki->first.c_str(), ci->first.c_str(), ci->second) >= 0;
+  }
+  if (fclose(fp) != 0)
+    ok = false;
+#ifdef WIN32
+  if (ok)
+    remove(filename);
+#endif
+  if (!ok || rename(tmpname, filename) != 0) {
+    error("Warning: could not write version probe statistics file %s: %s", filename, strerror(errno));
+    remove(tmpname);
+    return;
+  }
+  dirty = false;
+}
+
+void ProbeStats::record(const std::string &key, const ServiceProbe *probe) {
+  hits[key][probe->getName()]++;
+  dirty = true;
+}
+
+struct probe_hits_greater {
+  const std::map<std::string, unsigned int> *port, *all;
+
+  unsigned int get(const std::map<std::string, unsigned int> *counts,
+                   const ServiceProbe *probe) const {
+    std::map<std::string, unsigned int>::const_iterator it;
+
+    if (counts == NULL)
+      return 0;
+    it = counts->find(probe->getName());
+    return it == counts->end() ? 0 : it->second;
+  }
+  bool operator()(const ServiceProbe *a, const ServiceProbe *b) const {
+    unsigned int pa = get(port, a), pb = get(port, b);
+
+    if (pa != pb)
+      return pa > pb;
+    return get(all, a) > get(all, b);
+  }
+};
+
+void ProbeStats::order(std::vector<ServiceProbe *> &probes,
+                       const std::string &portkey,
+                       const std::string &classkey) const {
+  std::map<std::string, Counts>::const_iterator it;
+  struct probe_hits_greater cmp;
+
+  it = hits.find(portkey);
+  cmp.port = (it == hits.end()) ? NULL : &it->second;
+  it = hits.find(classkey);
+  cmp.all = (it == hits.end()) ? NULL : &it->second;
+  if (cmp.port == NULL && cmp.all == NULL)
+    return;
+  std::stable_sort(probes.begin(), probes.end(), cmp);
+}
+
+void save_probe_stats() {
+  if (o.version_adaptive_stats && probe_stats.loaded)
+    probe_stats.save(o.version_adaptive_stats);
+}
+
 ServiceNFO::ServiceNFO(AllProbes *newAP) {
   target = NULL;
+  hostq = NULL;
+  in_progress = false;
   probe_matched = NULL;
   niod = NULL;
   probe_state = PROBESTATE_INITIAL;
@@ -1604,6 +2567,12 @@ ServiceNFO::ServiceNFO(AllProbes *newAP) {
   servicefplen = servicefpalloc = 0;
   servicefp = NULL;
   tcpwrap_possible = true;
+  nullresp_seen = false;
+  nullresp_hash = 0;
+  nullresp_tunnel = SERVICE_TUNNEL_NONE;
+  from_cache = false;
+  cache_verify = o.service_cache && o.service_cache_verify > 0
+    && (double) get_random_u32() / 0xffffffffU < o.service_cache_verify;
   memset(&currentprobe_exec_time, 0, sizeof(currentprobe_exec_time));
 }
 
@@ -1758,6 +2727,39 @@ const char *ServiceNFO::getServiceFingerprint(int *flen) {
   return servicefp;
 }
 
+void ServiceNFO::setServiceFingerprint(const char *fp) {
+  size_t len = strlen(fp);
+
+  // getServiceFingerprint() adds the terminating semi-colon back.
+  if (len > 0 && fp[len - 1] == ';')
+    len--;
+  servicefpalloc = len + 20;
+  servicefp = (char *) safe_realloc(servicefp, servicefpalloc);
+  memcpy(servicefp, fp, len);
+  servicefplen = len;
+}
+
+void ServiceNFO::orderProbes() {
+  char buf[128];
+  const char *respclass;
+
+  if (softMatchFound)
+    respclass = probe_matched;
+  else if (nullresp_seen)
+    respclass = "(banner)";
+  else
+    respclass = "(silent)";
+  Snprintf(buf, sizeof(buf), "%s/%hu/%s/%s", IPPROTO2STR(proto), portno,
+           (tunnel == SERVICE_TUNNEL_SSL) ? "ssl" : "none", respclass);
+  order_portkey = buf;
+  Snprintf(buf, sizeof(buf), "%s/*/%s/%s", IPPROTO2STR(proto),
+           (tunnel == SERVICE_TUNNEL_SSL) ? "ssl" : "none", respclass);
+  order_classkey = buf;
+
+  probe_order = AP->probes;
+  probe_stats.order(probe_order, order_portkey, order_classkey);
+}
+
 ServiceProbe *ServiceNFO::currentProbe() {
   if (probe_state == PROBESTATE_INITIAL) {
     return nextProbe(true);
@@ -1799,12 +2801,14 @@ bool dropdown = false;
    // list looking for matching probes
    probe_state = PROBESTATE_MATCHINGPROBES;
    dropdown = true;
-   current_probe = AP->probes.begin();
+   if (o.version_adaptive)
+     orderProbes();
+   current_probe = phaseProbes().begin();
  }
 
  if (probe_state == PROBESTATE_MATCHINGPROBES) {
-   if (!dropdown && current_probe != AP->probes.end()) current_probe++;
-   while (current_probe != AP->probes.end()) {
+   if (!dropdown && current_probe != phaseProbes().end()) current_probe++;
+   while (current_probe != phaseProbes().end()) {
      // For the first run, we only do probes that match this port number
      if ((proto == (*current_probe)->getProbeProtocol()) &&
          (*current_probe)->portIsProbable(tunnel, portno) &&
@@ -1819,12 +2823,14 @@ bool dropdown = false;
    // Tried all MATCHINGPROBES -- now we must move to nonmatching
    probe_state = PROBESTATE_NONMATCHINGPROBES;
    dropdown = true;
-   current_probe = AP->probes.begin();
+   if (o.version_adaptive)
+     orderProbes();
+   current_probe = phaseProbes().begin();
  }
 
  if (probe_state == PROBESTATE_NONMATCHINGPROBES) {
-   if (!dropdown && current_probe != AP->probes.end()) current_probe++;
-   while (current_probe != AP->probes.end()) {
+   if (!dropdown && current_probe != phaseProbes().end()) current_probe++;
+   while (current_probe != phaseProbes().end()) {
      // The protocol must be right, it must be a nonmatching port ('cause we did those),
      // and we better either have no soft match yet, or the soft service match must
      // be available via this probe. Also, the Probe's rarity must be <= to our
@@ -1914,40 +2920,46 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   ServiceNFO *svc;
   Port *nxtport;
   Port port;
+  ServiceHostQueue *hostq;
   int desired_par;
   struct timeval now;
   num_hosts_timedout = 0;
+  num_remaining = 0;
+  responses_tested = 0;
+  match_usec = 0;
   gettimeofday(&now, NULL);
 
   for(targetno = 0 ; targetno < Targets.size(); targetno++) {
-    nxtport = NULL;
     if (Targets[targetno]->timedOut(&now)) {
       num_hosts_timedout++;
       continue;
     }
-    while((nxtport = Targets[targetno]->ports.nextPort(nxtport, &port, TCPANDUDPANDSCTP, PORT_OPEN))) {
+    hostq = new ServiceHostQueue();
+    hostq->target = Targets[targetno];
+    hostq->ready[0] = hostq->ready[1] = false;
+    hostq->in_progress = 0;
+    hosts.push_back(hostq);
+
+    /* The PORT_OPENFILTERED ports go in a tier of their own so that we try
+       all the known open ports first before bothering with this speculative
+       stuff */
+    nxtport = NULL;
+    while((nxtport = hostq->target->ports.nextPort(nxtport, &port, TCPANDUDPANDSCTP, PORT_OPEN))) {
       svc = new ServiceNFO(AP);
-      svc->target = Targets[targetno];
+      svc->target = hostq->target;
+      svc->hostq = hostq;
       svc->portno = nxtport->portno;
       svc->proto = nxtport->proto;
-      services_remaining.push_back(svc);
+      addRemaining(svc, 0);
     }
-  }
-
-  /* Use a whole new loop for PORT_OPENFILTERED so that we try all the
-     known open ports first before bothering with this speculative
-     stuff */
-  for(targetno = 0 ; targetno < Targets.size(); targetno++) {
     nxtport = NULL;
-    if (Targets[targetno]->timedOut(&now)) {
-      continue;
-    }
-    while((nxtport = Targets[targetno]->ports.nextPort(nxtport, &port, TCPANDUDPANDSCTP, PORT_OPENFILTERED))) {
+    while((nxtport = hostq->target->ports.nextPort(nxtport, &port, TCPANDUDPANDSCTP, PORT_OPENFILTERED))) {
       svc = new ServiceNFO(AP);
-      svc->target = Targets[targetno];
+      svc->target = hostq->target;
+      svc->hostq = hostq;
       svc->portno = nxtport->portno;
       svc->proto = nxtport->proto;
-      services_remaining.push_back(svc);
+      addRemaining(svc, 1);
     }
   }
 
@@ -1965,6 +2977,8 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
 
 ServiceGroup::~ServiceGroup() {
   std::list<ServiceNFO *>::iterator i;
+  std::vector<ServiceHostQueue *>::iterator h;
+  int tier;
 
   for(i = services_finished.begin(); i != services_finished.end(); i++)
     delete *i;
@@ -1972,12 +2986,72 @@ ServiceGroup::~ServiceGroup() {
   for(i = services_in_progress.begin(); i != services_in_progress.end(); i++)
     delete *i;
 
-  for(i = services_remaining.begin(); i != services_remaining.end(); i++)
-    delete *i;
+  for(h = hosts.begin(); h != hosts.end(); h++) {
+    for (tier = 0; tier < 2; tier++) {
+      for(i = (*h)->remaining[tier].begin(); i != (*h)->remaining[tier].end(); i++)
+        delete *i;
+    }
+    delete *h;
+  }
 
   delete SPM;
 }
 
+void ServiceGroup::addRemaining(ServiceNFO *svc, int tier) {
+  ServiceHostQueue *hostq = svc->hostq;
+
+  hostq->remaining[tier].push_back(svc);
+  num_remaining++;
+  if (!hostq->ready[tier]) {
+    ready_hosts[tier].push_back(hostq);
+    hostq->ready[tier] = true;
+  }
+}
+
+ServiceNFO *ServiceGroup::nextRemaining() {
+  ServiceHostQueue *hostq;
+  ServiceNFO *svc;
+  int tier;
+
+  for (tier = 0; tier < 2; tier++) {
+    while (!ready_hosts[tier].empty()) {
+      hostq = ready_hosts[tier].front();
+      ready_hosts[tier].pop_front();
+      // A host's queue may have been emptied behind our back (see
+      // remove_excluded_ports); it just drops out of the rotation here.
+      if (hostq->remaining[tier].empty()) {
+        hostq->ready[tier] = false;
+        continue;
+      }
+      svc = hostq->remaining[tier].front();
+      hostq->remaining[tier].pop_front();
+      num_remaining--;
+      if (hostq->remaining[tier].empty())
+        hostq->ready[tier] = false;
+      else
+        ready_hosts[tier].push_back(hostq);
+      return svc;
+    }
+  }
+  return NULL;
+}
+
+void ServiceGroup::setInProgress(ServiceNFO *svc) {
+  assert(!svc->in_progress);
+  svc->in_progress_pos = services_in_progress.insert(services_in_progress.end(), svc);
+  svc->in_progress = true;
+  svc->hostq->in_progress++;
+}
+
+void ServiceGroup::setFinished(ServiceNFO *svc) {
+  if (svc->in_progress) {
+    services_in_progress.erase(svc->in_progress_pos);
+    svc->in_progress = false;
+    svc->hostq->in_progress--;
+  }
+  services_finished.push_back(svc);
+}
+
 /* Called if data is read for a service or a TCP connection made. Sets the port
    state to PORT_OPEN. */
 static void adjustPortStateIfNecessary(ServiceNFO *svc) {
@@ -2166,42 +3240,23 @@ static void considerPrintingStats(nsock_pool nsp, ServiceGroup *SG) {
    /* Check for status requests */
    if (keyWasPressed()) {
       nmap_adjust_loglevel(o.versionTrace());
-      SG->SPM->printStats(SG->services_finished.size() /
-                          ((double)SG->services_remaining.size() + SG->services_in_progress.size() +
-                           SG->services_finished.size()), nsock_gettimeofday());
+      SG->SPM->printStats(SG->completion(), nsock_gettimeofday());
    }
 
 
   /* Perhaps this should be made more complex, but I suppose it should be
      good enough for now. */
   if (SG->SPM->mayBePrinted(nsock_gettimeofday())) {
-    SG->SPM->printStatsIfNecessary(SG->services_finished.size() / ((double)SG->services_remaining.size() + SG->services_in_progress.size() + SG->services_finished.size()), nsock_gettimeofday());
+    SG->SPM->printStatsIfNecessary(SG->completion(), nsock_gettimeofday());
   }
 }
 
 /* Check if target is done (no more probes remaining for it in service group),
    and responds appropriately if so */
-static void handleHostIfDone(ServiceGroup *SG, Target *target) {
-  std::list<ServiceNFO *>::const_iterator svcI;
-  bool found = false;
-
-  for(svcI = SG->services_in_progress.begin();
-      svcI != SG->services_in_progress.end(); svcI++) {
-    if ((*svcI)->target == target) {
-      found = true;
-      break;
-    }
-  }
-
-  for(svcI = SG->services_remaining.begin();
-      !found && svcI != SG->services_remaining.end(); svcI++) {
-    if ((*svcI)->target == target) {
-      found = true;
-      break;
-    }
-  }
+static void handleHostIfDone(ServiceGroup *SG, ServiceHostQueue *hostq) {
+  Target *target = hostq->target;
 
-  if (!found) {
+  if (hostq->done()) {
     target->stopTimeOutClock(nsock_gettimeofday());
     if (target->timedOut(NULL)) {
       SG->num_hosts_timedout++;
@@ -2213,33 +3268,17 @@ static void handleHostIfDone(ServiceGroup *SG, Target *target) {
 // set it to the given probe_state pass NULL for nsi if you don't want
 // it to be deleted (for example, if you already have done so).
 static void end_svcprobe(nsock_pool nsp, enum serviceprobestate probe_state, ServiceGroup *SG, ServiceNFO *svc, nsock_iod nsi) {
-  std::list<ServiceNFO *>::iterator member;
-  Target *target = svc->target;
-
   svc->probe_state = svc->tcpwrap_possible ? PROBESTATE_FINISHED_TCPWRAPPED : probe_state;
-  member = find(SG->services_in_progress.begin(), SG->services_in_progress.end(),
-                  svc);
-  if (member != SG->services_in_progress.end()) {
-    assert(*member == svc);
-    SG->services_in_progress.erase(member);
-  } else {
-    /* A probe can finish from services_remaining if the host times out before the
-       probe has even started */
-    member = find(SG->services_remaining.begin(), SG->services_remaining.end(),
-                  svc);
-    assert(member != SG->services_remaining.end());
-    assert(*member == svc);
-    SG->services_remaining.erase(member);
-  }
-
-  SG->services_finished.push_back(svc);
+  /* launchSomeServiceProbes puts a service in progress before looking at it,
+     so even one that finishes before its first probe was sent is found there */
+  SG->setFinished(svc);
 
   considerPrintingStats(nsp, SG);
 
   if (nsi)
     nsock_iod_delete(nsi, NSOCK_PENDING_SILENT);
 
-  handleHostIfDone(SG, target);
+  handleHostIfDone(SG, svc->hostq);
   return;
 }
 
@@ -2254,9 +3293,9 @@ static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
   static int warn_no_scanning=1;
 
   while (SG->services_in_progress.size() < SG->ideal_parallelism &&
-         !SG->services_remaining.empty()) {
+         (svc = SG->nextRemaining()) != NULL) {
     // Start executing a probe from the new list and move it to in_progress
-    svc = SG->services_remaining.front();
+    SG->setInProgress(svc);
     if (svc->target->timedOut(nsock_gettimeofday())) {
       end_svcprobe(nsp, PROBESTATE_INCOMPLETE, SG, svc, NULL);
       continue;
@@ -2300,15 +3339,6 @@ static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
                         svc, (struct sockaddr *) &ss, ss_len,
                         svc->portno);
     }
-    // Check that the service is still where we left it.
-    // servicescan_connect_handler can call end_svcprobe before this point,
-    // putting it into services_finished already.
-    if (!SG->services_remaining.empty() && SG->services_remaining.front() == svc) {
-      // Now remove it from the remaining service list
-      SG->services_remaining.pop_front();
-      // And add it to the in progress list
-      SG->services_in_progress.push_back(svc);
-    }
   }
   return 0;
 }
@@ -2394,9 +3424,7 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
 
   // Check if a status message was requested
   if (keyWasPressed()) {
-     SG->SPM->printStats(SG->services_finished.size() /
-                         ((double)SG->services_remaining.size() + SG->services_in_progress.size() +
-                          SG->services_finished.size()), nsock_gettimeofday());
+     SG->SPM->printStats(SG->completion(), nsock_gettimeofday());
   }
 
 
@@ -2441,7 +3469,9 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
   ServiceGroup *SG = (ServiceGroup *) nsock_pool_get_udata(nsp);
   const u8 *readstr;
   int readstrlen;
+  struct MatchDetails MD_storage;
   const struct MatchDetails *MD;
+  struct timeval matchstart, matchend;
   int fallbackDepth=0;
 
   assert(type == NSE_TYPE_READ);
@@ -2458,9 +3488,38 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
     // now get the full version
     readstr = svc->getcurrentproberesponse(&readstrlen);
 
+    if (probe->isNullProbe()) {
+      svc->nullresp_seen = true;
+      svc->nullresp_tunnel = svc->tunnel;
+    }
+    if (o.service_cache && probe->isNullProbe()) {
+      enum serviceprobestate cached_state;
+
+      svc->nullresp_hash = fnv1a_64(FNV1A_64_INIT, readstr, readstrlen);
+      if (!svc->cache_verify && service_cache.lookup(svc, &cached_state)) {
+        if (o.debugging > 1 || o.versionTrace())
+          log_write(LOG_PLAIN, "Service scan cache hit: %s:%hu is %s%s\n",
+                    svc->target->targetipstr(), svc->portno,
+                    (svc->tunnel == SERVICE_TUNNEL_SSL)? "SSL/" : "",
+                    svc->probe_matched ? svc->probe_matched : "unknown");
+        end_svcprobe(nsp, cached_state, SG, svc, nsi);
+        launchSomeServiceProbes(nsp, SG);
+        return;
+      }
+    }
+
+    if (o.debugging)
+      gettimeofday(&matchstart, NULL);
     for (MD = NULL; probe->fallbacks[fallbackDepth] != NULL; fallbackDepth++) {
-      MD = (probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen);
-      if (MD && MD->serviceName) break; // Found one!
+      if ((probe->fallbacks[fallbackDepth])->testMatch(readstr, readstrlen, &MD_storage)) {
+        MD = &MD_storage;
+        break; // Found one!
+      }
+    }
+    if (o.debugging) {
+      gettimeofday(&matchend, NULL);
+      SG->responses_tested++;
+      SG->match_usec += TIMEVAL_SUBTRACT(matchend, matchstart);
     }
 
     if (MD && MD->serviceName) {
@@ -2507,6 +3566,11 @@ static void servicescan_read_handler(nsock_pool nsp, nsock_event nse, void *myda
         if (MD->cpe_o)
           Strncpy(svc->cpe_o_matched, MD->cpe_o, sizeof(svc->cpe_o_matched));
         svc->softMatchFound = MD->isSoft;
+        if (!svc->softMatchFound && o.version_adaptive
+            && !svc->order_portkey.empty() && !probe->isNullProbe()) {
+          probe_stats.record(svc->order_portkey, probe);
+          probe_stats.record(svc->order_classkey, probe);
+        }
         if (!svc->softMatchFound) {
           // We might be able to continue scan through a tunnel protocol
           // like SSL
@@ -2668,6 +3732,8 @@ static void processResults(ServiceGroup *SG) {
 std::list<ServiceNFO *>::iterator svc;
 
  for(svc = SG->services_finished.begin(); svc != SG->services_finished.end(); svc++) {
+   if (o.service_cache)
+     service_cache.store(*svc);
    if ((*svc)->probe_state != PROBESTATE_FINISHED_NOMATCH) {
      std::vector<const char *> cpe;
 
@@ -2701,34 +3767,42 @@ std::list<ServiceNFO *>::iterator svc;
 }
 
 
-// We iterate through SG->services_remaining and remove any with port/protocol
-// pairs that are excluded. We use AP->isExcluded() to determine which ports
-// are excluded.
+// We iterate through the remaining services of each host and remove any with
+// port/protocol pairs that are excluded. We use AP->isExcluded() to determine
+// which ports are excluded.
 static void remove_excluded_ports(AllProbes *AP, ServiceGroup *SG) {
+  std::vector<ServiceHostQueue *>::iterator h;
   std::list<ServiceNFO *>::iterator i, nxt;
   ServiceNFO *svc;
+  int tier;
 
-  for(i = SG->services_remaining.begin(); i != SG->services_remaining.end(); i=nxt) {
-    nxt = i;
-    nxt++;
+  for (h = SG->hosts.begin(); h != SG->hosts.end(); h++) {
+    for (tier = 0; tier < 2; tier++) {
+      std::list<ServiceNFO *> &remaining = (*h)->remaining[tier];
 
-    svc = *i;
-    if (AP->isExcluded(svc->portno, svc->proto)) {
+      for(i = remaining.begin(); i != remaining.end(); i=nxt) {
+        nxt = i;
+        nxt++;
 
-      if (o.debugging) log_write(LOG_PLAIN, "EXCLUDING %d/%s\n", svc->portno,
-          IPPROTO2STR(svc->proto));
+        svc = *i;
+        if (AP->isExcluded(svc->portno, svc->proto)) {
 
-      svc->target->ports.setServiceProbeResults(svc->portno, svc->proto,
-                                        PROBESTATE_EXCLUDED, NULL,
-                                        SERVICE_TUNNEL_NONE,
-                                        "Excluded from version scan", NULL,
-                                        NULL, NULL, NULL, NULL, NULL, NULL);
+          if (o.debugging) log_write(LOG_PLAIN, "EXCLUDING %d/%s\n", svc->portno,
+              IPPROTO2STR(svc->proto));
 
-      SG->services_remaining.erase(i);
-      SG->services_finished.push_back(svc);
+          svc->target->ports.setServiceProbeResults(svc->portno, svc->proto,
+                                            PROBESTATE_EXCLUDED, NULL,
+                                            SERVICE_TUNNEL_NONE,
+                                            "Excluded from version scan", NULL,
+                                            NULL, NULL, NULL, NULL, NULL, NULL);
+
+          remaining.erase(i);
+          SG->num_remaining--;
+          SG->setFinished(svc);
+        }
+      }
     }
   }
-
 }
 
 
@@ -2748,6 +3822,10 @@ int service_scan(std::vector<Target *> &Targets) {
     return 1;
 
   AP = AllProbes::service_scan_init();
+  if (o.service_cache && !service_cache.loaded)
+    service_cache.load(o.service_cache);
+  if (o.version_adaptive_stats && !probe_stats.loaded)
+    probe_stats.load(o.version_adaptive_stats);
 
 
   // Now I convert the targets into a new ServiceGroup
@@ -2759,7 +3837,7 @@ int service_scan(std::vector<Target *> &Targets) {
     remove_excluded_ports(AP, SG);
   }
 
-  if (SG->services_remaining.size() == 0) {
+  if (SG->num_remaining == 0) {
     delete SG;
     return 1;
   }
@@ -2773,8 +3851,8 @@ int service_scan(std::vector<Target *> &Targets) {
     } else Snprintf(targetstr, sizeof(targetstr), "%u hosts", (unsigned) Targets.size());
 
     log_write(LOG_STDOUT, "Scanning %u %s on %s\n",
-              (unsigned) SG->services_remaining.size(),
-              (SG->services_remaining.size() == 1)? "service" : "services",
+              SG->num_remaining,
+              (SG->num_remaining == 1)? "service" : "services",
               targetstr);
   }
 
@@ -2795,6 +3873,9 @@ int service_scan(std::vector<Target *> &Targets) {
 #if HAVE_OPENSSL
   /* We don't care about connection security in version detection. */
   nsock_pool_ssl_init(nsp, NSOCK_SSL_MAX_SPEED);
+  /* Resumed sessions are fine too, and save full handshakes when several
+     probes go to the same SSL service. */
+  nsock_pool_set_ssl_session_cache(nsp, 1);
 #endif
 
   launchSomeServiceProbes(nsp, SG);
@@ -2810,6 +3891,17 @@ int service_scan(std::vector<Target *> &Targets) {
     fatal("Unexpected nsock_loop error.  Error code %d (%s)", err, socket_strerror(err));
   }
 
+#if HAVE_OPENSSL
+  if (o.debugging) {
+    unsigned long ssl_hits, ssl_misses;
+
+    nsock_pool_get_ssl_session_stats(nsp, &ssl_hits, &ssl_misses);
+    if (ssl_hits + ssl_misses > 0)
+      log_write(LOG_PLAIN, "SSL handshakes during version detection: %lu resumed, %lu full\n",
+                ssl_hits, ssl_misses);
+  }
+#endif
+
   nsock_pool_delete(nsp);
 
   if (o.verbose) {
@@ -2824,6 +3916,10 @@ int service_scan(std::vector<Target *> &Targets) {
                    (SG->num_hosts_timedout == 1)? "host" : "hosts");
     SG->SPM->endTask(NULL, additional_info);
   }
+  if (o.debugging) {
+    log_write(LOG_PLAIN, "Tested %u version detection responses against match lines in %.3fs\n",
+              SG->responses_tested, SG->match_usec / 1000000.0);
+  }
 
   // Yeah - done with the service scan.  Now I go through the results
   // discovered, store the important info away, and free up everything
@@ -68,7 +68,11 @@
 
 #include "portlist.h"
 #include "scan_lists.h"
+#include "utils.h"
 
+#include <map>
+#include <set>
+#include <string>
 #include <vector>
 
 #ifdef HAVE_CONFIG_H
@@ -92,12 +96,15 @@
 #define DEFAULT_CONNECT_SSL_TIMEOUT 8000  // includes connect() + ssl negotiation
 #define SERVICEMATCH_REGEX 1
 #define MAXFALLBACKS 20 /* How many comma separated fallbacks are allowed in the service-probes file? */
+#define MATCH_PREFIX_MAX 16 /* Longest literal prefix kept for each match regex */
 
 // #define SERVICEMATCH_STATIC 2 -- no longer supported
 
 /**********************  STRUCTURES  ***********************************/
 
-// This is returned when we find a match
+// This is filled in when we find a match. The strings point into the
+// buffers at the end of the structure, so it belongs to whoever passed
+// it to testMatch() and must not be copied.
 struct MatchDetails {
 // Rather the match is a "soft" service only match, where we should
 // continue to look for a better match.
@@ -124,6 +131,15 @@ struct MatchDetails {
   const char *cpe_a;
   const char *cpe_o;
   const char *cpe_h;
+
+  // Storage for the strings above.
+  char product_buf[80];
+  char version_buf[80];
+  char info_buf[256];  /* We will truncate with ... later */
+  char hostname_buf[80];
+  char ostype_buf[32];
+  char devicetype_buf[32];
+  char cpe_a_buf[80], cpe_h_buf[80], cpe_o_buf[80];
 };
 
 /**********************  CLASSES     ***********************************/
@@ -142,19 +158,25 @@ class ServiceProbeMatch {
   void InitMatch(const char *matchtext, int lineno);
 
   // If the buf (of length buflen) match the regex in this
-  // ServiceProbeMatch, returns the details of the match (service
-  // name, version number if applicable, and whether this is a "soft"
-  // match.  If the buf doesn't match, the serviceName field in the
-  // structure will be NULL.  The MatchDetails returned is only valid
-  // until the next time this function is called.  The only exception
-  // is that the serviceName field can be saved throughout program
-  // execution.  If no version matched, that field will be NULL.
-  const struct MatchDetails *testMatch(const u8 *buf, int buflen);
+  // ServiceProbeMatch, fills in MD with the details of the match
+  // (service name, version number if applicable, and whether this is
+  // a "soft" match) and returns true.  If the buf doesn't match,
+  // returns false and the serviceName field of MD will be NULL.  The
+  // serviceName field can be saved throughout program execution.  If
+  // no version matched, that field will be NULL.  This does not modify
+  // the ServiceProbeMatch, so it may be called with different MDs
+  // concurrently.
+  bool testMatch(const u8 *buf, int buflen, struct MatchDetails *MD) const;
 // Returns the service name this matches
   const char *getName() const { return servicename; }
   // The Line number where this match string was defined.  Returns
   // -1 if unknown.
   int getLineNo() const { return deflineno; }
+  // Returns the literal bytes a response must begin with to match this
+  // regex, setting *len to their number (0 if there is no such prefix).
+  // They are compared case-insensitively if ignoreCase() is true.
+  const u8 *getPrefix(int *len) const { *len = match_prefixlen; return match_prefix; }
+  bool ignoreCase() const { return matchops_ignorecase; }
  private:
   int deflineno; // The line number where this match is defined.
   bool isInitialized; // Has InitMatch yet been called?
@@ -164,6 +186,10 @@ class ServiceProbeMatch {
   int matchstrlen; // Because static strings may have embedded NULs
   pcre *regex_compiled;
   pcre_extra *regex_extra;
+  // Literal prefix of an anchored regex, used to reject responses without
+  // running pcre_exec.
+  u8 match_prefix[MATCH_PREFIX_MAX];
+  int match_prefixlen;
   bool matchops_ignorecase;
   bool matchops_dotall;
   bool isSoft; // is this a soft match? ("softmatch" keyword in nmap-service-probes)
@@ -181,9 +207,6 @@ class ServiceProbeMatch {
   // The anchor is for SERVICESCAN_STATIC matches.  If the anchor is not -1, the match must
   // start at that zero-indexed position in the response str.
   int matchops_anchor;
-// Details to fill out and return for testMatch() calls
-  struct MatchDetails MD_return;
-
   // Use the six version templates and the match data included here
   // to put the version info into the given strings, (as long as the sizes
   // are sufficient).  Returns zero for success.  If no template is available
@@ -269,15 +292,17 @@ class ServiceProbe {
   void addMatch(const char *match, int lineno);
 
   // If the buf (of length buflen) matches one of the regexes in this
-  // ServiceProbe, returns the details of the nth match (service name,
-  // version number if applicable, and whether this is a "soft" match.
-  // If the buf doesn't match, the serviceName field in the structure
-  // will be NULL.  The MatchDetails returned is only valid until the
-  // next time this function is called.  The only exception is that the
-  // serviceName field can be saved throughout program execution.  If
-  // no version matched, that field will be NULL. This function may
-  // return NULL if there are no match lines at all in this probe.
-  const struct MatchDetails *testMatch(const u8 *buf, int buflen, int n);
+  // ServiceProbe, fills in MD with the details of the nth match
+  // (service name, version number if applicable, and whether this is a
+  // "soft" match) and returns true.  Otherwise returns false and the
+  // serviceName field of MD will be NULL.  Like
+  // ServiceProbeMatch::testMatch(), this is const and reentrant;
+  // buildMatchIndex() must have been called after the last addMatch().
+  bool testMatch(const u8 *buf, int buflen, struct MatchDetails *MD, int n = 0) const;
+
+  // Indexes the matches by the first byte of their literal prefix so that
+  // testMatch only tries those that can match a given response.
+  void buildMatchIndex();
 
   char *fallbackStr;
   ServiceProbe *fallbacks[MAXFALLBACKS+1];
@@ -292,9 +317,17 @@ class ServiceProbe {
   std::vector<u16> probableports;
   std::vector<u16> probablesslports;
   int rarity;
-  std::vector<const char *> detectedServices;
+  std::set<const char *, cstring_less> detectedServices;
   int probeprotocol;
   std::vector<ServiceProbeMatch *> matches; // first-ever use of STL in Nmap!
+  // Positions in matches of the entries whose prefix starts with byte b
+  // are match_index[match_index_start[b]] up to (but not including)
+  // match_index[match_index_start[b + 1]], in increasing order.
+  // match_index_any holds those with no prefix. Built by
+  // buildMatchIndex() and cleared by addMatch().
+  std::vector<unsigned int> match_index;
+  std::vector<unsigned int> match_index_start;
+  std::vector<unsigned int> match_index_any;
 };
 
 class AllProbes {
@@ -329,6 +362,41 @@ protected:
   static AllProbes *global_AP;
 };
 
+class ServiceNFO;
+
+/* A result kept by --service-cache, for a service that sent the banner whose
+   hash is resphash. */
+struct ServiceCacheEntry {
+  u64 resphash;
+  time_t stored;
+  enum serviceprobestate probe_state;
+  enum service_tunnel_type tunnel;
+  std::string name, product, version, extrainfo, hostname, ostype, devicetype;
+  std::string cpe_a, cpe_h, cpe_o, fingerprint;
+};
+
+/* The entries of a --service-cache file, keyed by address, protocol, port
+   and tunnel. */
+class ServiceCache {
+public:
+  ServiceCache() : loaded(false), dirty(false) {}
+  void load(const char *filename);
+  void save(const char *filename);
+  bool lookup(ServiceNFO *svc, enum serviceprobestate *probe_state) const;
+  void store(ServiceNFO *svc);
+  /* Returns the entry stored under key, or NULL if there is none. */
+  const ServiceCacheEntry *get(const std::string &entry_key) const;
+  /* Stores entry under key, replacing any earlier entry. */
+  void set(const std::string &entry_key, const ServiceCacheEntry &entry);
+
+  bool loaded;
+private:
+  static std::string key(const ServiceNFO *svc);
+  bool expired(const ServiceCacheEntry &entry) const;
+  bool dirty;
+  std::map<std::string, ServiceCacheEntry> entries;
+};
+
 /**********************  PROTOTYPES  ***********************************/
 
 /* Parses the given nmap-service-probes file into the AP class Must
@@ -340,5 +408,12 @@ void parse_nmap_service_probe_file(AllProbes *AP, const char *filename);
    Targets specified. */
 int service_scan(std::vector<Target *> &Targets);
 
+/* Writes the results gathered for --service-cache back to its file. */
+void save_service_cache();
+
+/* Writes the statistics gathered for --version-adaptive-stats back to its
+   file. */
+void save_probe_stats();
+
 #endif /* SERVICE_SCAN_H */
 
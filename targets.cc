@@ -136,16 +136,18 @@ void returnhost(HostGroupState *hs) {
 }
 
 /* Is the host passed as Target to be excluded? Much of this logic had
-   to be rewritten from wam's original code to allow for the objects */
+   to be rewritten from wam's original code to allow for the objects. If so,
+   block_end is set to the last address of the excluded block it is in. */
 static int hostInExclude(struct sockaddr *checksock, size_t checksocklen,
-                  const struct addrset *exclude_group) {
+                  const struct addrset *exclude_group,
+                  struct sockaddr_storage *block_end) {
   if (exclude_group == NULL)
     return 0;
 
   if (checksock == NULL)
     return 0;
 
-  if (addrset_contains(exclude_group,checksock))
+  if (addrset_contains_block(exclude_group, checksock, block_end))
     return 1;
   return 0;
 }
@@ -313,12 +315,64 @@ void HostGroupState::undefer() {
   this->undeferred.splice(this->undeferred.end(), this->defer_buffer);
 }
 
+/* Returns true if target expressions can be read ahead without waiting for
+   more input: they come from the command line or from a regular file, not
+   from stdin or a pipe that may still be filling. */
+static bool target_input_is_file() {
+  struct stat st;
+
+  if (o.inputfd == NULL)
+    return true;
+  if (o.inputfd == stdin || fstat(fileno(o.inputfd), &st) == -1)
+    return false;
+  return (st.st_mode & S_IFMT) == S_IFREG;
+}
+
+/* Read the next target expressions into the lookahead list. Up to
+   RESOLVE_LOOKAHEAD of them are read at a time when the parallel resolver is
+   in use, and the host names among them are resolved together, rather than
+   one at a time as each one comes up. */
+void HostGroupState::read_ahead() {
+  std::list<std::string> names;
+  std::string name;
+  const char *expr;
+  unsigned int n, remaining;
+
+  n = 1;
+  if (o.mass_dns && !o.generate_random_ips && target_input_is_file())
+    n = HostGroupState::RESOLVE_LOOKAHEAD;
+
+  /* Every expression yields at least one host, so there is no point reading
+     (and resolving) more of them than max_ips_to_scan leaves to scan. */
+  if (o.max_ips_to_scan > 0) {
+    remaining = o.max_ips_to_scan - o.numhosts_scanned - this->current_batch_sz;
+    if (remaining < n)
+      n = MAX(remaining, 1);
+  }
+
+  while (this->lookahead.size() < n) {
+    expr = grab_next_host_spec(o.inputfd, o.generate_random_ips, this->argc, this->argv);
+    if (expr == NULL)
+      break;
+    this->lookahead.push_back(expr);
+    if (target_expr_hostname(expr, o.af(), name))
+      names.push_back(name);
+  }
+
+  /* A single name gains nothing from the parallel resolver. */
+  if (names.size() > 1)
+    nmap_mass_dns(names);
+}
+
 const char *HostGroupState::next_expression() {
   if (o.max_ips_to_scan == 0 || o.numhosts_scanned + this->current_batch_sz < o.max_ips_to_scan) {
-    const char *expr;
-    expr = grab_next_host_spec(o.inputfd, o.generate_random_ips, this->argc, this->argv);
-    if (expr != NULL)
-      return expr;
+    if (this->lookahead.empty())
+      this->read_ahead();
+    if (!this->lookahead.empty()) {
+      this->current_expression = this->lookahead.front();
+      this->lookahead.pop_front();
+      return this->current_expression.c_str();
+    }
   }
 
 #ifndef NOLUA
@@ -425,7 +479,7 @@ bail:
 
 static Target *next_target(HostGroupState *hs, struct addrset *exclude_group,
   const struct scan_lists *ports, int pingtype) {
-  struct sockaddr_storage ss;
+  struct sockaddr_storage ss, block_end;
   size_t sslen;
   Target *t;
 
@@ -465,9 +519,12 @@ tryagain:
     goto tryagain;
   }
 
-  /* Check exclude list. */
-  if (hostInExclude((struct sockaddr *) &ss, sslen, exclude_group))
+  /* Check exclude list. Jump over the rest of an excluded block instead of
+     testing its addresses one by one. */
+  if (hostInExclude((struct sockaddr *) &ss, sslen, exclude_group, &block_end)) {
+    hs->current_group.skip_past(&block_end);
     goto tryagain;
+  }
 
   t = setup_target(hs, &ss, sslen, pingtype);
   if (t == NULL)
@@ -484,6 +541,7 @@ static void refresh_hostbatch(HostGroupState *hs, struct addrset *exclude_group,
   const struct scan_lists *ports, int pingtype) {
   int i;
   bool arpping_done = false;
+  bool discovery_pending = false;
   struct timeval now;
 
   hs->current_batch_sz = hs->next_batch_no = 0;
@@ -542,15 +600,25 @@ static void refresh_hostbatch(HostGroupState *hs, struct addrset *exclude_group,
   gettimeofday(&now, NULL);
   if ((o.sendpref & PACKET_SEND_ETH) &&
       hs->hostbatch[0]->ifType() == devt_ethernet) {
+    std::vector<Target *> targets;
+    targets.reserve(hs->current_batch_sz);
     for (i=0; i < hs->current_batch_sz; i++) {
       if (!(hs->hostbatch[i]->flags & HOST_DOWN) &&
           !hs->hostbatch[i]->timedOut(&now)) {
-        if (!setTargetNextHopMAC(hs->hostbatch[i])) {
+        targets.push_back(hs->hostbatch[i]);
+      }
+    }
+    if (!targets.empty()) {
+      bool *ok = (bool *) safe_malloc(targets.size() * sizeof(*ok));
+      setTargetsNextHopMAC(&targets[0], targets.size(), ok);
+      for (i=0; i < (int) targets.size(); i++) {
+        if (!ok[i]) {
           error("%s: Failed to determine dst MAC address for target %s",
-              __func__, hs->hostbatch[i]->NameIP());
-          hs->hostbatch[i]->flags = HOST_DOWN;
+              __func__, targets[i]->NameIP());
+          targets[i]->flags = HOST_DOWN;
         }
       }
+      free(ok);
     }
   }
 
@@ -566,11 +634,24 @@ static void refresh_hostbatch(HostGroupState *hs, struct addrset *exclude_group,
           hs->hostbatch[i]->reason.reason_id = ER_LOCALHOST;
       }
     }
+  } else if (!arpping_done && o.inline_discovery) {
+    /* Host discovery is done by the SYN scan itself. Presume the targets up
+       for now; the ones that never answer are dropped after that scan. */
+    for (i=0; i < hs->current_batch_sz; i++) {
+      if (!(hs->hostbatch[i]->flags & HOST_DOWN || hs->hostbatch[i]->timedOut(&now))) {
+        initialize_timeout_info(&hs->hostbatch[i]->to);
+        hs->hostbatch[i]->flags |= HOST_UP;
+        hs->hostbatch[i]->discovery_pending = true;
+      }
+    }
+    discovery_pending = true;
   } else if (!arpping_done) {
     massping(hs->hostbatch, hs->current_batch_sz, ports);
   }
 
-  if (!o.noresolve)
+  /* Names of targets still pending discovery are looked up once they are
+     found up. */
+  if (!o.noresolve && (!discovery_pending || o.always_resolve))
     nmap_mass_rdns(hs->hostbatch, hs->current_batch_sz);
 }
 
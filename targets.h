@@ -67,6 +67,7 @@
 
 #include "TargetGroup.h"
 #include <list>
+#include <string>
 #include <nbase.h>
 class Target;
 
@@ -74,6 +75,9 @@ class HostGroupState {
 public:
   /* The maximum number of entries we want to allow storing in defer_buffer. */
   static const unsigned int DEFER_LIMIT = 64;
+  /* The number of target expressions read ahead of time so that the host
+     names among them can be resolved in parallel. */
+  static const unsigned int RESOLVE_LOOKAHEAD = 512;
 
   HostGroupState(int lookahead, int randomize, int argc, const char *argv[]);
   ~HostGroupState();
@@ -98,11 +102,19 @@ public:
                     at a time to the client program */
   TargetGroup current_group; /* For batch chunking -- targets in queue */
 
+  /* Target expressions that have been read ahead but not used yet, and the one
+     last returned by next_expression. */
+  std::list<std::string> lookahead;
+  std::string current_expression;
+
   /* Returns true iff the defer buffer is not yet full. */
   bool defer(Target *t);
   void undefer();
   const char *next_expression();
   Target *next_target();
+
+private:
+  void read_ahead();
 };
 
 /* ports is used to pass information about what ports to use for host discovery */
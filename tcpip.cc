@@ -83,6 +83,9 @@
 #endif /* NETINET_IF_ETHER_H */
 #endif /* HAVE_NETINET_IF_ETHER_H */
 
+#include <map>
+#include <vector>
+
 extern NmapOps o;
 
 static PacketCounter PktCt;
@@ -1674,9 +1677,9 @@ bool setTargetNextHopMAC(Target *target) {
   return false;
 }
 
-/* Like to getTargetNextHopMAC(), but for arbitrary hosts (not Targets) */
-bool getNextHopMAC(const char *iface, const u8 *srcmac, const struct sockaddr_storage *srcss,
-                   const struct sockaddr_storage *dstss, u8 *dstmac) {
+/* Looks up dstss in the Nmap ARP cache, then in the system ARP cache. Returns
+   true and fills in dstmac if it is found in either. */
+static bool getCachedMAC(const struct sockaddr_storage *dstss, u8 *dstmac) {
   arp_t *a;
   struct arp_entry ae;
 
@@ -1695,6 +1698,97 @@ bool getNextHopMAC(const char *iface, const u8 *srcmac, const struct sockaddr_st
   }
   arp_close(a);
 
+  return false;
+}
+
+/* Does setTargetNextHopMAC() for each of the num_targets targets, storing
+   the results in ok. Next hops that are in neither the Nmap nor the system
+   ARP cache are resolved together with doArpNDBatch(), instead of waiting for
+   ARP or ND replies one host at a time. The targets should share a device
+   and source address, as the hosts in a host group do; any that don't are
+   handled by setTargetNextHopMAC(). */
+void setTargetsNextHopMAC(Target *targets[], int num_targets, bool ok[]) {
+  std::map<struct sockaddr_storage, int, lt_sockaddr_storage> hop_index;
+  std::vector<struct sockaddr_storage> hops;
+  std::vector<int> target_hop(num_targets, -1);
+  Target *first = NULL;
+  struct sockaddr_storage targetss;
+  size_t sslen;
+  u8 mac[6];
+  int i;
+
+  for (i = 0; i < num_targets; i++) {
+    Target *target = targets[i];
+
+    ok[i] = false;
+    if (target->ifType() != devt_ethernet)
+      continue;
+    if (target->NextHopMACAddress()) {
+      ok[i] = true;
+      continue;
+    }
+    if (target->directlyConnected() && target->MACAddress()) {
+      target->setNextHopMACAddress(target->MACAddress());
+      ok[i] = true;
+      continue;
+    }
+
+    if (first == NULL)
+      first = target;
+    if (strcmp(target->deviceFullName(), first->deviceFullName()) != 0
+      || memcmp(target->SrcMACAddress(), first->SrcMACAddress(), 6) != 0
+      || sockaddr_storage_cmp(target->SourceSockAddr(), first->SourceSockAddr()) != 0) {
+      ok[i] = setTargetNextHopMAC(target);
+      continue;
+    }
+
+    if (target->directlyConnected()) {
+      target->TargetSockAddr(&targetss, &sslen);
+    } else {
+      if (!target->nextHop(&targetss, &sslen))
+        fatal("%s: Failed to determine nextHop to target", __func__);
+    }
+    if (getCachedMAC(&targetss, mac)) {
+      target->setNextHopMACAddress(mac);
+      ok[i] = true;
+      continue;
+    }
+
+    std::map<struct sockaddr_storage, int, lt_sockaddr_storage>::iterator it = hop_index.find(targetss);
+    if (it == hop_index.end()) {
+      it = hop_index.insert(std::make_pair(targetss, (int) hops.size())).first;
+      hops.push_back(targetss);
+    }
+    target_hop[i] = it->second;
+  }
+
+  if (hops.empty())
+    return;
+
+  std::vector<u8> macs(hops.size() * 6);
+  bool *found = (bool *) safe_malloc(hops.size() * sizeof(*found));
+  doArpNDBatch(first->deviceFullName(), first->SrcMACAddress(), first->SourceSockAddr(),
+               &hops[0], hops.size(), &macs[0], found, o.max_packet_send_rate,
+               first->af() == AF_INET ? PacketTrace::traceArp : PacketTrace::traceND);
+  for (i = 0; i < (int) hops.size(); i++) {
+    if (found[i])
+      mac_cache_set(&hops[i], &macs[i * 6]);
+  }
+  for (i = 0; i < num_targets; i++) {
+    if (target_hop[i] != -1 && found[target_hop[i]]) {
+      targets[i]->setNextHopMACAddress(&macs[target_hop[i] * 6]);
+      ok[i] = true;
+    }
+  }
+  free(found);
+}
+
+/* Like to getTargetNextHopMAC(), but for arbitrary hosts (not Targets) */
+bool getNextHopMAC(const char *iface, const u8 *srcmac, const struct sockaddr_storage *srcss,
+                   const struct sockaddr_storage *dstss, u8 *dstmac) {
+  if (getCachedMAC(dstss, dstmac))
+    return true;
+
   /* OK, the last choice is to send our own damn ARP request (and
      retransmissions if necessary) to determine the MAC */
   if (dstss->ss_family == AF_INET) {
@@ -77,6 +77,13 @@ class Target;
 #define INET_ADDRSTRLEN 16
 #endif
 
+/* Dummy class to use sockaddr_storage as a map key. */
+struct lt_sockaddr_storage {
+  bool operator()(const struct sockaddr_storage& a, const struct sockaddr_storage& b) const {
+    return sockaddr_storage_cmp(&a, &b) < 0;
+  }
+};
+
 int nmap_raw_socket();
 
 /* Used for tracing all packets sent or received (eg the
@@ -346,6 +353,14 @@ int setTargetMACIfAvailable(Target *target, struct link_header *linkhdr,
    after an ARP scan if many directly connected machines are involved. */
 bool setTargetNextHopMAC(Target *target);
 
+/* Does setTargetNextHopMAC() for each of the num_targets targets, storing
+   the results in ok. Next hops that are in neither the Nmap nor the system
+   ARP cache are resolved together with doArpNDBatch(), instead of waiting for
+   ARP or ND replies one host at a time. The targets should share a device
+   and source address, as the hosts in a host group do; any that don't are
+   handled by setTargetNextHopMAC(). */
+void setTargetsNextHopMAC(Target *targets[], int num_targets, bool ok[]);
+
 bool getNextHopMAC(const char *iface, const u8 *srcmac, const struct sockaddr_storage *srcss,
                    const struct sockaddr_storage *dstss, u8 *dstmac);
 
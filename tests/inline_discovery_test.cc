@@ -0,0 +1,160 @@
+/***************************************************************************
+ * inline_discovery_test.cc -- Tests the probes of --inline-discovery      *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2022 Nmap Software LLC ("The Nmap *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This       *
+ * header summarizes some key points from the Nmap license, but is no      *
+ * substitute for the actual license text.                                 *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem/                                 *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.com) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem/                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "../nmap.h"
+#include "../NmapOps.h"
+#include "../Target.h"
+#include "../scan_engine.h"
+
+#include <iostream>
+#include <unistd.h>
+
+#define TEST_INCR(pred,acc) \
+if ( !(pred) ) \
+{ \
+  std::cout << "Test " << #pred << " failed at " << __FILE__ << ":" << __LINE__ << std::endl; \
+  ++acc; \
+}
+
+extern NmapOps o;
+
+int main()
+{
+  std::cout << "Testing inline discovery" << std::endl;
+
+  /* A SYN scan opens a raw socket. */
+  if (geteuid() != 0) {
+    std::cout << "Testing inline discovery skipped: not running as root" << std::endl;
+    return 0;
+  }
+
+  int ret = 0;
+  unsigned short scanned[] = { 22, 80, 443 };
+  unsigned short synping[] = { 80, 8080 };
+  struct scan_lists ports;
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+  probespec pspec;
+
+  o.inline_discovery = true;
+  o.pingtype = PINGTYPE_TCP | PINGTYPE_TCP_USE_SYN;
+
+  memset(&ports, 0, sizeof(ports));
+  ports.tcp_ports = scanned;
+  ports.tcp_count = 3;
+  ports.syn_ping_ports = synping;
+  ports.syn_ping_count = 2;
+
+  memset(&ss, 0, sizeof(ss));
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(0xc0000201); /* 192.0.2.1 */
+  Target *target = new Target();
+  target->setTargetSockAddr(&ss, sizeof(*sin));
+  target->discovery_pending = true;
+  std::vector<Target *> targets;
+  targets.push_back(target);
+
+  UltraScanInfo *USI = new UltraScanInfo(targets, &ports, SYN_SCAN);
+  HostScanStats *hss = USI->findHost(&ss);
+  TEST_INCR(hss != NULL, ret);
+
+  /* Both SYN pings are sent, but the one to the scanned port is also its
+     port probe. */
+  TEST_INCR(USI->discovery_probes.size() == 2, ret);
+  TEST_INCR(USI->discovery_syn_ports.size() == 1, ret);
+  TEST_INCR(USI->discovery_port_probes.size() == 1, ret);
+  TEST_INCR(USI->discovery_port_probes.count(80) == 1, ret);
+
+  memset(&pspec, 0, sizeof(pspec));
+  pspec.type = PS_TCP;
+  pspec.proto = IPPROTO_TCP;
+  pspec.pd.tcp.flags = TH_SYN;
+  pspec.pd.tcp.dport = 80;
+  TEST_INCR(!USI->isDiscoveryProbe(&pspec), ret);
+  pspec.pd.tcp.dport = 8080;
+  TEST_INCR(USI->isDiscoveryProbe(&pspec), ret);
+
+  if (hss != NULL) {
+    TEST_INCR(hss->discovering(), ret);
+
+    /* Port 80 is probed in turn until its SYN ping has been sent... */
+    hss->next_portidx = 1;
+    hss->next_discoveryidx = 0;
+    hss->skipDiscoveryPorts();
+    TEST_INCR(hss->next_portidx == 1, ret);
+
+    /* ...and is not probed a second time after that. */
+    hss->next_discoveryidx = 1;
+    hss->skipDiscoveryPorts();
+    TEST_INCR(hss->next_portidx == 2, ret);
+
+    hss->next_portidx = 0;
+    hss->skipDiscoveryPorts();
+    TEST_INCR(hss->next_portidx == 0, ret);
+  }
+
+  delete USI;
+  delete target;
+
+  if(ret) std::cout << "Testing inline discovery finished with errors" << std::endl;
+  else std::cout << "Testing inline discovery finished without errors" << std::endl;
+
+  return ret; // 0 means ok
+}
@@ -195,6 +195,45 @@ int main()
   DNS::PTR_Record * r = static_cast<DNS::PTR_Record *>(a->record);
   TEST_INCR(r->value == target, ret);
 
+  // A possible answer for an AAAA query for scanme.nmap.org
+  const char ipp6[] = "2600:3c01::f03c:91ff:fe18:bb2f";
+  const size_t aaaa_answere_len = 61;
+  const u8 aaaa_answere[] = { 0x5a, 0x11, // ID
+                              0x81, 0x80, // Flags
+                              0x00, 0x01, // Questions count
+                              0x00, 0x01, // Answers RRs count
+                              0x00, 0x00, // Authorities RRs count
+                              0x00, 0x00, // Additionals RRs count
+                              0x06, // Label length <-- [12]
+                              0x73, 0x63, 0x61, 0x6e, 0x6d, 0x65, // "scanme"
+                              0x04, // Label length
+                              0x6e, 0x6d, 0x61, 0x70, // "nmap"
+                              0x03, // Label length
+                              0x6f, 0x72, 0x67, // "org"
+                              0x00, // Name terminator
+                              0x00, 0x1c, // AAAA
+                              0x00, 0x01, // CLASS_IN
+                              0xc0, 0x0c, // Compressed name pointer to offset 12
+                              0x00, 0x1c, // AAAA
+                              0x00, 0x01, // CLASS_IN
+                              0x00, 0x00, 0x0e, 0x0f, // TTL 3599
+                              0x00, 0x10, // Record Length
+                              0x26, 0x00, 0x3c, 0x01, 0x00, 0x00, 0x00, 0x00,
+                              0xf0, 0x3c, 0x91, 0xff, 0xfe, 0x18, 0xbb, 0x2f };
+
+  plen = p.parseFromBuffer(aaaa_answere, aaaa_answere_len);
+  TEST_INCR(plen == aaaa_answere_len, ret);
+  TEST_INCR(p.answers.size() == 1, ret);
+
+  a = &*p.answers.begin();
+  TEST_INCR(a->name == target, ret);
+  TEST_INCR(a->record_type == DNS::AAAA, ret);
+  TEST_INCR(a->length == 16, ret);
+
+  DNS::AAAA_Record * aaaar = static_cast<DNS::AAAA_Record *>(a->record);
+  sockaddr_storage_iptop(&aaaar->value, ar_ipp);
+  TEST_INCR(!strcmp(ipp6, ar_ipp), ret);
+
   if(ret) std::cout << "Testing nmap_dns finished with errors" << std::endl;
   else std::cout << "Testing nmap_dns finished without errors" << std::endl;
 
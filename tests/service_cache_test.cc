@@ -0,0 +1,176 @@
+/***************************************************************************
+ * service_cache_test.cc -- Tests saving and loading --service-cache files *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *                                                                         *
+ * The Nmap Security Scanner is (C) 1996-2022 Nmap Software LLC ("The Nmap *
+ * Project"). Nmap is also a registered trademark of the Nmap Project.     *
+ *                                                                         *
+ * This program is distributed under the terms of the Nmap Public Source   *
+ * License (NPSL). The exact license text applying to a particular Nmap    *
+ * release or source code control revision is contained in the LICENSE     *
+ * file distributed with that version of Nmap or source code control       *
+ * revision. More Nmap copyright/legal information is available from       *
+ * https://nmap.org/book/man-legal.html, and further information on the    *
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This       *
+ * header summarizes some key points from the Nmap license, but is no      *
+ * substitute for the actual license text.                                 *
+ *                                                                         *
+ * Nmap is generally free for end users to download and use themselves,    *
+ * including commercial use. It is available from https://nmap.org.        *
+ *                                                                         *
+ * The Nmap license generally prohibits companies from using and           *
+ * redistributing Nmap in commercial products, but we sell a special Nmap  *
+ * OEM Edition with a more permissive license and special features for     *
+ * this purpose. See https://nmap.org/oem/                                 *
+ *                                                                         *
+ * If you have received a written Nmap license agreement or contract       *
+ * stating terms other than these (such as an Nmap OEM license), you may   *
+ * choose to use and redistribute Nmap under those terms instead.          *
+ *                                                                         *
+ * The official Nmap Windows builds include the Npcap software             *
+ * (https://npcap.com) for packet capture and transmission. It is under    *
+ * separate license terms which forbid redistribution without special      *
+ * permission. So the official Nmap Windows builds may not be              *
+ * redistributed without special permission (such as an Nmap OEM           *
+ * license).                                                               *
+ *                                                                         *
+ * Source is provided to this software because we believe users have a     *
+ * right to know exactly what a program is going to do before they run it. *
+ * This also allows you to audit the software for security holes.          *
+ *                                                                         *
+ * Source code also allows you to port Nmap to new platforms, fix bugs,    *
+ * and add new features.  You are highly encouraged to submit your         *
+ * changes as a Github PR or by email to the dev@nmap.org mailing list     *
+ * for possible incorporation into the main distribution. Unless you       *
+ * specify otherwise, it is understood that you are offering us very       *
+ * broad rights to use your submissions as described in the Nmap Public    *
+ * Source License Contributor Agreement. This is important because we      *
+ * fund the project by selling licenses with various terms, and also       *
+ * because the inability to relicense code has caused devastating          *
+ * problems for other Free Software projects (such as KDE and NASM).       *
+ *                                                                         *
+ * The free version of Nmap is distributed in the hope that it will be     *
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of  *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,        *
+ * indemnification and commercial support are all available through the    *
+ * Npcap OEM program--see https://nmap.org/oem/                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#include "../nmap.h"
+#include "../service_scan.h"
+
+#include <iostream>
+#include <stdio.h>
+#include <unistd.h>
+
+#define TEST_INCR(pred,acc) \
+if ( !(pred) ) \
+{ \
+  std::cout << "Test " << #pred << " failed at " << __FILE__ << ":" << __LINE__ << std::endl; \
+  ++acc; \
+}
+
+int main()
+{
+  std::cout << "Testing service cache" << std::endl;
+
+  int ret = 0;
+  char filename[64];
+  ServiceCacheEntry e;
+  const ServiceCacheEntry *l;
+  const std::string key = "192.0.2.1\ttcp\t22\t0";
+  const std::string key2 = "192.0.2.1\ttcp\t80\t1";
+
+  Snprintf(filename, sizeof(filename), "service_cache_test.%lu", (unsigned long) getpid());
+
+  e.resphash = 0x0123456789abcdefULL;
+  e.stored = time(NULL);
+  e.probe_state = PROBESTATE_FINISHED_HARDMATCHED;
+  e.tunnel = SERVICE_TUNNEL_NONE;
+  e.name = "ssh";
+  e.product = "OpenSSH";
+  e.version = "8.9p1";
+  e.extrainfo = "tab\there\r\nnewline and \\backslash";
+  e.cpe_a = "cpe:/a:openbsd:openssh:8.9p1";
+  /* Longer than any fixed line buffer, and crossing its boundaries with
+     escaped characters. */
+  for (int i = 0; i < 20000; i++)
+    e.fingerprint += (i % 7 == 0) ? "\n" : "SF:\\x";
+
+  ServiceCache saved;
+  saved.set(key, e);
+  e.name = "http";
+  e.probe_state = PROBESTATE_FINISHED_SOFTMATCHED;
+  e.tunnel = SERVICE_TUNNEL_SSL;
+  e.fingerprint.clear();
+  saved.set(key2, e);
+  saved.save(filename);
+
+  ServiceCache loaded;
+  loaded.load(filename);
+  TEST_INCR(loaded.loaded, ret);
+
+  l = loaded.get(key);
+  TEST_INCR(l != NULL, ret);
+  if (l != NULL) {
+    const ServiceCacheEntry *s = saved.get(key);
+    TEST_INCR(l->resphash == s->resphash, ret);
+    TEST_INCR(l->stored == s->stored, ret);
+    TEST_INCR(l->probe_state == s->probe_state, ret);
+    TEST_INCR(l->tunnel == s->tunnel, ret);
+    TEST_INCR(l->name == "ssh", ret);
+    TEST_INCR(l->product == s->product, ret);
+    TEST_INCR(l->version == s->version, ret);
+    TEST_INCR(l->extrainfo == s->extrainfo, ret);
+    TEST_INCR(l->hostname.empty(), ret);
+    TEST_INCR(l->cpe_a == s->cpe_a, ret);
+    TEST_INCR(l->fingerprint.size() > 65536, ret);
+    TEST_INCR(l->fingerprint == s->fingerprint, ret);
+  }
+
+  l = loaded.get(key2);
+  TEST_INCR(l != NULL, ret);
+  if (l != NULL) {
+    TEST_INCR(l->name == "http", ret);
+    TEST_INCR(l->probe_state == PROBESTATE_FINISHED_SOFTMATCHED, ret);
+    TEST_INCR(l->tunnel == SERVICE_TUNNEL_SSL, ret);
+    TEST_INCR(l->fingerprint.empty(), ret);
+  }
+
+  TEST_INCR(loaded.get("192.0.2.2\ttcp\t22\t0") == NULL, ret);
+
+  /* Entries with a state or tunnel that store() never writes are skipped. */
+  FILE *fp = fopen(filename, "w");
+  TEST_INCR(fp != NULL, ret);
+  if (fp != NULL) {
+    const char *rest = "\t\t\t\t\t\t\t\t\t\t\t";
+    fputs("# Nmap service cache 1\n", fp);
+    fprintf(fp, "192.0.2.3\ttcp\t1\t0\t0\t0\t%d\t0%s\n", PROBESTATE_FINISHED_NOMATCH, rest);
+    fprintf(fp, "192.0.2.3\ttcp\t2\t0\t0\t0\t%d\t0%s\n", PROBESTATE_INITIAL, rest);
+    fprintf(fp, "192.0.2.3\ttcp\t3\t0\t0\t0\t99\t0%s\n", rest);
+    fprintf(fp, "192.0.2.3\ttcp\t4\t0\t0\t0\t%dx\t0%s\n", PROBESTATE_FINISHED_NOMATCH, rest);
+    fprintf(fp, "192.0.2.3\ttcp\t5\t0\t0\t0\t\t0%s\n", rest);
+    fprintf(fp, "192.0.2.3\ttcp\t6\t0\t0\t0\t%d\t2%s\n", PROBESTATE_FINISHED_NOMATCH, rest);
+    fprintf(fp, "192.0.2.3\ttcp\t7\t0\t0\t0\t%d\t%s\n", PROBESTATE_FINISHED_NOMATCH, rest);
+    fclose(fp);
+
+    ServiceCache checked;
+    checked.load(filename);
+    TEST_INCR(checked.get("192.0.2.3\ttcp\t1\t0") != NULL, ret);
+    TEST_INCR(checked.get("192.0.2.3\ttcp\t2\t0") == NULL, ret);
+    TEST_INCR(checked.get("192.0.2.3\ttcp\t3\t0") == NULL, ret);
+    TEST_INCR(checked.get("192.0.2.3\ttcp\t4\t0") == NULL, ret);
+    TEST_INCR(checked.get("192.0.2.3\ttcp\t5\t0") == NULL, ret);
+    TEST_INCR(checked.get("192.0.2.3\ttcp\t6\t0") == NULL, ret);
+    TEST_INCR(checked.get("192.0.2.3\ttcp\t7\t0") == NULL, ret);
+  }
+
+  remove(filename);
+
+  if(ret) std::cout << "Testing service cache finished with errors" << std::endl;
+  else std::cout << "Testing service cache finished without errors" << std::endl;
+
+  return ret; // 0 means ok
+}
@@ -1335,13 +1335,6 @@ void TracerouteState::remove_finished_hosts() {
   }
 }
 
-/* Dummy class to use sockaddr_storage as a map key. */
-struct lt_sockaddr_storage {
-  bool operator()(const struct sockaddr_storage& a, const struct sockaddr_storage& b) const {
-    return sockaddr_storage_cmp(&a, &b) < 0;
-  }
-};
-
 /* Find the reverse-DNS names of the hops. */
 void TracerouteState::resolve_hops() {
   std::set<sockaddr_storage, lt_sockaddr_storage> addrs;
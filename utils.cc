@@ -525,6 +525,39 @@ int cpe_get_part(const char *cpe) {
 }
 
 
+/* Adds len bytes of data to a 64-bit FNV-1a hash. Start with FNV1A_64_INIT. */
+u64 fnv1a_64(u64 hash, const u8 *data, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+/* FNV-1a hash of a file's contents, used to tie a cache to the data file it
+   was built from. Returns false if the file can't be read. */
+bool hash_file(const char *filename, u64 *hash, u64 *size) {
+  unsigned char buf[8192];
+  size_t n;
+  FILE *fp;
+
+  fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return false;
+  *hash = FNV1A_64_INIT;
+  *size = 0;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    *hash = fnv1a_64(*hash, buf, n);
+    *size += n;
+  }
+  fclose(fp);
+
+  return true;
+}
+
 #ifndef WIN32
 static int open2mmap_flags(int open_flags)
 {
@@ -89,6 +89,13 @@
 
 #define MAX_PARSE_ARGS 254 /* +1 for integrity checking + 1 for null term */
 
+/* Orders C strings by their contents, for maps and sets keyed on them. */
+struct cstring_less {
+  bool operator()(const char *a, const char *b) const {
+    return strcmp(a, b) < 0;
+  }
+};
+
 /* Return num if it is between min and max.  Otherwise return min or max
    (whichever is closest to num). */
 template<class T> T box(T bmin, T bmax, T bnum) {
@@ -121,6 +128,10 @@ u8 *parse_hex_string(const char *str, size_t *outlen);
 
 int cpe_get_part(const char *cpe);
 
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
+u64 fnv1a_64(u64 hash, const u8 *data, size_t len);
+bool hash_file(const char *filename, u64 *hash, u64 *size);
+
 char *mmapfile(char *fname, s64 *length, int openflags);
 
 #ifdef WIN32